@@ -0,0 +1,124 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdint.h>
+
+constexpr int MAX_STACK = 64;
+constexpr int MAX_SLOTS = 32;
+constexpr int MAX_ARGS = 16;
+constexpr int MAX_KERNEL_LENGTH = 65536;       // Instructions up to and including RETURN
+
+/* RAND hash constants, shared by every engine so they draw alike. */
+constexpr uint32_t RAND_STEP = 0x9E3779B9;     // Added per call number
+constexpr uint32_t RAND_MIX1 = 0x7FEB352D;
+constexpr uint32_t RAND_MIX2 = 0x846CA68B;
+
+/* Type of an expression. */
+enum TypeTag {
+    I32,
+    F32,
+    BOOL,
+};
+
+/*
+ * Opcode values are stored in kernel files and sent on the wire, so new
+ * opcodes are only ever appended.
+ */
+enum OpCode {
+    /* Stack operations. */
+    PUSH_CONST,
+    LOAD_VAR,
+    STORE_VAR,
+
+    /* Mathematical operations. */
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    MOD,
+
+    /* Comparison operations. */
+    CMP_LT,
+    CMP_LTE,
+    CMP_GT,
+    CMP_GTE,
+    CMP_EQ,
+    CMP_NE,
+
+    /* Logical operations. */
+    AND,
+    OR,
+    NOT,
+
+    /* Branching operation. */
+    SELECT,
+
+    /* Random number generation operations. */
+    RAND,
+
+    /* Return operations. */
+    RETURN,
+
+    /* Column argument load. */
+    LOAD_ARG,
+
+    /* Strength reduced integer operations by 2^shift. */
+    SHL,
+    DIV_POW2,
+    MOD_POW2,
+
+    /* Superinstructions, produced by fuse_superinstructions(). */
+    SQUARE_VAR,
+    FMA,
+    CMP_SELECT_CONST,
+};
+
+constexpr int NUM_OPCODES = CMP_SELECT_CONST + 1;
+
+/* Instruction with (optional) arguments. */
+struct Instruction {
+    OpCode opcode;
+    TypeTag type;
+    union {
+        int32_t const_int;
+        float const_float;
+        bool const_bool;
+        int slot;
+        int arg;
+        int shift;
+        OpCode compare;
+    };
+};
+
+enum VMReturnType {
+    KERNEL_I32,
+    KERNEL_F32,
+    KERNEL_BOOL,
+    KERNEL_ERROR,
+};
+
+/* Aggregate a batch computes in place of its per-instance results. */
+enum ReduceOp {
+    REDUCE_SUM,
+    REDUCE_COUNT,       // Instances with a nonzero or true result, NaN counts as nonzero
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_MEAN,
+};
+
+/*
+ * Result of a reduction. f64 holds MEAN and the SUM/MIN/MAX of F32
+ * kernels, i64 everything else. BOOL results count as 0 and 1.
+ */
+union ReduceValue {
+    int64_t i64;
+    double f64;
+};
+
+/* Caller-owned column of kernel inputs, one 32-bit value per instance. */
+struct Column {
+    TypeTag type;
+    const void *data;
+};
+
+#endif
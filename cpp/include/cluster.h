@@ -0,0 +1,158 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+#include "bytecode.h"
+#include "engine.h"
+#include "tuner.h"
+#include "scheduler.h"
+
+/* Entries per ring, more than the slices of any one job a worker gets. */
+constexpr uint32_t CLUSTER_RING_SIZE = 64;
+
+/* Control messages on a worker's socket, one byte each. */
+constexpr char CLUSTER_WAKE = 'W';      // Scheduler queued tasks
+constexpr char CLUSTER_QUIT = 'Q';      // Scheduler is stopping the worker
+constexpr char CLUSTER_DONE = 'D';      // Worker queued results
+
+/*
+ * A slice of a batch job as a worker process sees it. Everything it refers
+ * to is an offset into the shared arena, so the worker reads the kernel and
+ * its columns and writes its output in place.
+ */
+struct ClusterTask {
+    uint64_t id;
+    uint64_t kernel;                // Kernel number, so workers compile each kernel once
+    uint64_t bytecode;              // Arena offset of the bytecode
+    int32_t length;
+    int32_t return_type;            // VMReturnType
+    int32_t num_inputs;
+    int32_t input_types[MAX_ARGS];  // TypeTag of each column
+    uint64_t inputs[MAX_ARGS];      // Arena offset of each column at the slice's first instance
+    uint64_t output;                // Arena offset of the slice's output
+    uint64_t count;
+    uint64_t first_instance;
+    uint64_t seed;
+};
+
+/* What a worker reports for one task. */
+struct ClusterResult {
+    uint64_t id;
+    int32_t status;                 // 0 on success, -1 on failure
+    double seconds;                 // Time spent running the slice
+};
+
+/*
+ * Single producer, single consumer ring in shared memory. The producer
+ * owns tail and the consumer owns head, each on a cache line of its own;
+ * the atomics are lock free, so they work across processes.
+ */
+template<typename T>
+struct SharedRing {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) T slots[CLUSTER_RING_SIZE];
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "ring indices must be lock free across processes");
+
+    /*
+     * Append an entry.
+     * Returns:
+     *     int - 0 on success, -1 if the ring is full.
+     */
+    int push(const T& item) {
+        uint32_t end = tail.load(std::memory_order_relaxed);
+        if(end - head.load(std::memory_order_acquire) == CLUSTER_RING_SIZE) return -1;
+
+        slots[end % CLUSTER_RING_SIZE] = item;
+        tail.store(end + 1, std::memory_order_release);
+        return 0;
+    }
+
+    /*
+     * Take the oldest entry.
+     * Returns:
+     *     int - 0 on success, -1 if the ring is empty.
+     */
+    int pop(T *item) {
+        uint32_t begin = head.load(std::memory_order_relaxed);
+        if(begin == tail.load(std::memory_order_acquire)) return -1;
+
+        *item = slots[begin % CLUSTER_RING_SIZE];
+        head.store(begin + 1, std::memory_order_release);
+        return 0;
+    }
+};
+
+/* Rings between the scheduler and one worker, at the start of the region. */
+struct ClusterChannel {
+    SharedRing<ClusterTask> tasks;
+    SharedRing<ClusterResult> results;
+};
+
+/*
+ * Scheduler side of a cluster of worker processes on this host. The
+ * cluster owns one memfd region shared with every worker: a channel per
+ * worker followed by an arena the caller allocates columns, outputs and
+ * kernels from. Only task descriptors and results cross the rings and a
+ * byte per wake up crosses the Unix sockets; column data is never copied.
+ *
+ * Each worker is a node of the scheduler's registry, so jobs are split by
+ * place_task() and the split follows the run times workers report. Workers
+ * run kernels on the engines of the host profile given to start(), fused
+ * into superinstructions by add_kernel(). A
+ * worker that dies fails the job it was running and is dropped, the rest
+ * of the cluster carries on.
+ */
+class LocalCluster {
+private:
+    struct Worker {
+        pid_t pid;
+        int socket;                 // Scheduler end of the control socket
+        int node;                   // Id in the registry
+        ClusterChannel *channel;
+    };
+
+    struct Kernel {
+        uint64_t bytecode;          // Arena offset
+        int length;
+        VMReturnType return_type;
+        KernelCost cost;
+    };
+
+    std::vector<Worker> workers;
+    std::vector<Kernel> kernels;
+    NodeRegistry registry;
+    uint8_t *region;
+    size_t region_bytes;
+    int lanes;                      // Lanes of the host's widest engine
+    size_t arena_begin;             // Region offset of the arena
+    size_t arena_used;              // Region offset of the next allocation
+    uint64_t next_task;
+
+    uint64_t offset_of(const void *data, size_t bytes) const;
+    void drop_worker(size_t index);
+
+public:
+    LocalCluster() : region(nullptr), region_bytes(0), lanes(0), arena_begin(0), arena_used(0), next_task(0) {}
+    ~LocalCluster() { stop(); }
+    LocalCluster(const LocalCluster&) = delete;
+    LocalCluster& operator=(const LocalCluster&) = delete;
+
+    int start(int num_workers, size_t arena_bytes, const char *profile = nullptr);
+    int stop();
+
+    int size() const { return (int)workers.size(); }
+    pid_t pid_of(int worker) const { return workers[worker].pid; }
+    const NodeRegistry& nodes() const { return registry; }
+
+    void *allocate(size_t bytes);
+    int add_kernel(const Instruction *bytecode, int length, VMReturnType type);
+    int run_batch(int kernel, const Column *inputs, int num_inputs, size_t n, uint64_t seed, void *output);
+};
+
+#endif
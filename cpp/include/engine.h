@@ -0,0 +1,63 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <memory>
+
+#include "bytecode.h"
+
+/* Instruction sets the VM is built for, narrowest first. */
+enum Isa {
+    ISA_SSE41,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT,
+};
+
+/* Vectors per stack slot and register each ISA build is compiled with. */
+constexpr int ENGINE_UNROLLS[] = { 1, 4 };
+constexpr int ENGINE_UNROLL_COUNT = sizeof(ENGINE_UNROLLS) / sizeof(ENGINE_UNROLLS[0]);
+
+/* Instances per lane group of the widest build, a multiple of every build's. */
+constexpr int ENGINE_MAX_WIDTH = 16 * 4;
+
+/*
+ * One ISA build of the VM behind a width independent interface. Each build
+ * of vm.cpp lives in its own namespace, so a single binary carries all of
+ * them and create_engine() picks one at run time.
+ */
+class Engine {
+public:
+    virtual ~Engine() = default;
+
+    virtual Isa isa() const = 0;
+    virtual int lanes() const = 0;
+    virtual int unroll() const = 0;
+    virtual VMReturnType return_type() const = 0;
+    virtual int share(std::unique_ptr<Engine> *engine) const = 0;
+
+    virtual int verify(int length) = 0;
+    virtual int optimize() = 0;
+    virtual int translate() = 0;
+    virtual int compile_jit() = 0;
+    virtual int run_batch(size_t n, void *output) = 0;
+    virtual int run_batch(const Column *inputs, int num_inputs, size_t n, void *output) = 0;
+    virtual int run_reduce(size_t n, ReduceOp op, ReduceValue *result) = 0;
+    virtual int run_reduce(const Column *inputs, int num_inputs, size_t n, ReduceOp op, ReduceValue *result) = 0;
+    virtual int bind_column(int index, TypeTag type, const void *data) = 0;
+    virtual void reset() = 0;
+    virtual void set_return_type(VMReturnType type) = 0;
+    virtual void seed_random(uint64_t seed) = 0;
+    virtual void set_first_instance(uint64_t index) = 0;
+};
+
+Isa detect_isa();
+Isa select_isa();
+const char *isa_name(Isa isa);
+int isa_lanes(Isa isa);
+int parse_isa(const char *name, Isa *isa);
+int create_engine(const Instruction *bytecode, Isa isa, int unroll, std::unique_ptr<Engine> *engine);
+int create_engine(const Instruction *bytecode, Isa isa, std::unique_ptr<Engine> *engine);
+int create_engine(const Instruction *bytecode, std::unique_ptr<Engine> *engine);
+
+#endif
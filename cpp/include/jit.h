@@ -0,0 +1,46 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <memory>
+
+#include "simd.h"
+#include "bytecode.h"
+#include "verifier.h"
+
+/* Deepest stack the JIT keeps in vector registers. */
+constexpr int JIT_MAX_STACK = 14;
+
+MOSAIC_ISA_BEGIN
+
+/* Everything generated code reads or writes, passed in rdi. */
+struct JitContext {
+    void *slots;                    // Variable slots, one register row each
+    const void *args[MAX_ARGS];     // Bound columns
+    size_t offset;                  // Byte offset of the lane group in each column
+    void *rng_base;                 // RAND key of the vector being run
+    void *result;
+};
+
+using JitFunction = void (*)(JitContext *context);
+
+/* Executable copy of a compiled kernel, unmapped with its last owner. */
+struct JitCode {
+    void *memory;
+    size_t size;
+    JitFunction entry;
+    int rand_calls;                 // RAND instructions in the kernel
+
+    JitCode() : memory(nullptr), size(0), entry(nullptr), rand_calls(0) {}
+    ~JitCode();
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    JitCode(JitCode&& other);
+    JitCode& operator=(JitCode&& other);
+};
+
+int jit_compile(const Instruction *bytecode, const KernelInfo& info, const int slot_base[3], std::shared_ptr<JitCode> *code);
+
+MOSAIC_ISA_END
+
+#endif
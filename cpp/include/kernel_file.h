@@ -0,0 +1,67 @@
+#ifndef KERNEL_FILE_H
+#define KERNEL_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+#include "bytecode.h"
+#include "verifier.h"
+
+constexpr uint32_t KERNEL_FILE_MAGIC = 0x4B534F4D;     // "MOSK" read little endian
+constexpr uint16_t KERNEL_FILE_VERSION = 2;
+constexpr int KERNEL_NAME_SIZE = 64;
+constexpr int KERNEL_ARG_NAME_SIZE = 32;
+constexpr uint32_t KERNEL_ARG_UNUSED = 0xFFFFFFFF;  // Type of an argument the kernel skips
+
+/* Name and type of one kernel argument, as stored in a kernel file. */
+struct KernelFileArg {
+    char name[KERNEL_ARG_NAME_SIZE];   // NUL terminated, empty when unused
+    uint32_t type;                      // TypeTag or KERNEL_ARG_UNUSED
+};
+
+/*
+ * Header of a compiled kernel file. The bytecode follows it directly as
+ * length Instructions in their in-memory layout, so a mapped file runs in
+ * place. The verifier's facts are stored alongside and must match what the
+ * verifier proves when the file is mapped. The checksum covers the header
+ * (with checksum zero) and the bytecode.
+ */
+struct KernelFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;           // Offset of the bytecode
+    uint32_t instruction_size;      // sizeof(Instruction) of the writer
+    uint32_t length;                // Instructions up to and including RETURN
+    uint32_t return_type;           // VMReturnType
+    uint32_t num_args;              // Highest argument used + 1
+    uint32_t max_stack;
+    uint32_t slot_count[3];
+    uint32_t slot_read_first[3];
+    uint32_t checksum;              // FNV-1a
+    uint32_t reserved[2];
+    char name[KERNEL_NAME_SIZE];    // NUL terminated
+    KernelFileArg args[MAX_ARGS];
+};
+
+static_assert(sizeof(KernelFileHeader) % 64 == 0, "bytecode starts on a cache line");
+
+/* A kernel file mapped read-only. The mapping lives as long as this does. */
+struct MappedKernel {
+    const KernelFileHeader *header;
+    const Instruction *bytecode;
+    size_t size;
+
+    MappedKernel() : header(nullptr), bytecode(nullptr), size(0) {}
+    ~MappedKernel();
+    MappedKernel(const MappedKernel&) = delete;
+    MappedKernel& operator=(const MappedKernel&) = delete;
+};
+
+int write_kernel_file(const char *path, const char *name, const char *const *arg_names,
+                      const Instruction *bytecode, int length, VMReturnType type);
+int map_kernel_file(const char *path, std::shared_ptr<const MappedKernel> *kernel);
+int verify_kernel_file(const KernelFileHeader& header, const Instruction *bytecode, KernelInfo *info);
+int check_kernel_columns(const KernelFileHeader& header, const Column *columns, int num_columns);
+
+#endif
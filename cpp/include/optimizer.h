@@ -0,0 +1,12 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <vector>
+
+#include "bytecode.h"
+#include "verifier.h"
+
+int optimize_bytecode(const Instruction *bytecode, const KernelInfo& info, std::vector<Instruction> *optimized);
+int fuse_superinstructions(const Instruction *bytecode, const KernelInfo& info, std::vector<Instruction> *fused, bool contract);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "bytecode.h"
+
+/* Cost units per second per core assumed for a node not yet measured. */
+constexpr double DEFAULT_THROUGHPUT = 1e9;
+
+/* Weight of a new measurement in a node's running throughput. */
+constexpr double THROUGHPUT_SMOOTHING = 0.25;
+
+/*
+ * Static cost of a kernel, in cost units. Every operation is paid once per
+ * vector and shared by its lanes, so wider nodes pay less per instance.
+ */
+struct KernelCost {
+    double vector_units;
+};
+
+/* A kernel run over a range of global instance indices. */
+struct Task {
+    uint64_t id;
+    const Instruction *bytecode;
+    int length;
+    VMReturnType return_type;
+    uint64_t first_instance;
+    uint64_t count;
+    uint64_t seed;
+};
+
+/* A compute node as the scheduler knows it. */
+struct NodeInfo {
+    int id;
+    int lanes;                  // 32-bit lanes per vector
+    int cores;
+    double throughput;          // Measured cost units per second per core, 0 if unknown
+};
+
+/* The slice of a task given to one node. */
+struct Placement {
+    int node;
+    uint64_t first_instance;
+    uint64_t count;
+    double seconds;             // Predicted run time
+};
+
+/* Nodes available for placement, with throughput learned from their runs. */
+class NodeRegistry {
+private:
+    std::vector<NodeInfo> nodes;
+    int next_id;
+
+public:
+    NodeRegistry() : next_id(0) {}
+
+    int add_node(int lanes, int cores, double throughput = 0);
+    int remove_node(int id);
+    int record_run(int id, double cost_units, double seconds);
+    const NodeInfo *find(int id) const;
+    const std::vector<NodeInfo>& list() const { return nodes; }
+};
+
+int estimate_cost(const Instruction *bytecode, int length, KernelCost *cost);
+double instance_cost(const KernelCost& cost, int lanes);
+int place_task(const Task& task, const NodeRegistry& registry, std::vector<Placement> *placements);
+
+#endif
@@ -1,7 +1,107 @@
 #ifndef SIMD_H
 #define SIMD_H
 
-#ifdef __AVX2__
+#ifdef __AVX512F__
+#include <stdint.h>
+#include <immintrin.h>
+
+#define LANES 16
+
+#define __veci __m512i
+#define __vecf __m512
+
+#define _vec_storei(target, value) _mm512_storeu_si512((void *)(target), (value))
+#define _vec_storef _mm512_storeu_ps
+#define _vec_loadi(src) _mm512_loadu_si512((const void *)(src))
+#define _vec_loadf _mm512_loadu_ps
+
+#define _vec_addi _mm512_add_epi32
+#define _vec_addf _mm512_add_ps
+#define _vec_subi _mm512_sub_epi32
+#define _vec_subf _mm512_sub_ps
+#define _vec_muli _mm512_mullo_epi32
+#define _vec_mulf _mm512_mul_ps
+#define _vec_divf _mm512_div_ps
+#define _vec_mini _mm512_min_epi32
+#define _vec_maxi _mm512_max_epi32
+#define _vec_minf _mm512_min_ps
+#define _vec_maxf _mm512_max_ps
+#define _vec_fmaddf _mm512_fmadd_ps
+
+#define _vec_castfi _mm512_castps_si512
+#define _vec_castif _mm512_castsi512_ps
+
+/* Comparisons produce k-mask registers directly. */
+#define _vec_cmplti(a, b) _mm512_cmplt_epi32_mask((a), (b))
+#define _vec_cmpltf(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LT_OQ)
+#define _vec_cmplef(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LE_OQ)
+#define _vec_cmpgtf(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ)
+#define _vec_cmpgef(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GE_OQ)
+#define _vec_cmpeqi(a, b) _mm512_cmpeq_epi32_mask((a), (b))
+#define _vec_cmpeqf(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_EQ_OQ)
+#define _vec_cmpnef(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_NEQ_OQ)
+#define _vec_cmpneuf(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_NEQ_UQ)
+
+#define _vec_andi _mm512_and_si512
+#define _vec_andf _mm512_and_ps
+#define _vec_ori _mm512_or_si512
+#define _vec_orf _mm512_or_ps
+#define _vec_xori _mm512_xor_si512
+#define _vec_andnoti _mm512_andnot_si512
+#define _vec_andnotf _mm512_andnot_ps
+
+#define _vec_sli _mm512_slli_epi32
+#define _vec_sri _mm512_srli_epi32
+#define _vec_srai _mm512_srai_epi32
+
+#define _vec_bcsti _mm512_set1_epi32
+#define _vec_bcstf _mm512_set1_ps
+
+/* Booleans are 16-bit lane masks, widened to -1/0 only for output. */
+#define __vecb __mmask16
+#define _vec_loadb(src) (*(const __mmask16 *)(src))
+#define _vec_storeb(target, value) (*(__mmask16 *)(target) = (value))
+#define _vec_bcstb(value) ((__mmask16)((value) ? 0xFFFF : 0))
+#define _vec_andb(a, b) ((__mmask16)((a) & (b)))
+#define _vec_orb(a, b) ((__mmask16)((a) | (b)))
+#define _vec_notb(a) ((__mmask16)~(a))
+#define _vec_anyb(a) ((a) != 0)
+#define _vec_blendi(mask, a, b) _mm512_mask_blend_epi32((mask), (b), (a))
+#define _vec_blendf(mask, a, b) _mm512_mask_blend_ps((mask), (b), (a))
+#define _vec_b2i(mask) _mm512_maskz_set1_epi32((mask), -1)
+#define _vec_i2b(value) _mm512_test_epi32_mask((value), (value))
+
+/* Lanes [0, n) of a group, for partial groups. */
+static inline __mmask16 _avx512_lanemask(int n) {
+    if(n >= 16) return 0xFFFF;
+    if(n <= 0) return 0;
+    return (__mmask16)((1u << n) - 1);
+}
+
+#define _vec_iota _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#define _vec_lanemask _avx512_lanemask
+#define _vec_maskloadi(src, mask) _mm512_maskz_loadu_epi32((mask), (const void *)(src))
+#define _vec_maskstorei(target, mask, value) _mm512_mask_storeu_epi32((void *)(target), (mask), (value))
+
+/* Truncating division, doubles hold every 32-bit quotient exactly. */
+static inline __m512i _avx512_div_epi32(__m512i a, __m512i b) {
+    __m512d lo = _mm512_div_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(a)), _mm512_cvtepi32_pd(_mm512_castsi512_si256(b)));
+    __m512d hi = _mm512_div_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(a, 1)), _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(b, 1)));
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvttpd_epi32(lo)), _mm512_cvttpd_epi32(hi), 1);
+}
+
+/* High 32 bits of the signed 64-bit products. */
+static inline __m512i _avx512_mulhi_epi32(__m512i a, __m512i b) {
+    __m512i even = _mm512_srli_epi64(_mm512_mul_epi32(a, b), 32);
+    __m512i odd = _mm512_mul_epi32(_mm512_srli_epi64(a, 32), _mm512_srli_epi64(b, 32));
+    return _mm512_mask_blend_epi32(0xAAAA, even, odd);
+}
+
+#define _vec_divi _avx512_div_epi32
+#define _vec_mulhii _avx512_mulhi_epi32
+
+
+#elifdef __AVX2__
 #include <immintrin.h>
 
 #define LANES 8
@@ -21,18 +121,28 @@
 #define _vec_muli _mm256_mullo_epi32
 #define _vec_mulf _mm256_mul_ps
 #define _vec_divf _mm256_div_ps
+#define _vec_mini _mm256_min_epi32
+#define _vec_maxi _mm256_max_epi32
+#define _vec_minf _mm256_min_ps
+#define _vec_maxf _mm256_max_ps
+#ifdef __FMA__
+#define _vec_fmaddf _mm256_fmadd_ps
+#else
+#define _vec_fmaddf(a, b, c) _mm256_add_ps(_mm256_mul_ps((a), (b)), (c))
+#endif
 
 #define _vec_castfi _mm256_castps_si256
 #define _vec_castif _mm256_castsi256_ps
 
 #define _vec_cmplti(a, b) _mm256_cmpgt_epi32((b), (a))
-#define _vec_cmpltf(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
-#define _vec_cmplef(a, b) _mm256_cmp_ps((a), (b), _CMP_LE_OQ)
-#define _vec_cmpgtf(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
-#define _vec_cmpgef(a, b) _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define _vec_cmpltf(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_LT_OQ))
+#define _vec_cmplef(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_LE_OQ))
+#define _vec_cmpgtf(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_GT_OQ))
+#define _vec_cmpgef(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_GE_OQ))
 #define _vec_cmpeqi _mm256_cmpeq_epi32
-#define _vec_cmpeqf(a, b) _mm256_cmp_ps((a), (b), _CMP_EQ_OQ)
-#define _vec_cmpnef(a, b) _mm256_cmp_ps((a), (b), _CMP_NEQ_OQ)
+#define _vec_cmpeqf(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_EQ_OQ))
+#define _vec_cmpnef(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_NEQ_OQ))
+#define _vec_cmpneuf(a, b) _mm256_castps_si256(_mm256_cmp_ps((a), (b), _CMP_NEQ_UQ))
 
 #define _vec_andi _mm256_and_si256
 #define _vec_andf _mm256_and_ps
@@ -44,12 +154,50 @@
 
 #define _vec_sli _mm256_slli_epi32
 #define _vec_sri _mm256_srli_epi32
+#define _vec_srai _mm256_srai_epi32
 
 #define _vec_bcsti _mm256_set1_epi32
 #define _vec_bcstf _mm256_set1_ps
 
+/* Booleans are full -1/0 lane masks in a vector. */
+#define __vecb __m256i
+#define _vec_loadb(src) _mm256_loadu_si256((__veci *)(src))
+#define _vec_storeb(target, value) _mm256_storeu_si256((__veci *)(target), (value))
+#define _vec_bcstb(value) _mm256_set1_epi32((value) ? -1 : 0)
+#define _vec_andb _mm256_and_si256
+#define _vec_orb _mm256_or_si256
+#define _vec_notb(a) _mm256_xor_si256((a), _mm256_set1_epi32(-1))
+#define _vec_anyb(a) (!_mm256_testz_si256((a), (a)))
+#define _vec_blendi(mask, a, b) _mm256_blendv_epi8((b), (a), (mask))
+#define _vec_blendf(mask, a, b) _mm256_blendv_ps((b), (a), _mm256_castsi256_ps(mask))
+#define _vec_b2i(mask) (mask)
+#define _vec_i2b(value) _mm256_xor_si256(_mm256_cmpeq_epi32((value), _mm256_setzero_si256()), _mm256_set1_epi32(-1))
+
+#define _vec_iota _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+#define _vec_lanemask(n) _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _vec_iota)
+#define _vec_maskloadi(src, mask) _mm256_maskload_epi32((const int *)(src), (mask))
+#define _vec_maskstorei(target, mask, value) _mm256_maskstore_epi32((int *)(target), (mask), (value))
+
+/* Truncating division, doubles hold every 32-bit quotient exactly. */
+static inline __m256i _avx_div_epi32(__m256i a, __m256i b) {
+    __m256d lo = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)), _mm256_cvtepi32_pd(_mm256_castsi256_si128(b)));
+    __m256d hi = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)), _mm256_cvtepi32_pd(_mm256_extracti128_si256(b, 1)));
+    return _mm256_set_m128i(_mm256_cvttpd_epi32(hi), _mm256_cvttpd_epi32(lo));
+}
+
+/* High 32 bits of the signed 64-bit products. */
+static inline __m256i _avx_mulhi_epi32(__m256i a, __m256i b) {
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(a, b), 32);
+    __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+    return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+#define _vec_divi _avx_div_epi32
+#define _vec_mulhii _avx_mulhi_epi32
+
 
 #elifdef __SSE4_1__
+#include <stdint.h>
 #include <smmintrin.h>
 
 #define LANES 4
@@ -69,18 +217,24 @@
 #define _vec_muli _mm_mullo_epi32
 #define _vec_mulf _mm_mul_ps
 #define _vec_divf _mm_div_ps
+#define _vec_mini _mm_min_epi32
+#define _vec_maxi _mm_max_epi32
+#define _vec_minf _mm_min_ps
+#define _vec_maxf _mm_max_ps
+#define _vec_fmaddf(a, b, c) _mm_add_ps(_mm_mul_ps((a), (b)), (c))
 
 #define _vec_castfi _mm_castps_si128
 #define _vec_castif _mm_castsi128_ps
 
 #define _vec_cmplti _mm_cmplt_epi32
-#define _vec_cmpltf _mm_cmplt_ps
-#define _vec_cmplef _mm_cmple_ps
-#define _vec_cmpgtf _mm_cmpgt_ps
-#define _vec_cmpgef _mm_cmpge_ps
+#define _vec_cmpltf(a, b) _mm_castps_si128(_mm_cmplt_ps((a), (b)))
+#define _vec_cmplef(a, b) _mm_castps_si128(_mm_cmple_ps((a), (b)))
+#define _vec_cmpgtf(a, b) _mm_castps_si128(_mm_cmpgt_ps((a), (b)))
+#define _vec_cmpgef(a, b) _mm_castps_si128(_mm_cmpge_ps((a), (b)))
 #define _vec_cmpeqi _mm_cmpeq_epi32
-#define _vec_cmpeqf _mm_cmpeq_ps
-#define _vec_cmpnef _mm_cmpneq_ps
+#define _vec_cmpeqf(a, b) _mm_castps_si128(_mm_cmpeq_ps((a), (b)))
+#define _vec_cmpnef(a, b) _mm_castps_si128(_mm_cmpneq_ps((a), (b)))
+#define _vec_cmpneuf(a, b) _mm_castps_si128(_mm_cmpneq_ps((a), (b)))   // cmpneqps is unordered
 
 #define _vec_andi _mm_and_si128
 #define _vec_andf _mm_and_ps
@@ -92,12 +246,96 @@
 
 #define _vec_sli _mm_slli_epi32
 #define _vec_sri _mm_srli_epi32
+#define _vec_srai _mm_srai_epi32
 
 #define _vec_bcsti _mm_set1_epi32
 #define _vec_bcstf _mm_set1_ps
 
+/* SSE4.1 has no masked load/store, emulate them lane by lane. */
+static inline __m128i _sse_maskload_epi32(const void *src, __m128i mask) {
+    alignas(16) int32_t m[4];
+    alignas(16) int32_t v[4] = { 0, 0, 0, 0 };
+    _mm_store_si128((__m128i *)m, mask);
+    for(int i = 0; i < 4; i++) {
+        if(m[i] < 0) v[i] = ((const int32_t *)src)[i];
+    }
+    return _mm_load_si128((__m128i *)v);
+}
+
+static inline void _sse_maskstore_epi32(void *target, __m128i mask, __m128i value) {
+    alignas(16) int32_t m[4];
+    alignas(16) int32_t v[4];
+    _mm_store_si128((__m128i *)m, mask);
+    _mm_store_si128((__m128i *)v, value);
+    for(int i = 0; i < 4; i++) {
+        if(m[i] < 0) ((int32_t *)target)[i] = v[i];
+    }
+}
+
+/* Booleans are full -1/0 lane masks in a vector. */
+#define __vecb __m128i
+#define _vec_loadb(src) _mm_loadu_si128((__veci *)(src))
+#define _vec_storeb(target, value) _mm_storeu_si128((__veci *)(target), (value))
+#define _vec_bcstb(value) _mm_set1_epi32((value) ? -1 : 0)
+#define _vec_andb _mm_and_si128
+#define _vec_orb _mm_or_si128
+#define _vec_notb(a) _mm_xor_si128((a), _mm_set1_epi32(-1))
+#define _vec_anyb(a) (!_mm_testz_si128((a), (a)))
+#define _vec_blendi(mask, a, b) _mm_blendv_epi8((b), (a), (mask))
+#define _vec_blendf(mask, a, b) _mm_blendv_ps((b), (a), _mm_castsi128_ps(mask))
+#define _vec_b2i(mask) (mask)
+#define _vec_i2b(value) _mm_xor_si128(_mm_cmpeq_epi32((value), _mm_setzero_si128()), _mm_set1_epi32(-1))
+
+#define _vec_iota _mm_setr_epi32(0, 1, 2, 3)
+#define _vec_lanemask(n) _mm_cmpgt_epi32(_mm_set1_epi32(n), _vec_iota)
+#define _vec_maskloadi _sse_maskload_epi32
+#define _vec_maskstorei _sse_maskstore_epi32
+
+/* Truncating division, doubles hold every 32-bit quotient exactly. */
+static inline __m128i _sse_div_epi32(__m128i a, __m128i b) {
+    __m128d lo = _mm_div_pd(_mm_cvtepi32_pd(a), _mm_cvtepi32_pd(b));
+    __m128d hi = _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(a, 0xEE)), _mm_cvtepi32_pd(_mm_shuffle_epi32(b, 0xEE)));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+/* High 32 bits of the signed 64-bit products. */
+static inline __m128i _sse_mulhi_epi32(__m128i a, __m128i b) {
+    __m128i even = _mm_srli_epi64(_mm_mul_epi32(a, b), 32);
+    __m128i odd = _mm_mul_epi32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_blend_epi16(even, odd, 0xCC);
+}
+
+#define _vec_divi _sse_div_epi32
+#define _vec_mulhii _sse_mulhi_epi32
+
 #else
 #error "SIMD requires at least SSE4.1"
 #endif
 
+/*
+ * Vectors the VM carries per stack slot and register. Every instruction
+ * works on UNROLL independent vectors back to back, spreading the dispatch
+ * cost over WIDTH lanes and giving the core independent work to overlap.
+ * Tune per host with -DMOSAIC_UNROLL=k.
+ */
+#ifndef MOSAIC_UNROLL
+#define MOSAIC_UNROLL 1
+#endif
+
+#define UNROLL MOSAIC_UNROLL
+#define WIDTH (LANES * UNROLL)
+
+/*
+ * Multi-ISA builds compile the VM once per instruction set into one binary,
+ * each copy in its own namespace named by -DMOSAIC_ISA_NAMESPACE=name.
+ * Everything whose layout or code depends on LANES goes between these.
+ */
+#ifdef MOSAIC_ISA_NAMESPACE
+#define MOSAIC_ISA_BEGIN namespace MOSAIC_ISA_NAMESPACE {
+#define MOSAIC_ISA_END }
+#else
+#define MOSAIC_ISA_BEGIN
+#define MOSAIC_ISA_END
+#endif
+
 #endif
\ No newline at end of file
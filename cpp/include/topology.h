@@ -0,0 +1,18 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stddef.h>
+#include <vector>
+
+/* CPUs this process may run on, grouped by NUMA node. */
+struct Topology {
+    std::vector<std::vector<int>> nodes;    // CPUs of each node
+    std::vector<int> node_ids;              // Kernel number of each node, for memory binding
+};
+
+int parse_cpulist(const char *text, std::vector<int> *cpus);
+int discover_topology(Topology *topology);
+int pin_thread(int cpu);
+int bind_pages(const void *data, size_t bytes, int node_id);
+
+#endif
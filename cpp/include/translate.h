@@ -0,0 +1,99 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include <vector>
+
+#include "bytecode.h"
+#include "verifier.h"
+
+constexpr int MAX_REGS = 128;
+
+/*
+ * Typed register opcode. The operand type is part of the opcode, so each
+ * handler is written for one type and nothing is decided per lane group
+ * at run time. Paired opcodes keep the I32 form first.
+ */
+enum RegOp : uint8_t {
+    MOVE,               // dst = a
+    LOAD_COLUMN,        // dst = column arg
+    LOAD_MASK,          // dst = column arg widened to a -1/0 lane mask
+
+    ADD_I32, ADD_F32,
+    SUB_I32, SUB_F32,
+    MUL_I32, MUL_F32,
+    DIV_I32, DIV_F32,
+    MOD_I32,
+    DIV_MAGIC_I32,      // dst = a / divisors[arg]
+    MOD_MAGIC_I32,      // dst = a % divisors[arg]
+    SHL_I32,            // dst = a << arg
+    DIV_POW2_I32,       // dst = a / 2^arg
+    MOD_POW2_I32,       // dst = a % 2^arg
+
+    CMP_LT_I32, CMP_LTE_I32, CMP_GT_I32, CMP_GTE_I32, CMP_EQ_I32, CMP_NE_I32,
+    CMP_LT_F32, CMP_LTE_F32, CMP_GT_F32, CMP_GTE_F32, CMP_EQ_F32, CMP_NE_F32,
+
+    FMA_I32, FMA_F32,   // dst = a + b * c
+    AND_BOOL,
+    OR_BOOL,
+    NOT_BOOL,
+    BLEND,              // dst = a ? b : c, on the raw bits of any type
+    RAND_F32,
+    RET,                // Store a to the result
+
+    REG_OP_COUNT,
+};
+
+/*
+ * Pre-decoded three-address instruction over the register file, six
+ * bytes so a whole kernel stays in a few cache lines. Built once by
+ * translate_bytecode(). PUSH_CONST and LOAD_VAR never appear, constants
+ * and variables are registers of their own, and SQUARE_VAR and
+ * CMP_SELECT_CONST are split back into MUL and a compare and BLEND.
+ */
+struct RegInstruction {
+    RegOp op;
+    uint8_t dst;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint8_t arg;        // Column, shift or divisor index
+};
+
+static_assert(sizeof(RegInstruction) == 6, "RegInstruction is packed into six bytes");
+static_assert(MAX_REGS <= 256 && MAX_ARGS <= 256, "operands fit a byte");
+
+/*
+ * Signed division by a constant divisor as a multiply-high and shifts:
+ * q = mulhi(a, multiplier), +/- a when adjust is set, >> shift, then + 1
+ * if negative.
+ */
+struct DivMagic {
+    int32_t divisor;
+    int32_t multiplier;
+    int shift;
+    int adjust;
+};
+
+/* Constant to broadcast into a register before the kernel runs. */
+struct RegConstant {
+    uint8_t reg;
+    uint32_t bits;
+};
+
+/*
+ * Register form of a kernel. The register file holds the variable slots
+ * of each type, then the constants, then one temporary per stack level.
+ */
+struct RegProgram {
+    std::vector<RegInstruction> code;
+    std::vector<RegConstant> constants;
+    std::vector<DivMagic> divisors;
+    int slot_base[3];
+    int num_slot_regs;
+    int num_regs;
+};
+
+int div_magic(int32_t divisor, DivMagic *magic);
+int translate_bytecode(const Instruction *bytecode, const KernelInfo& info, RegProgram *program);
+
+#endif
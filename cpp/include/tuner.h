@@ -0,0 +1,50 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <memory>
+
+#include "bytecode.h"
+#include "engine.h"
+
+/* How far a kernel is prepared before it runs. */
+enum EngineMode {
+    ENGINE_STACK,       // Stack interpreter
+    ENGINE_REGISTER,    // Verified and translated to registers
+    ENGINE_JIT,         // Compiled to native code
+    ENGINE_MODE_COUNT,
+};
+
+/* Coarse kernel classes that tend to prefer different engines. */
+enum KernelShape {
+    SHAPE_INT,          // Integer arithmetic, compares and selects
+    SHAPE_FLOAT,        // Float arithmetic
+    SHAPE_DIVIDE,       // Integer division or modulo
+    SHAPE_RANDOM,       // Uses RAND
+    SHAPE_COUNT,
+};
+
+struct EngineConfig {
+    Isa isa;
+    int unroll;
+    EngineMode mode;
+};
+
+/* Time each configuration runs per kernel when a pool or cluster calibrates on boot. */
+constexpr double CALIBRATE_BUDGET_MS = 2.0;
+
+/* Best engine per kernel shape, measured on one host. */
+struct HostProfile {
+    Isa host;                       // Widest ISA when calibrated
+    EngineConfig best[SHAPE_COUNT];
+};
+
+KernelShape kernel_shape(const Instruction *bytecode, int length);
+int build_engine(const Instruction *bytecode, int length, VMReturnType type, const EngineConfig& config, std::unique_ptr<Engine> *engine);
+int calibrate(double budget_ms, HostProfile *profile);
+int save_profile(const char *path, const HostProfile& profile);
+int load_profile(const char *path, HostProfile *profile);
+int load_or_calibrate(const char *path, double budget_ms, HostProfile *profile);
+HostProfile default_profile();
+int create_tuned_engine(const Instruction *bytecode, int length, VMReturnType type, const HostProfile& profile, std::unique_ptr<Engine> *engine);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "bytecode.h"
+
+static_assert(MAX_SLOTS <= 32, "slot_read_first holds one bit per slot");
+
+/* Facts about a kernel proven by the verifier. */
+struct KernelInfo {
+    int length;                 // Instructions up to and including RETURN
+    int max_stack;              // Deepest stack the kernel reaches
+    int slot_count[3];          // Highest slot index + 1, per TypeTag
+    uint32_t slot_read_first[3];    // Slots loaded before any store, one bit each, per TypeTag
+    bool arg_used[MAX_ARGS];
+    TypeTag arg_types[MAX_ARGS];
+    int error_pc;               // Offending instruction when rejected
+    bool too_long;              // Rejected for having no RETURN within MAX_KERNEL_LENGTH
+};
+
+int verify_bytecode(const Instruction *bytecode, int length, VMReturnType return_type, KernelInfo *info);
+
+#endif
@@ -2,171 +2,232 @@
 #define VM_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include <memory>
+#include <vector>
 #include "simd.h"
-
-constexpr int MAX_STACK = 64;
-constexpr int MAX_SLOTS = 32;
-
-/* Type of an expression. */
-enum TypeTag {
-    I32,
-    F32,
-    BOOL,
-};
-
-/* Stack can have multiple data types. */
-union StackSlot {
-    uint32_t i32[LANES];
-    float f32[LANES];
-    int32_t b[LANES];
+#include "bytecode.h"
+#include "verifier.h"
+#include "translate.h"
+#include "jit.h"
+#include "kernel_file.h"
+
+MOSAIC_ISA_BEGIN
+
+/* One row of the frame: a stack level, a variable slot or a register. */
+union alignas(LANES * 4) StackSlot {
+    uint32_t i32[WIDTH];
+    float f32[WIDTH];
+    int32_t b[WIDTH];
 };
 
-/* Stack for execution. */
+/* Stack for execution, rows of the frame above the variable slots. */
 struct Stack {
-    StackSlot data[MAX_STACK];
+    StackSlot *data;
     int sp;
 };
 
-/* Variable slots for variable lookup. */
-struct Slots {
-    int32_t i32_slot[MAX_SLOTS][LANES];
-    float f32_slot[MAX_SLOTS][LANES];
-    uint32_t bool_slot[MAX_SLOTS][LANES];
+/* Frames come from aligned_alloc(). */
+struct FrameDeleter {
+    void operator()(StackSlot *frame) const { free(frame); }
 };
 
-enum OpCode {
-    /* Stack operations. */
-    PUSH_CONST,
-    LOAD_VAR,
-    STORE_VAR,
-
-    /* Mathematical operations. */
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    MOD,
-
-    /* Comparison operations. */
-    CMP_LT,
-    CMP_LTE,
-    CMP_GT,
-    CMP_GTE,
-    CMP_EQ,
-    CMP_NE,
+struct VMReturnValue {
+    VMReturnType type;
+    union {
+        int32_t result_int[WIDTH];
+        float result_float[WIDTH];
+        uint32_t result_bool[WIDTH];
+    };
+};
 
-    /* Logical operations. */
-    AND,
-    OR,
-    NOT,
+/*
+ * Everything derived from a kernel's bytecode: its verification, register
+ * form and native code. Once built it is only read, so one kernel can be
+ * shared by any number of ExecutionContexts on any number of threads.
+ */
+struct CompiledKernel {
+    const Instruction *bytecode;
+    std::vector<Instruction> storage;   // Owned copy, when built by compile_kernel() or optimize()
+    std::shared_ptr<const MappedKernel> file;   // Mapping the bytecode lives in, when loaded
+    VMReturnType return_type;
 
-    /* Branching operation. */
-    SELECT,
+    /* Set once the kernel passes verify_bytecode(). */
+    KernelInfo info;
+    bool verified;
 
-    /* Random number generation operations. */
-    RAND,
+    /* Register form of the kernel, used once translate() succeeds. */
+    RegProgram program;
+    bool use_registers;
 
-    /* Return operations. */
-    RETURN,
-};
+    /* Native code for full lane groups, used once compile_jit() succeeds. */
+    std::shared_ptr<JitCode> jit_code;
 
-/* Instruction with (optional) arguments. */
-struct Instruction {
-    OpCode opcode;
-    TypeTag type;
-    union {
-        int32_t const_int;
-        float const_float;
-        bool const_bool;
-        int slot;
-    };
-};
+    CompiledKernel(const Instruction *bytecode)
+        : bytecode(bytecode), return_type(KERNEL_I32), verified(false), use_registers(false) {}
 
-enum VMReturnType {
-    KERNEL_I32,
-    KERNEL_F32,
-    KERNEL_BOOL,
-    KERNEL_ERROR,
+    int verify(int length);
+    int optimize();
+    int translate();
+    int compile_jit();
+    void set_return_type(VMReturnType type);
 };
 
-struct VMReturnValue {
-    VMReturnType type;
-    union {
-        int32_t result_int[LANES];
-        float result_float[LANES];
-        uint32_t result_bool[LANES];
-    };
-};
+int compile_kernel(const Instruction *bytecode, int length, VMReturnType type, bool jit, bool optimize, bool fuse, std::shared_ptr<const CompiledKernel> *kernel);
+int load_kernel(std::shared_ptr<const MappedKernel> file, bool jit, std::shared_ptr<const CompiledKernel> *kernel);
 
-class VM {
+/*
+ * Mutable state of one run of a compiled kernel: the frame, the RNG key,
+ * the bound columns and the result. Cheap to create, one per thread.
+ */
+class ExecutionContext {
 private:
+    std::shared_ptr<const CompiledKernel> kernel;
     const Instruction *bytecode;
     int pc;
 
+    /*
+     * Cache line aligned frame sized for the kernel. Variable slots of all
+     * types come first, I32 then F32 then BOOL, followed by the stack, or by
+     * the constants and temporaries once the kernel runs in registers.
+     */
+    std::unique_ptr<StackSlot, FrameDeleter> frame;
+    int frame_rows;
+    int slot_base[3];
     Stack stack;
-    Slots slots;
 
-    uint32_t rng_seed[LANES];
-    __veci rng_state;
+    /* RAND is a hash of (seed, global instance index, call number). */
+    uint64_t rng_seed;
+    uint64_t first_instance;        // Global index of the first instance run
+    __veci rng_base[UNROLL];        // Seed and instance hashed, per lane group
+    int rand_calls;                 // RAND calls made by the current lane group
 
     VMReturnValue retval;
 
-    using OpHandler = int (VM::*)(const Instruction&);
+    /* Kernel arguments, read in place at the current batch offset. */
+    Column columns[MAX_ARGS];
+    size_t batch_offset;
+
+    __veci (*regs)[UNROLL];         // The frame viewed as registers
+    JitContext jit_context;
+
+    /* Lanes [0, active_lanes) hold real instances, the rest are padding. */
+    int active_lanes;
+
+    using OpHandler = int (ExecutionContext::*)(const Instruction&);
+
+    /* Checked handlers validate every instruction as it runs, unchecked
+     * handlers rely on the kernel having been verified up front. */
+    template<bool Checked> static const OpHandler dispatch[];
+
+    template<bool Checked> VMReturnValue& execute();
+    VMReturnValue& execute_registers();
+    VMReturnValue& execute_group();
+    int check_columns();
+    void bind_jit_context();
 
-    static const OpHandler dispatch[];
+    __veci load_column(const Column& column, int o);
+    void layout_frame();
+    StackSlot& slot(TypeTag type, int index) { return frame.get()[slot_base[type] + index]; }
+    void clear_slots();
+    void start_random();
+    __vecf next_random(int j, int call);
 
     /* Stack operations. */
-    int simd_push_const(const Instruction& instruction);
-    int simd_load_var(const Instruction& instruction);
-    int simd_store_var(const Instruction& instruction);
+    template<bool Checked> int simd_push_const(const Instruction& instruction);
+    template<bool Checked> int simd_load_var(const Instruction& instruction);
+    template<bool Checked> int simd_store_var(const Instruction& instruction);
+    template<bool Checked> int simd_load_arg(const Instruction& instruction);
 
     /* Mathematical operations. */
-    int simd_add(const Instruction& instruction);
-    int simd_sub(const Instruction& instruction);
-    int simd_mul(const Instruction& instruction);
-    int simd_div(const Instruction& instruction);
-    int simd_mod(const Instruction& instruction);
+    template<bool Checked> int simd_add(const Instruction& instruction);
+    template<bool Checked> int simd_sub(const Instruction& instruction);
+    template<bool Checked> int simd_mul(const Instruction& instruction);
+    template<bool Checked> int simd_div(const Instruction& instruction);
+    template<bool Checked> int simd_mod(const Instruction& instruction);
+    template<bool Checked> int simd_shl(const Instruction& instruction);
+    template<bool Checked> int simd_div_pow2(const Instruction& instruction);
+    template<bool Checked> int simd_mod_pow2(const Instruction& instruction);
 
     /* Comparison operations. */
-    int simd_cmp_lt(const Instruction& instruction);
-    int simd_cmp_lte(const Instruction& instruction);
-    int simd_cmp_gt(const Instruction& instruction);
-    int simd_cmp_gte(const Instruction& instruction);
-    int simd_cmp_eq(const Instruction& instruction);
-    int simd_cmp_ne(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_lt(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_lte(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_gt(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_gte(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_eq(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_ne(const Instruction& instruction);
 
     /* Logical operations. */
-    int simd_and(const Instruction& instruction);
-    int simd_or(const Instruction& instruction);
-    int simd_not(const Instruction& instruction);
+    template<bool Checked> int simd_and(const Instruction& instruction);
+    template<bool Checked> int simd_or(const Instruction& instruction);
+    template<bool Checked> int simd_not(const Instruction& instruction);
 
     /* Branching operations. */
-    int simd_select(const Instruction& instruction);
+    template<bool Checked> int simd_select(const Instruction& instruction);
 
     /* Random number generator operations. */
-    int simd_rand(const Instruction& instruction);
+    template<bool Checked> int simd_rand(const Instruction& instruction);
+
+    /* Superinstructions. */
+    template<bool Checked> int simd_square_var(const Instruction& instruction);
+    template<bool Checked> int simd_fma(const Instruction& instruction);
+    template<bool Checked> int simd_cmp_select_const(const Instruction& instruction);
 
     /* Return from the VM. */
-    int simd_return(const Instruction& instruction);
+    template<bool Checked> int simd_return(const Instruction& instruction);
 
 public:
-    VM(const Instruction *bytecode) 
-        : bytecode(bytecode), pc(0) {
+    ExecutionContext(std::shared_ptr<const CompiledKernel> kernel, uint64_t seed = 0)
+        : pc(0), frame_rows(0), rng_seed(seed), first_instance(0), rand_calls(0), batch_offset(0), active_lanes(WIDTH) {
             stack.sp = -1;
-            memset(&slots, 0, sizeof(slots));
-            memset(&retval, 0, sizeof(retval));
-            int fd = open("/dev/random", O_RDONLY);
-            read(fd, &rng_seed, sizeof(rng_seed));
-            rng_state = _vec_loadi(rng_seed);
+            memset(&columns, 0, sizeof(columns));
+            bind(std::move(kernel));
         }
-    ~VM() = default; 
 
+    void bind(std::shared_ptr<const CompiledKernel> kernel);
     VMReturnValue& run();
+    int run_batch(size_t n, void *output);
+    int run_batch(const Column *inputs, int num_inputs, size_t n, void *output);
+    int run_reduce(size_t n, ReduceOp op, ReduceValue *result);
+    int run_reduce(const Column *inputs, int num_inputs, size_t n, ReduceOp op, ReduceValue *result);
+    int bind_column(int index, TypeTag type, const void *data);
     void reset();
+    void seed_random(uint64_t seed);
+    void set_first_instance(uint64_t index);
+    size_t frame_bytes() const { return frame_rows * sizeof(StackSlot); }
+};
+
+/*
+ * A kernel and one context to run it in. The kernel is prepared in place
+ * with verify(), translate() and compile_jit(), and the context follows it.
+ */
+class VM {
+private:
+    std::shared_ptr<CompiledKernel> kernel;
+    ExecutionContext context;
+
+public:
+    VM(const Instruction *bytecode, uint64_t seed = 0)
+        : kernel(std::make_shared<CompiledKernel>(bytecode)), context(kernel, seed) {}
+
+    int verify(int length);
+    int translate();
+    int compile_jit();
     void set_return_type(VMReturnType type);
+
+    VMReturnValue& run() { return context.run(); }
+    int run_batch(size_t n, void *output) { return context.run_batch(n, output); }
+    int run_batch(const Column *inputs, int num_inputs, size_t n, void *output) { return context.run_batch(inputs, num_inputs, n, output); }
+    int run_reduce(size_t n, ReduceOp op, ReduceValue *result) { return context.run_reduce(n, op, result); }
+    int run_reduce(const Column *inputs, int num_inputs, size_t n, ReduceOp op, ReduceValue *result) { return context.run_reduce(inputs, num_inputs, n, op, result); }
+    int bind_column(int index, TypeTag type, const void *data) { return context.bind_column(index, type, data); }
+    void reset() { context.reset(); }
+    void seed_random(uint64_t seed) { context.seed_random(seed); }
+    void set_first_instance(uint64_t index) { context.set_first_instance(index); }
+    size_t frame_bytes() const { return context.frame_bytes(); }
 };
 
-#endif
\ No newline at end of file
+MOSAIC_ISA_END
+
+#endif
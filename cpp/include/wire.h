@@ -0,0 +1,108 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bytecode.h"
+
+/*
+ * Binary protocol between the scheduler and remote workers. Every frame is
+ * a WireHeader followed by length bytes of records in host byte order, so
+ * both ends must be the same host type, as with kernel files; the magic
+ * number fails on the other byte order.
+ */
+constexpr uint32_t WIRE_MAGIC = 0x5753534D;     // "MOSW"
+constexpr uint8_t WIRE_VERSION = 2;
+constexpr uint32_t WIRE_MAX_PAYLOAD = 1u << 28;
+constexpr size_t WIRE_INSTRUCTION_SIZE = 6;     // Opcode, type and a 32-bit operand
+
+enum WireType : uint8_t {
+    WIRE_KERNEL = 1,        // One kernel, sent once per connection
+    WIRE_TASKS,             // count task assignments
+    WIRE_RESULT,            // One task's status and values
+};
+
+struct WireHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;           // WireType
+    uint16_t count;         // Records in the payload
+    uint32_t length;        // Payload bytes after the header
+};
+
+static_assert(sizeof(WireHeader) == 12, "wire header layout");
+
+/* A range of a kernel to run, the kernel named by its hash. */
+struct WireTask {
+    uint64_t id;
+    uint64_t kernel;
+    uint64_t first_instance;
+    uint64_t count;
+    uint64_t seed;
+};
+
+static_assert(sizeof(WireTask) == 40, "wire task layout");
+
+/* Leads a WIRE_RESULT payload, followed by count 32-bit values. */
+struct WireResult {
+    uint64_t id;
+    uint64_t count;
+    int32_t status;         // 0 on success, -1 on failure
+    int32_t return_type;    // VMReturnType of the values
+};
+
+static_assert(sizeof(WireResult) == 24, "wire result layout");
+
+/* A kernel received over a connection. */
+struct WireKernel {
+    VMReturnType return_type;
+    std::vector<Instruction> bytecode;
+};
+
+/* One frame as receive() decodes it. */
+struct WireMessage {
+    WireType type;
+    uint64_t kernel;                // WIRE_KERNEL: hash of the kernel received
+    std::vector<WireTask> tasks;    // WIRE_TASKS
+    WireResult result;              // WIRE_RESULT
+    const void *values;             // WIRE_RESULT: the values, valid until the next receive()
+};
+
+/*
+ * One end of a stream connection. Frames are written with one vectored
+ * send straight from the caller's buffers. Each kernel crosses a
+ * connection once; tasks refer to it by hash after that.
+ */
+class WireConnection {
+private:
+    int fd;
+    std::unordered_set<uint64_t> sent;                      // Kernels the peer has
+    std::unordered_map<uint64_t, WireKernel> received;      // Kernels the peer sent
+    std::vector<uint8_t> payload;                           // Last frame received
+    uint64_t max_task_count;                                // Largest task sent, bounds the results
+
+    size_t payload_limit(const WireHeader& header) const;
+
+public:
+    explicit WireConnection(int fd) : fd(fd), max_task_count(0) {}
+    ~WireConnection();
+    WireConnection(const WireConnection&) = delete;
+    WireConnection& operator=(const WireConnection&) = delete;
+
+    int send_kernel(const Instruction *bytecode, int length, VMReturnType type, uint64_t *hash);
+    int send_tasks(const WireTask *tasks, size_t count);
+    int send_result(const WireResult& result, const void *values);
+    int receive(WireMessage *message);
+    const WireKernel *find_kernel(uint64_t hash) const;
+};
+
+uint64_t kernel_hash(const Instruction *bytecode, int length, VMReturnType type);
+int wire_listen(uint16_t port, uint16_t *bound_port);
+int wire_accept(int listener);
+int wire_connect(uint16_t port);
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "bytecode.h"
+#include "engine.h"
+#include "tuner.h"
+#include "topology.h"
+
+/*
+ * Lane groups of ENGINE_MAX_WIDTH instances per chunk unless
+ * set_chunk_groups() says otherwise. Chunks then never split a lane group
+ * of any engine.
+ */
+constexpr size_t WORKER_CHUNK_GROUPS = 16;
+
+/*
+ * A kernel run over n instances of its input columns. The engine holds the
+ * prepared kernel; workers run it on engines shared from it, so the job
+ * runs on whichever ISA build the engine was made for.
+ */
+struct BatchJob {
+    const Engine *engine;
+    const Column *inputs;           // n values each, read in place
+    int num_inputs;
+    size_t n;
+    uint64_t seed;
+    uint64_t first_instance;        // Global index of instance 0, for RAND
+};
+
+/*
+ * One worker's deque of chunks. Chunks of a job are numbered and each
+ * worker starts with a contiguous run of them, packed as begin << 32 | end
+ * in a single word. The owner takes chunks from the front and idle workers
+ * steal the back half, both with one compare and swap.
+ */
+struct alignas(64) ChunkDeque {
+    std::atomic<uint64_t> range;
+
+    int pop(uint32_t *chunk);
+    int steal(ChunkDeque& victim);
+    void assign(uint32_t begin, uint32_t end) { range.store((uint64_t)begin << 32 | end, std::memory_order_release); }
+};
+
+/*
+ * Per-core worker threads that run a batch job in chunks of lane groups,
+ * each thread in an engine of its own. Output chunks are
+ * disjoint and each thread reduces into its own partial, so nothing on the
+ * hot path takes a lock; partials are merged once the job is done.
+ *
+ * Threads are pinned to CPUs spread over the NUMA nodes and numbered node
+ * by node, so each node starts with one contiguous span of every job.
+ * Idle workers steal within their node before crossing to another.
+ *
+ * Jobs run on engines from prepare(), built for the host profile the pool
+ * booted with by tune(), or for select_isa() until then.
+ */
+class WorkerPool {
+private:
+    struct alignas(64) Worker {
+        ChunkDeque deque;
+        std::unique_ptr<Engine> context;        // Shared from the job's engine
+        ReduceValue partial;        // Reduction of the chunks this worker ran
+        bool has_partial;
+        int cpu;
+        int node;                   // Index into topology.nodes
+        std::vector<int> victims;   // Workers to steal from, same node first
+    };
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<Worker[]> workers;
+    int num_workers;
+    size_t chunk_groups;
+    Topology topology;
+    HostProfile profile;            // Engines prepare() builds
+
+    /* The job in flight and how to run it, read-only while it runs. */
+    const BatchJob *job;
+    int32_t *output;                // Batch output, or nullptr to reduce
+    uint8_t *touch;                 // Buffer to first touch instead of running a kernel
+    ReduceOp reduce_op;             // Per-chunk op, SUM for MEAN
+    size_t chunk_size;              // Instances per chunk
+    std::atomic<bool> failed;
+
+    /* Job hand-off, only touched when a job starts and ends. */
+    std::mutex submit;              // Held by the caller for a whole job
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+    uint64_t generation;
+    int running;
+    bool stopping;
+
+    void place_workers(int num_threads);
+    void thread_main(int index);
+    void work(int index);
+    int run_chunk(Worker& worker, uint32_t chunk);
+    size_t plan_chunks(size_t n, size_t *size) const;
+    int dispatch(const BatchJob& job, int32_t *output, ReduceOp op);
+
+public:
+    explicit WorkerPool(int num_threads = 0);
+    WorkerPool(int num_threads, const Topology& topology);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    int size() const { return num_workers; }
+    int cpu_of(int worker) const { return workers[worker].cpu; }
+    int node_of(int worker) const { return workers[worker].node; }
+    void set_chunk_groups(size_t groups) { chunk_groups = groups > 0 ? groups : 1; }
+    const HostProfile& host_profile() const { return profile; }
+
+    int tune(const char *path);
+    int prepare(const Instruction *bytecode, int length, VMReturnType type, std::unique_ptr<Engine> *engine) const;
+
+    int run_batch(const BatchJob& job, void *output);
+    int run_reduce(const BatchJob& job, ReduceOp op, ReduceValue *result);
+    int first_touch(void *buffer, size_t n);
+    int place_job(const BatchJob& job, void *output);
+};
+
+#endif
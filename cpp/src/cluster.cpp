@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <new>
+
+#include "cluster.h"
+#include "optimizer.h"
+#include "verifier.h"
+
+/*
+ * Run one task in a worker process, reading the columns and writing the
+ * output in the shared arena.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel fails.
+ */
+static int run_task(const ClusterTask& task, Engine& engine, uint8_t *region, double *seconds) {
+    Column columns[MAX_ARGS];
+    for(int k = 0; k < task.num_inputs; k++) {
+        columns[k].type = (TypeTag)task.input_types[k];
+        columns[k].data = region + task.inputs[k];
+    }
+
+    engine.seed_random(task.seed);
+    engine.set_first_instance(task.first_instance);
+
+    timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int status = engine.run_batch(columns, task.num_inputs, task.count, region + task.output);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9;
+    return status;
+}
+
+/*
+ * Body of a worker process: sleep on the control socket, drain the task
+ * ring when woken and answer with a byte once the results are queued. Each
+ * kernel runs on the engine the profile picked for its shape, reading the
+ * bytecode in place from the arena. The last kernel stays compiled, as
+ * consecutive jobs mostly share it.
+ */
+static void worker_main(int socket, ClusterChannel *channel, uint8_t *region, const HostProfile& profile) {
+    std::unique_ptr<Engine> engine;
+    uint64_t kernel_id = 0;
+
+    for(;;) {
+        char message;
+        if(recv(socket, &message, 1, 0) != 1 || message == CLUSTER_QUIT) return;
+
+        ClusterTask task;
+        while(channel->tasks.pop(&task) == 0) {
+            if(engine == nullptr || task.kernel != kernel_id) {
+                const Instruction *bytecode = (const Instruction *)(region + task.bytecode);
+                if(create_tuned_engine(bytecode, task.length, (VMReturnType)task.return_type, profile, &engine) < 0) engine = nullptr;
+                kernel_id = task.kernel;
+            }
+
+            ClusterResult result = { task.id, -1, 0 };
+            if(engine != nullptr) result.status = run_task(task, *engine, region, &result.seconds);
+            if(channel->results.push(result) < 0) return;
+        }
+
+        if(send(socket, &CLUSTER_DONE, 1, MSG_NOSIGNAL) != 1) return;
+    }
+}
+
+/*
+ * Map the shared region and fork the workers. The host profile is loaded,
+ * or calibrated once if missing, before the fork, so every worker boots on
+ * it without timing engines against its siblings.
+ * Arguments:
+ *     int num_workers - Worker processes to spawn.
+ *     size_t arena_bytes - Shared memory left for allocate().
+ *     const char *profile - Host profile file, nullptr to run every kernel
+ *                           on the select_isa() engine.
+ * Returns:
+ *     int - 0 on success, -1 if the cluster is running or cannot be set up.
+ */
+int LocalCluster::start(int num_workers, size_t arena_bytes, const char *profile) {
+    if(region != nullptr || num_workers <= 0) return -1;
+
+    HostProfile tuned = default_profile();
+    if(profile != nullptr && load_or_calibrate(profile, CALIBRATE_BUDGET_MS, &tuned) < 0) return -1;
+    if(tuned.host == ISA_COUNT) return -1;
+
+    size_t channel_bytes = num_workers * sizeof(ClusterChannel);
+    int fd = memfd_create("mosaic-cluster", MFD_CLOEXEC);
+    if(fd < 0) return -1;
+    if(ftruncate(fd, channel_bytes + arena_bytes) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(nullptr, channel_bytes + arena_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+
+    region = (uint8_t *)map;
+    region_bytes = channel_bytes + arena_bytes;
+    arena_begin = arena_used = channel_bytes;
+    lanes = isa_lanes(tuned.host);
+
+    for(int i = 0; i < num_workers; i++) {
+        ClusterChannel *channel = new (region + i * sizeof(ClusterChannel)) ClusterChannel();
+
+        int sockets[2];
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0) {
+            stop();
+            return -1;
+        }
+
+        pid_t pid = fork();
+        if(pid == 0) {
+            // Keep only this worker's end, so the scheduler sees a hang up when it exits
+            close(sockets[0]);
+            for(const Worker& worker : workers) close(worker.socket);
+            worker_main(sockets[1], channel, region, tuned);
+            _exit(0);
+        }
+
+        close(sockets[1]);
+        if(pid < 0) {
+            close(sockets[0]);
+            stop();
+            return -1;
+        }
+
+        workers.push_back({ pid, sockets[0], registry.add_node(lanes, 1), channel });
+    }
+
+    return 0;
+}
+
+/*
+ * Tell the workers to quit, wait for them and unmap the region.
+ * Returns:
+ *     int - 0 on success, -1 if a worker did not exit cleanly.
+ */
+int LocalCluster::stop() {
+    int status = 0;
+    for(const Worker& worker : workers) {
+        send(worker.socket, &CLUSTER_QUIT, 1, MSG_NOSIGNAL);
+        close(worker.socket);
+
+        int exit_status;
+        if(waitpid(worker.pid, &exit_status, 0) < 0 || !WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0) status = -1;
+    }
+
+    if(region != nullptr) munmap(region, region_bytes);
+    workers.clear();
+    kernels.clear();
+    registry = NodeRegistry();
+    region = nullptr;
+    region_bytes = arena_begin = arena_used = 0;
+    lanes = 0;
+    return status;
+}
+
+/*
+ * Reap a worker that failed and stop placing work on it.
+ */
+void LocalCluster::drop_worker(size_t index) {
+    Worker& worker = workers[index];
+    close(worker.socket);
+    kill(worker.pid, SIGKILL);
+    waitpid(worker.pid, nullptr, 0);
+
+    registry.remove_node(worker.node);
+    workers.erase(workers.begin() + index);
+}
+
+/*
+ * Shared memory for columns and outputs. Allocations last until stop().
+ * Arguments:
+ *     size_t bytes - Size wanted.
+ * Returns:
+ *     void * - Cache line aligned memory every worker sees, nullptr if the
+ *         arena is full.
+ */
+void *LocalCluster::allocate(size_t bytes) {
+    size_t size = (bytes + 63) & ~(size_t)63;
+    if(region == nullptr || size < bytes || size > region_bytes - arena_used) return nullptr;
+
+    void *data = region + arena_used;
+    arena_used += size;
+    return data;
+}
+
+/*
+ * Arena offset of a range, checking it lies within the arena.
+ * Returns:
+ *     uint64_t - The offset, UINT64_MAX if the range is not shared.
+ */
+uint64_t LocalCluster::offset_of(const void *data, size_t bytes) const {
+    uintptr_t begin = (uintptr_t)region + arena_begin, end = (uintptr_t)region + region_bytes;
+    uintptr_t address = (uintptr_t)data;
+    if(region == nullptr || address < begin || address > end || bytes > end - address) return UINT64_MAX;
+    return address - (uintptr_t)region;
+}
+
+/*
+ * Verify a kernel, optimize it, fuse it into superinstructions and copy it
+ * into the arena for the workers. Each rewrite is verified again, as the
+ * workers trust the verifier's facts. Float MUL; ADD is left alone, so
+ * results match the kernel as given.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel.
+ *     int length - Length of the bytecode.
+ *     VMReturnType type - Type of the kernel's result.
+ * Returns:
+ *     int - Kernel number for run_batch(), -1 if the kernel is invalid or
+ *         the arena is full.
+ */
+int LocalCluster::add_kernel(const Instruction *bytecode, int length, VMReturnType type) {
+    KernelInfo info;
+    KernelCost cost;
+    std::vector<Instruction> optimized, fused;
+    if(verify_bytecode(bytecode, length, type, &info) < 0) return -1;
+    if(optimize_bytecode(bytecode, info, &optimized) < 0) return -1;
+    if(verify_bytecode(optimized.data(), optimized.size(), type, &info) < 0) return -1;
+    fuse_superinstructions(optimized.data(), info, &fused, false);
+    if(verify_bytecode(fused.data(), fused.size(), type, &info) < 0) return -1;
+    if(estimate_cost(fused.data(), info.length, &cost) < 0) return -1;
+
+    void *copy = allocate(info.length * sizeof(Instruction));
+    if(copy == nullptr) return -1;
+    memcpy(copy, fused.data(), info.length * sizeof(Instruction));
+
+    kernels.push_back({ offset_of(copy, 0), info.length, type, cost });
+    return (int)kernels.size() - 1;
+}
+
+/*
+ * Run a kernel over n instances on the workers. Inputs and output must be
+ * arena memory from allocate(); each worker gets a contiguous slice sized
+ * by place_task() and reads and writes it in place. The instances are
+ * numbered from 0 for RAND, so results match a single ExecutionContext.
+ * Arguments:
+ *     int kernel - From add_kernel().
+ *     const Column *inputs - Columns of n values each.
+ *     int num_inputs - Number of columns.
+ *     size_t n - Number of instances.
+ *     uint64_t seed - RNG seed.
+ *     void *output - Receives n 32-bit results.
+ * Returns:
+ *     int - 0 on success, -1 on failure. Workers that died are dropped
+ *         before returning.
+ */
+int LocalCluster::run_batch(int kernel, const Column *inputs, int num_inputs, size_t n, uint64_t seed, void *output) {
+    if(kernel < 0 || kernel >= (int)kernels.size() || num_inputs < 0 || num_inputs > MAX_ARGS) return -1;
+    if(workers.empty()) return -1;
+    if(n == 0) return 0;
+
+    const Kernel& code = kernels[kernel];
+    uint64_t output_offset = offset_of(output, n * sizeof(int32_t));
+    uint64_t input_offsets[MAX_ARGS];
+    if(output_offset == UINT64_MAX) return -1;
+    for(int k = 0; k < num_inputs; k++) {
+        input_offsets[k] = offset_of(inputs[k].data, n * sizeof(int32_t));
+        if(input_offsets[k] == UINT64_MAX) return -1;
+    }
+
+    Task task = { next_task, (const Instruction *)(region + code.bytecode), code.length, code.return_type, 0, n, seed };
+    std::vector<Placement> placements;
+    if(place_task(task, registry, &placements) < 0) return -1;
+
+    // Queue each slice on its worker and wake it
+    std::vector<uint64_t> counts(workers.size(), 0);
+    std::vector<bool> dead(workers.size(), false);
+    bool failed = false;
+    for(const Placement& placement : placements) {
+        size_t w = 0;
+        while(workers[w].node != placement.node) w++;
+
+        ClusterTask slice = {};
+        slice.id = next_task++;
+        slice.kernel = kernel;
+        slice.bytecode = code.bytecode;
+        slice.length = code.length;
+        slice.return_type = code.return_type;
+        slice.num_inputs = num_inputs;
+        for(int k = 0; k < num_inputs; k++) {
+            slice.input_types[k] = inputs[k].type;
+            slice.inputs[k] = input_offsets[k] + placement.first_instance * sizeof(int32_t);
+        }
+        slice.output = output_offset + placement.first_instance * sizeof(int32_t);
+        slice.count = placement.count;
+        slice.first_instance = placement.first_instance;
+        slice.seed = seed;
+
+        if(workers[w].channel->tasks.push(slice) < 0 || send(workers[w].socket, &CLUSTER_WAKE, 1, MSG_NOSIGNAL) != 1) {
+            dead[w] = true;
+            failed = true;
+            continue;
+        }
+        counts[w] = placement.count;
+    }
+
+    // Collect a result from every worker given a slice
+    std::vector<pollfd> fds;
+    std::vector<size_t> polled;
+    for(;;) {
+        fds.clear();
+        polled.clear();
+        for(size_t w = 0; w < workers.size(); w++) {
+            if(counts[w] == 0 || dead[w]) continue;
+            fds.push_back({ workers[w].socket, POLLIN, 0 });
+            polled.push_back(w);
+        }
+        if(fds.empty()) break;
+
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            if(errno == EINTR) continue;
+            for(size_t w : polled) dead[w] = true;
+            failed = true;
+            break;
+        }
+
+        for(size_t i = 0; i < fds.size(); i++) {
+            if(fds[i].revents == 0) continue;
+
+            size_t w = polled[i];
+            char message;
+            if(recv(workers[w].socket, &message, 1, 0) != 1 || message != CLUSTER_DONE) {
+                dead[w] = true;
+                failed = true;
+                continue;
+            }
+
+            ClusterResult result;
+            while(workers[w].channel->results.pop(&result) == 0) {
+                if(result.status < 0) failed = true;
+                else registry.record_run(workers[w].node, counts[w] * instance_cost(code.cost, lanes), result.seconds);
+                counts[w] = 0;
+            }
+        }
+    }
+
+    for(size_t w = workers.size(); w-- > 0;) {
+        if(dead[w]) drop_worker(w);
+    }
+
+    return failed ? -1 : 0;
+}
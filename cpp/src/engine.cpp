@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+/*
+ * The dispatcher is built for the baseline target, so it runs on any x86-64
+ * host and only calls into an ISA build once the CPU is known to have it.
+ */
+
+#define DECLARE_ENGINE(ns) namespace ns { int create_engine(const Instruction *bytecode, std::unique_ptr<Engine> *engine); }
+DECLARE_ENGINE(mosaic_sse41)
+DECLARE_ENGINE(mosaic_sse41_u4)
+DECLARE_ENGINE(mosaic_avx2)
+DECLARE_ENGINE(mosaic_avx2_u4)
+DECLARE_ENGINE(mosaic_avx512)
+DECLARE_ENGINE(mosaic_avx512_u4)
+
+using EngineFactory = int (*)(const Instruction *bytecode, std::unique_ptr<Engine> *engine);
+
+/* Indexed by ISA, then by position in ENGINE_UNROLLS. */
+static const EngineFactory factories[ISA_COUNT][ENGINE_UNROLL_COUNT] = {
+    { &mosaic_sse41::create_engine, &mosaic_sse41_u4::create_engine },
+    { &mosaic_avx2::create_engine, &mosaic_avx2_u4::create_engine },
+    { &mosaic_avx512::create_engine, &mosaic_avx512_u4::create_engine },
+};
+
+static const char *const isa_names[ISA_COUNT] = {
+    "sse4.1",
+    "avx2",
+    "avx512",
+};
+
+/*
+ * Widest instruction set the CPU and OS both support. The checks include
+ * the XCR0 state bits, so a kernel that does not save zmm registers never
+ * gets the AVX-512 engine. The AVX2 builds use FMA as well.
+ * Returns:
+ *     Isa - The instruction set, ISA_COUNT if even SSE4.1 is missing.
+ */
+Isa detect_isa() {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return ISA_AVX2;
+    if(__builtin_cpu_supports("sse4.1")) return ISA_SSE41;
+    return ISA_COUNT;
+}
+
+/*
+ * Instruction set engines are built for by default: the widest supported
+ * one, or the one named by MOSAIC_ISA if the host supports it. The override
+ * lets tests and benchmarks force a narrower engine.
+ * Returns:
+ *     Isa - The instruction set, ISA_COUNT if even SSE4.1 is missing.
+ */
+Isa select_isa() {
+    Isa detected = detect_isa();
+    if(detected == ISA_COUNT) return detected;
+
+    Isa requested;
+    const char *name = getenv("MOSAIC_ISA");
+    if(name != nullptr && parse_isa(name, &requested) == 0 && requested <= detected) return requested;
+
+    return detected;
+}
+
+/*
+ * Name of an instruction set, as MOSAIC_ISA and parse_isa() spell it.
+ * Arguments:
+ *     Isa isa - Instruction set.
+ * Returns:
+ *     const char * - The name, "none" for ISA_COUNT or any other value.
+ */
+const char *isa_name(Isa isa) {
+    if(isa < 0 || isa >= ISA_COUNT) return "none";
+    return isa_names[isa];
+}
+
+/*
+ * Width of an instruction set's vectors.
+ * Arguments:
+ *     Isa isa - Instruction set.
+ * Returns:
+ *     int - 32-bit lanes per vector, 0 if isa is not an instruction set.
+ */
+int isa_lanes(Isa isa) {
+    if(isa < 0 || isa >= ISA_COUNT) return 0;
+    return 4 << isa;
+}
+
+/*
+ * Look up an instruction set by name.
+ * Arguments:
+ *     const char *name - One of the names isa_name() returns.
+ *     Isa *isa - Receives the instruction set.
+ * Returns:
+ *     int - 0 on success, -1 if the name is unknown.
+ */
+int parse_isa(const char *name, Isa *isa) {
+    for(int i = 0; i < ISA_COUNT; i++) {
+        if(strcmp(name, isa_names[i]) == 0) {
+            *isa = (Isa)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Build an engine for the given instruction set and unroll factor.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, kept by reference as with VM.
+ *     Isa isa - Instruction set to run on.
+ *     int unroll - One of ENGINE_UNROLLS.
+ *     std::unique_ptr<Engine> *engine - Receives the engine.
+ * Returns:
+ *     int - 0 on success, -1 if the host does not support the instruction
+ *           set or no build has the unroll factor.
+ */
+int create_engine(const Instruction *bytecode, Isa isa, int unroll, std::unique_ptr<Engine> *engine) {
+    Isa detected = detect_isa();
+    if(detected == ISA_COUNT || isa < 0 || isa > detected) return -1;
+
+    for(int u = 0; u < ENGINE_UNROLL_COUNT; u++) {
+        if(ENGINE_UNROLLS[u] == unroll) return factories[isa][u](bytecode, engine);
+    }
+    return -1;
+}
+
+/* Build an engine for the given instruction set, one vector per slot. */
+int create_engine(const Instruction *bytecode, Isa isa, std::unique_ptr<Engine> *engine) {
+    return create_engine(bytecode, isa, 1, engine);
+}
+
+/* Build an engine for select_isa(). */
+int create_engine(const Instruction *bytecode, std::unique_ptr<Engine> *engine) {
+    return create_engine(bytecode, select_isa(), engine);
+}
@@ -0,0 +1,106 @@
+#include "engine.h"
+#include "vm.h"
+
+/*
+ * Built once per instruction set with -DMOSAIC_ISA_NAMESPACE, next to the
+ * matching builds of vm.cpp and jit.cpp.
+ */
+
+MOSAIC_ISA_BEGIN
+
+/*
+ * An ExecutionContext on a kernel of this build. The engine made from
+ * bytecode prepares the kernel in place, as VM does; engines made by
+ * share() run the same kernel in frames of their own and cannot prepare it.
+ * Once shared the kernel is never changed again: preparing it further works
+ * on a copy, so shared engines keep running the kernel their frames were
+ * laid out for.
+ */
+class IsaEngine : public Engine {
+    std::shared_ptr<CompiledKernel> prepared;   // Only set on the engine that prepares the kernel
+    std::shared_ptr<const CompiledKernel> kernel;
+    ExecutionContext context;
+    mutable bool shared = false;                // prepared has been handed out by share()
+
+    /* The kernel to prepare, copied first if other engines run it. */
+    CompiledKernel *unshared() {
+        if(shared) {
+            auto copy = std::make_shared<CompiledKernel>(*prepared);
+            if(!prepared->storage.empty()) copy->bytecode = copy->storage.data();
+            prepared = copy;
+            kernel = copy;
+            shared = false;
+        }
+        return prepared.get();
+    }
+
+    /* Follow a change to the prepared kernel. */
+    int rebind(int result) {
+        context.bind(kernel);
+        return result;
+    }
+
+public:
+    IsaEngine(const Instruction *bytecode)
+        : prepared(std::make_shared<CompiledKernel>(bytecode)), kernel(prepared), context(kernel) {}
+    IsaEngine(std::shared_ptr<const CompiledKernel> kernel) : kernel(kernel), context(kernel) {}
+
+    Isa isa() const override {
+        return LANES == 16 ? ISA_AVX512 : LANES == 8 ? ISA_AVX2 : ISA_SSE41;
+    }
+
+    int lanes() const override { return LANES; }
+    int unroll() const override { return UNROLL; }
+    VMReturnType return_type() const override { return kernel->return_type; }
+
+    /*
+     * Point *engine at this engine's kernel. A shared engine of this build
+     * is rebound in place and keeps its frame, anything else is replaced.
+     */
+    int share(std::unique_ptr<Engine> *engine) const override {
+        shared = prepared != nullptr;
+        IsaEngine *same = dynamic_cast<IsaEngine *>(engine->get());
+        if(same != nullptr && same->prepared == nullptr) {
+            same->kernel = kernel;
+            same->context.bind(kernel);
+        } else {
+            engine->reset(new IsaEngine(kernel));
+        }
+        return 0;
+    }
+
+    int verify(int length) override { return prepared ? rebind(unshared()->verify(length)) : -1; }
+    int optimize() override { return prepared ? rebind(unshared()->optimize()) : -1; }
+    int translate() override { return prepared ? rebind(unshared()->translate()) : -1; }
+    int compile_jit() override { return prepared ? rebind(unshared()->compile_jit()) : -1; }
+    int run_batch(size_t n, void *output) override { return context.run_batch(n, output); }
+    int run_batch(const Column *inputs, int num_inputs, size_t n, void *output) override { return context.run_batch(inputs, num_inputs, n, output); }
+    int run_reduce(size_t n, ReduceOp op, ReduceValue *result) override { return context.run_reduce(n, op, result); }
+    int run_reduce(const Column *inputs, int num_inputs, size_t n, ReduceOp op, ReduceValue *result) override {
+        return context.run_reduce(inputs, num_inputs, n, op, result);
+    }
+    int bind_column(int index, TypeTag type, const void *data) override { return context.bind_column(index, type, data); }
+    void reset() override { context.reset(); }
+    void set_return_type(VMReturnType type) override {
+        if(prepared == nullptr) return;
+        unshared()->set_return_type(type);
+        context.bind(kernel);
+    }
+    void seed_random(uint64_t seed) override { context.seed_random(seed); }
+    void set_first_instance(uint64_t index) override { context.set_first_instance(index); }
+};
+
+/*
+ * Build an engine for this translation unit's instruction set.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, kept by reference as with VM.
+ *     std::unique_ptr<Engine> *engine - Receives the engine.
+ * Returns:
+ *     int - 0 on success.
+ */
+int create_engine(const Instruction *bytecode, std::unique_ptr<Engine> *engine) {
+    engine->reset(new IsaEngine(bytecode));
+    return 0;
+}
+
+MOSAIC_ISA_END
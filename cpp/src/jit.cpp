@@ -0,0 +1,553 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "jit.h"
+#include "translate.h"
+
+MOSAIC_ISA_BEGIN
+
+/*
+ * The JIT translates verified stack bytecode straight to x86-64. Stack level
+ * d lives in vector register d for the whole kernel, so values never touch
+ * memory between instructions. Register 14 holds all ones and register 15
+ * is scratch. AVX2 builds emit VEX encoded ymm code, SSE4.1 builds emit the
+ * legacy two operand xmm forms. AVX-512 builds are not compiled.
+ */
+
+constexpr int VEC_BYTES = LANES * 4;
+
+/* Registers hold UNROLL vectors, the code runs on one of them at a time. */
+constexpr int SLOT_BYTES = VEC_BYTES * UNROLL;
+
+/* Fuse FMA only when the interpreters do, so every engine rounds alike. */
+#ifdef __FMA__
+constexpr bool JIT_HAS_FMA = true;
+#else
+constexpr bool JIT_HAS_FMA = false;
+#endif
+constexpr int ONES = 14;
+constexpr int SCRATCH = 15;
+
+/* General purpose registers. */
+constexpr int RAX = 0;
+constexpr int RDX = 2;
+constexpr int RSI = 6;
+constexpr int RDI = 7;
+
+/* Opcode prefixes and maps. */
+constexpr int PP_NONE = 0;
+constexpr int PP_66 = 1;
+constexpr int PP_F3 = 2;
+constexpr int MAP_0F = 1;
+constexpr int MAP_0F38 = 2;
+
+/* Operand of a vector instruction: register, memory or pooled constant. */
+struct Operand {
+    enum Kind { REG, MEM, MEM_INDEX, CONST } kind;
+    int reg;
+    int base;
+    int index;
+    int32_t disp;
+
+    static Operand vec(int reg) { return { REG, reg, 0, 0, 0 }; }
+    static Operand mem(int base, int32_t disp) { return { MEM, 0, base, 0, disp }; }
+    static Operand mem_index(int base, int index) { return { MEM_INDEX, 0, base, index, 0 }; }
+    static Operand constant(int k) { return { CONST, 0, 0, 0, k }; }
+};
+
+/* RIP relative reference to the constant pool, patched once code is done. */
+struct Fixup {
+    size_t pos;
+    size_t end;
+    int constant;
+};
+
+class Assembler {
+private:
+    bool pending;
+    Fixup pending_fixup;
+
+    void modrm(int reg, const Operand& rm) {
+        if(rm.kind == Operand::REG) {
+            emit(0xC0 | (reg & 7) << 3 | (rm.reg & 7));
+        } else if(rm.kind == Operand::MEM) {
+            emit(0x80 | (reg & 7) << 3 | (rm.base & 7));
+            emit32(rm.disp);
+        } else if(rm.kind == Operand::MEM_INDEX) {
+            emit(0x04 | (reg & 7) << 3);
+            emit((rm.index & 7) << 3 | (rm.base & 7));
+        } else {
+            emit(0x05 | (reg & 7) << 3);
+            pending = true;
+            pending_fixup = { code.size(), 0, rm.disp };
+            emit32(0);
+        }
+    }
+
+    static int ext_b(const Operand& rm) {
+        if(rm.kind == Operand::REG) return rm.reg >> 3;
+        if(rm.kind == Operand::CONST) return 0;
+        return rm.base >> 3;
+    }
+
+    static int ext_x(const Operand& rm) {
+        return rm.kind == Operand::MEM_INDEX ? rm.index >> 3 : 0;
+    }
+
+    /* Encode one instruction with either a VEX or a legacy prefix. */
+    void encode(int pp, int map, uint8_t opcode, int reg, int vvvv, const Operand& rm, int imm) {
+        int r = reg >> 3, x = ext_x(rm), b = ext_b(rm);
+
+        if(avx) {
+            emit(0xC4);
+            emit((!r) << 7 | (!x) << 6 | (!b) << 5 | map);
+            emit((~vvvv & 15) << 3 | (LANES == 8) << 2 | pp);
+        } else {
+            static const uint8_t prefixes[] = { 0x00, 0x66, 0xF3, 0xF2 };
+            if(pp != PP_NONE) emit(prefixes[pp]);
+            if(r || x || b) emit(0x40 | r << 2 | x << 1 | b);
+            emit(0x0F);
+            if(map == MAP_0F38) emit(0x38);
+        }
+
+        emit(opcode);
+        modrm(reg, rm);
+        if(imm >= 0) emit(imm);
+
+        if(pending) {
+            pending_fixup.end = code.size();
+            fixups.push_back(pending_fixup);
+            pending = false;
+        }
+    }
+
+public:
+    std::vector<uint8_t> code;
+    std::vector<Fixup> fixups;
+    bool avx;
+
+    Assembler() : pending(false), avx(LANES == 8) {}
+
+    void emit(uint8_t byte) {
+        code.push_back(byte);
+    }
+
+    void emit32(uint32_t value) {
+        for(int i = 0; i < 4; i++) emit(value >> (8 * i));
+    }
+
+    /* dst = src1 op src2, copying through scratch for destructive SSE forms. */
+    void vop(int pp, int map, uint8_t opcode, int dst, int src1, const Operand& src2, int imm = -1) {
+        if(avx) {
+            encode(pp, map, opcode, dst, src1, src2, imm);
+            return;
+        }
+
+        if(dst != src1) {
+            if(src2.kind == Operand::REG && src2.reg == dst) {
+                mov(SCRATCH, src1);
+                encode(pp, map, opcode, SCRATCH, 0, src2, imm);
+                mov(dst, SCRATCH);
+                return;
+            }
+            mov(dst, src1);
+        }
+        encode(pp, map, opcode, dst, 0, src2, imm);
+    }
+
+    /*
+     * dst = src shifted by an immediate, ext selects the shift direction.
+     * Opcode 0x72 shifts dwords, 0x73 shifts qwords.
+     */
+    void shift(int ext, int dst, int src, int imm, uint8_t opcode = 0x72) {
+        if(avx) {
+            encode(PP_66, MAP_0F, opcode, ext, dst, Operand::vec(src), imm);
+            return;
+        }
+
+        if(dst != src) mov(dst, src);
+        encode(PP_66, MAP_0F, opcode, ext, 0, Operand::vec(dst), imm);
+    }
+
+    void mov(int dst, int src) {
+        encode(PP_66, MAP_0F, 0x6F, dst, 0, Operand::vec(src), -1);
+    }
+
+    void load(int dst, const Operand& src) {
+        encode(PP_F3, MAP_0F, 0x6F, dst, 0, src, -1);
+    }
+
+    void store(const Operand& dst, int src) {
+        encode(PP_F3, MAP_0F, 0x7F, src, 0, dst, -1);
+    }
+
+    /* mov r64, [base + disp32] */
+    void load_pointer(int reg, int base, int32_t disp) {
+        emit(0x48 | (reg >> 3) << 2 | (base >> 3));
+        emit(0x8B);
+        emit(0x80 | (reg & 7) << 3 | (base & 7));
+        emit32(disp);
+    }
+};
+
+/* Vector opcodes as (prefix, map, opcode). */
+constexpr int PADDD = 0xFE, PSUBD = 0xFA, PMULLD = 0x40, PMULDQ = 0x28, PCMPGTD = 0x66, PCMPEQD = 0x76;
+constexpr int PAND = 0xDB, PANDN = 0xDF, POR = 0xEB, PXOR = 0xEF;
+constexpr int ADDPS = 0x58, SUBPS = 0x5C, MULPS = 0x59, DIVPS = 0x5E, CMPPS = 0xC2, VFMADD231PS = 0xB8;
+constexpr int SHIFT_RIGHT = 2, SHIFT_RIGHT_ARITH = 4, SHIFT_LEFT = 6;
+constexpr uint8_t SHIFT_QWORD = 0x73;
+
+/*
+ * Lane value of a PUSH_CONST, with booleans widened to a full mask.
+ */
+static uint32_t constant_bits(const Instruction& instr) {
+    if(instr.type == BOOL) return instr.const_bool ? 0xFFFFFFFF : 0;
+
+    uint32_t bits;
+    memcpy(&bits, &instr.const_int, sizeof(bits));
+    return bits;
+}
+
+/*
+ * Add a broadcast constant to the pool, reusing an existing entry.
+ */
+static int pool_constant(std::vector<uint32_t>& pool, uint32_t bits) {
+    for(size_t k = 0; k < pool.size(); k++) {
+        if(pool[k] == bits) return k;
+    }
+    pool.push_back(bits);
+    return pool.size() - 1;
+}
+
+/*
+ * Emit a CMP_* of the vectors in a and b, leaving the lane mask in a.
+ */
+static void emit_compare(Assembler& as, OpCode op, bool is_int, int a, int b) {
+    if(is_int) {
+        // Only > and == exist, the rest swap operands or invert
+        bool swap = op == CMP_LT || op == CMP_GTE;
+        bool invert = op == CMP_LTE || op == CMP_GTE || op == CMP_NE;
+        bool equal = op == CMP_EQ || op == CMP_NE;
+
+        if(equal) {
+            as.vop(PP_66, MAP_0F, PCMPEQD, a, a, Operand::vec(b));
+        } else if(swap) {
+            as.vop(PP_66, MAP_0F, PCMPGTD, a, b, Operand::vec(a));
+        } else {
+            as.vop(PP_66, MAP_0F, PCMPGTD, a, a, Operand::vec(b));
+        }
+        if(invert) as.vop(PP_66, MAP_0F, PXOR, a, a, Operand::vec(ONES));
+    } else if(as.avx) {
+        // Same ordered, non-signalling predicates as simd.h
+        static const int predicates[] = { 0x11, 0x12, 0x1E, 0x1D, 0x00, 0x0C };
+        as.vop(PP_NONE, MAP_0F, CMPPS, a, a, Operand::vec(b), predicates[op - CMP_LT]);
+    } else {
+        // SSE only has lt/le/eq/neq, > and >= swap the operands
+        static const int predicates[] = { 1, 2, 1, 2, 0, 4 };
+        bool swap = op == CMP_GT || op == CMP_GTE;
+        int predicate = predicates[op - CMP_LT];
+        if(swap) {
+            as.vop(PP_NONE, MAP_0F, CMPPS, a, b, Operand::vec(a), predicate);
+        } else {
+            as.vop(PP_NONE, MAP_0F, CMPPS, a, a, Operand::vec(b), predicate);
+        }
+    }
+}
+
+/* Emit mix32() on register t, as in the interpreters. Clobbers SCRATCH. */
+static void emit_mix32(Assembler& as, std::vector<uint32_t>& pool, int t) {
+    as.shift(SHIFT_RIGHT, SCRATCH, t, 16);
+    as.vop(PP_66, MAP_0F, PXOR, t, t, Operand::vec(SCRATCH));
+    as.vop(PP_66, MAP_0F38, PMULLD, t, t, Operand::constant(pool_constant(pool, RAND_MIX1)));
+    as.shift(SHIFT_RIGHT, SCRATCH, t, 15);
+    as.vop(PP_66, MAP_0F, PXOR, t, t, Operand::vec(SCRATCH));
+    as.vop(PP_66, MAP_0F38, PMULLD, t, t, Operand::constant(pool_constant(pool, RAND_MIX2)));
+    as.shift(SHIFT_RIGHT, SCRATCH, t, 16);
+    as.vop(PP_66, MAP_0F, PXOR, t, t, Operand::vec(SCRATCH));
+}
+
+/*
+ * Emit a / d (or a % d) for a constant d with its magic number, as in
+ * divide_magic(). Clobbers b, the register the divisor was pushed into.
+ */
+static void emit_divide_magic(Assembler& as, std::vector<uint32_t>& pool, int a, int b, const DivMagic& magic, bool modulo) {
+    int multiplier = pool_constant(pool, (uint32_t)magic.multiplier);
+
+    // High halves of the even lane products into b, odd lanes into SCRATCH
+    as.shift(SHIFT_RIGHT, SCRATCH, a, 32, SHIFT_QWORD);
+    as.vop(PP_66, MAP_0F38, PMULDQ, SCRATCH, SCRATCH, Operand::constant(multiplier));
+    as.vop(PP_66, MAP_0F38, PMULDQ, b, a, Operand::constant(multiplier));
+    as.shift(SHIFT_RIGHT, b, b, 32, SHIFT_QWORD);
+    as.shift(SHIFT_RIGHT, SCRATCH, SCRATCH, 32, SHIFT_QWORD);
+    as.shift(SHIFT_LEFT, SCRATCH, SCRATCH, 32, SHIFT_QWORD);
+    as.vop(PP_66, MAP_0F, POR, b, b, Operand::vec(SCRATCH));
+
+    if(magic.adjust > 0) as.vop(PP_66, MAP_0F, PADDD, b, b, Operand::vec(a));
+    if(magic.adjust < 0) as.vop(PP_66, MAP_0F, PSUBD, b, b, Operand::vec(a));
+    if(magic.shift > 0) as.shift(SHIFT_RIGHT_ARITH, b, b, magic.shift);
+    as.shift(SHIFT_RIGHT, SCRATCH, b, 31);
+    as.vop(PP_66, MAP_0F, PADDD, b, b, Operand::vec(SCRATCH));
+
+    if(modulo) {
+        as.vop(PP_66, MAP_0F38, PMULLD, b, b, Operand::constant(pool_constant(pool, (uint32_t)magic.divisor)));
+        as.vop(PP_66, MAP_0F, PSUBD, a, a, Operand::vec(b));
+    } else {
+        as.mov(a, b);
+    }
+}
+
+JitCode::~JitCode() {
+    if(memory != nullptr) munmap(memory, size);
+}
+
+JitCode::JitCode(JitCode&& other) : memory(other.memory), size(other.size), entry(other.entry), rand_calls(other.rand_calls) {
+    other.memory = nullptr;
+    other.entry = nullptr;
+}
+
+/*
+ * Take over another mapping, releasing the one held so far.
+ */
+JitCode& JitCode::operator=(JitCode&& other) {
+    if(this != &other) {
+        if(memory != nullptr) munmap(memory, size);
+        memory = other.memory;
+        size = other.size;
+        entry = other.entry;
+        rand_calls = other.rand_calls;
+        other.memory = nullptr;
+        other.entry = nullptr;
+    }
+    return *this;
+}
+
+/*
+ * Compile a verified kernel to native code for full lane groups.
+ * Arguments:
+ *     const Instruction *bytecode - Verified kernel.
+ *     const KernelInfo& info - Metadata from verify_bytecode().
+ *     const int slot_base[3] - First slot vector of each type in context->slots.
+ *     std::shared_ptr<JitCode> *code - Receives the executable code.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel can't be compiled.
+ */
+int jit_compile(const Instruction *bytecode, const KernelInfo& info, const int slot_base[3], std::shared_ptr<JitCode> *code) {
+    // There is no EVEX encoder, AVX-512 builds stay on the interpreters
+    if(LANES > 8) return -1;
+    if(info.max_stack > JIT_MAX_STACK) return -1;
+
+    Assembler as;
+    std::vector<uint32_t> pool;
+    int depth = 0;
+
+    // Prologue: slots in rsi, lane group offset in rdx, all ones in ONES
+    as.load_pointer(RSI, RDI, offsetof(JitContext, slots));
+    as.load_pointer(RDX, RDI, offsetof(JitContext, offset));
+    as.vop(PP_66, MAP_0F, PCMPEQD, ONES, ONES, Operand::vec(ONES));
+
+    // PUSH_CONST of the previous instruction, a constant top of stack
+    const Instruction *last_const = nullptr;
+    uint32_t rand_calls = 0;
+
+    for(int pc = 0; pc < info.length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        bool is_int = instr.type == I32;
+        int a = depth - 2, b = depth - 1;
+        const Instruction *top_const = last_const;
+        last_const = instr.opcode == PUSH_CONST ? &instr : nullptr;
+
+        switch(instr.opcode) {
+        case PUSH_CONST:
+            as.load(depth++, Operand::constant(pool_constant(pool, constant_bits(instr))));
+            break;
+        case LOAD_VAR:
+            as.load(depth++, Operand::mem(RSI, (slot_base[instr.type] + instr.slot) * SLOT_BYTES));
+            break;
+        case STORE_VAR:
+            as.store(Operand::mem(RSI, (slot_base[instr.type] + instr.slot) * SLOT_BYTES), --depth);
+            break;
+        case LOAD_ARG:
+            as.load_pointer(RAX, RDI, offsetof(JitContext, args) + instr.arg * sizeof(void *));
+            as.load(depth, Operand::mem_index(RAX, RDX));
+            if(instr.type == BOOL) {
+                // Any nonzero value is true, normalize to a full lane mask
+                as.vop(PP_66, MAP_0F, PXOR, SCRATCH, SCRATCH, Operand::vec(SCRATCH));
+                as.vop(PP_66, MAP_0F, PCMPEQD, depth, depth, Operand::vec(SCRATCH));
+                as.vop(PP_66, MAP_0F, PXOR, depth, depth, Operand::vec(ONES));
+            }
+            depth++;
+            break;
+        case ADD:
+            as.vop(is_int ? PP_66 : PP_NONE, MAP_0F, is_int ? PADDD : ADDPS, a, a, Operand::vec(b));
+            depth--;
+            break;
+        case SUB:
+            as.vop(is_int ? PP_66 : PP_NONE, MAP_0F, is_int ? PSUBD : SUBPS, a, a, Operand::vec(b));
+            depth--;
+            break;
+        case MUL:
+            if(is_int) {
+                as.vop(PP_66, MAP_0F38, PMULLD, a, a, Operand::vec(b));
+            } else {
+                as.vop(PP_NONE, MAP_0F, MULPS, a, a, Operand::vec(b));
+            }
+            depth--;
+            break;
+        case DIV:
+        case MOD:
+            if(is_int) {
+                // Only constant divisors, anything else can divide by zero
+                DivMagic magic;
+                if(!top_const || div_magic(top_const->const_int, &magic) < 0) return -1;
+                emit_divide_magic(as, pool, a, b, magic, instr.opcode == MOD);
+            } else {
+                as.vop(PP_NONE, MAP_0F, DIVPS, a, a, Operand::vec(b));
+            }
+            depth--;
+            break;
+        case SHL:
+            as.shift(SHIFT_LEFT, b, b, instr.shift);
+            break;
+        case DIV_POW2:
+        case MOD_POW2:
+            // Bias negative values by 2^k - 1, then shift, as in div_pow2()
+            as.shift(SHIFT_RIGHT_ARITH, SCRATCH, b, 31);
+            as.shift(SHIFT_RIGHT, SCRATCH, SCRATCH, 32 - instr.shift);
+            as.vop(PP_66, MAP_0F, PADDD, SCRATCH, SCRATCH, Operand::vec(b));
+            as.shift(SHIFT_RIGHT_ARITH, SCRATCH, SCRATCH, instr.shift);
+            if(instr.opcode == DIV_POW2) {
+                as.mov(b, SCRATCH);
+            } else {
+                as.shift(SHIFT_LEFT, SCRATCH, SCRATCH, instr.shift);
+                as.vop(PP_66, MAP_0F, PSUBD, b, b, Operand::vec(SCRATCH));
+            }
+            break;
+        case CMP_LT:
+        case CMP_LTE:
+        case CMP_GT:
+        case CMP_GTE:
+        case CMP_EQ:
+        case CMP_NE:
+            emit_compare(as, instr.opcode, is_int, a, b);
+            depth--;
+            break;
+        case AND:
+            as.vop(PP_66, MAP_0F, PAND, a, a, Operand::vec(b));
+            depth--;
+            break;
+        case OR:
+            as.vop(PP_66, MAP_0F, POR, a, a, Operand::vec(b));
+            depth--;
+            break;
+        case NOT:
+            as.vop(PP_66, MAP_0F, PXOR, b, b, Operand::vec(ONES));
+            break;
+        case SELECT: {
+            // (cond & a) | (~cond & b)
+            int cond = depth - 3;
+            as.vop(PP_66, MAP_0F, PANDN, SCRATCH, cond, Operand::vec(b));
+            as.vop(PP_66, MAP_0F, PAND, cond, cond, Operand::vec(a));
+            as.vop(PP_66, MAP_0F, POR, cond, cond, Operand::vec(SCRATCH));
+            depth -= 2;
+            break;
+        }
+        case RAND: {
+            // mix32(key + call step), then the same float conversion as VM::next_random()
+            int t = depth;
+            as.load_pointer(RAX, RDI, offsetof(JitContext, rng_base));
+            as.load(t, Operand::mem(RAX, 0));
+            as.vop(PP_66, MAP_0F, PADDD, t, t, Operand::constant(pool_constant(pool, ++rand_calls * RAND_STEP)));
+            emit_mix32(as, pool, t);
+
+            as.shift(SHIFT_RIGHT, t, t, 9);
+            as.vop(PP_66, MAP_0F, POR, t, t, Operand::constant(pool_constant(pool, 0x3F800000)));
+            as.vop(PP_NONE, MAP_0F, SUBPS, t, t, Operand::constant(pool_constant(pool, 0x3F800000)));
+            depth++;
+            break;
+        }
+        case SQUARE_VAR:
+            as.load(depth, Operand::mem(RSI, (slot_base[instr.type] + instr.slot) * SLOT_BYTES));
+            if(is_int) {
+                as.vop(PP_66, MAP_0F38, PMULLD, depth, depth, Operand::vec(depth));
+            } else {
+                as.vop(PP_NONE, MAP_0F, MULPS, depth, depth, Operand::vec(depth));
+            }
+            depth++;
+            break;
+        case FMA: {
+            // c + a * b, with the stack c a b
+            int c = depth - 3;
+            if(is_int) {
+                as.vop(PP_66, MAP_0F38, PMULLD, a, a, Operand::vec(b));
+                as.vop(PP_66, MAP_0F, PADDD, c, c, Operand::vec(a));
+            } else if(JIT_HAS_FMA && as.avx) {
+                as.vop(PP_66, MAP_0F38, VFMADD231PS, c, a, Operand::vec(b));
+            } else {
+                as.vop(PP_NONE, MAP_0F, MULPS, a, a, Operand::vec(b));
+                as.vop(PP_NONE, MAP_0F, ADDPS, c, c, Operand::vec(a));
+            }
+            depth -= 2;
+            break;
+        }
+        case CMP_SELECT_CONST: {
+            emit_compare(as, instr.compare, is_int, a, b);
+
+            // (mask & if_true) | (~mask & if_false), constants from the pool
+            int if_true = pool_constant(pool, constant_bits(bytecode[pc+1]));
+            int if_false = pool_constant(pool, constant_bits(bytecode[pc+2]));
+            as.vop(PP_66, MAP_0F, PANDN, SCRATCH, a, Operand::constant(if_false));
+            as.vop(PP_66, MAP_0F, PAND, a, a, Operand::constant(if_true));
+            as.vop(PP_66, MAP_0F, POR, a, a, Operand::vec(SCRATCH));
+            depth--;
+            pc += 2;
+            break;
+        }
+        case RETURN:
+            as.load_pointer(RAX, RDI, offsetof(JitContext, result));
+            as.store(Operand::mem(RAX, 0), b);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    // Epilogue
+    if(as.avx) {
+        as.emit(0xC5);
+        as.emit(0xF8);
+        as.emit(0x77);      // vzeroupper
+    }
+    as.emit(0xC3);          // ret
+
+    // Constant pool follows the code, aligned to a vector
+    while(as.code.size() % VEC_BYTES != 0) as.emit(0xCC);
+    size_t pool_start = as.code.size();
+    for(uint32_t bits : pool) {
+        for(int lane = 0; lane < LANES; lane++) as.emit32(bits);
+    }
+
+    for(const Fixup& fixup : as.fixups) {
+        int32_t disp = pool_start + fixup.constant * VEC_BYTES - fixup.end;
+        memcpy(&as.code[fixup.pos], &disp, sizeof(disp));
+    }
+
+    void *memory = mmap(nullptr, as.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED) return -1;
+
+    memcpy(memory, as.code.data(), as.code.size());
+    if(mprotect(memory, as.code.size(), PROT_READ | PROT_EXEC) < 0) {
+        munmap(memory, as.code.size());
+        return -1;
+    }
+
+    auto compiled = std::make_shared<JitCode>();
+    compiled->memory = memory;
+    compiled->size = as.code.size();
+    compiled->entry = (JitFunction)memory;
+    compiled->rand_calls = rand_calls;
+    *code = compiled;
+    return 0;
+}
+
+MOSAIC_ISA_END
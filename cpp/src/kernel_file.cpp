@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+#include "kernel_file.h"
+
+/*
+ * Compiled kernel files. A file is the header followed by the bytecode
+ * exactly as it sits in memory, so workers map it and run the bytecode in
+ * place. Files are only read on the host type that wrote them: the
+ * instruction size is recorded and the magic number fails on the other
+ * byte order.
+ */
+
+constexpr uint32_t FNV_OFFSET = 0x811C9DC5;
+constexpr uint32_t FNV_PRIME = 0x01000193;
+
+/*
+ * Continue an FNV-1a hash over a buffer.
+ */
+static uint32_t fnv1a(const void *data, size_t size, uint32_t hash) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Checksum of a kernel file, taken with the checksum field zero.
+ */
+static uint32_t kernel_checksum(const KernelFileHeader& header, const Instruction *bytecode) {
+    KernelFileHeader copy = header;
+    copy.checksum = 0;
+    uint32_t hash = fnv1a(&copy, sizeof(copy), FNV_OFFSET);
+    return fnv1a(bytecode, (size_t)header.length * sizeof(Instruction), hash);
+}
+
+/*
+ * Verify a kernel and write it with its metadata to a kernel file. The
+ * file is written next to its final path and renamed into place, so a
+ * worker mapping it never sees a partial file.
+ * Arguments:
+ *     const char *path - File to write.
+ *     const char *name - Kernel name, shorter than KERNEL_NAME_SIZE.
+ *     const char *const *arg_names - Name per argument up to the highest
+ *         one used, shorter than KERNEL_ARG_NAME_SIZE, or nullptr.
+ *     const Instruction *bytecode - Kernel to store.
+ *     int length - Number of instructions available in bytecode.
+ *     VMReturnType type - Return type of the kernel.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is rejected, a name is too long
+ *           or the file cannot be written.
+ */
+int write_kernel_file(const char *path, const char *name, const char *const *arg_names,
+                      const Instruction *bytecode, int length, VMReturnType type) {
+    KernelInfo info;
+    if(verify_bytecode(bytecode, length, type, &info) < 0) return -1;
+    if(strlen(name) >= KERNEL_NAME_SIZE) return -1;
+
+    KernelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = KERNEL_FILE_MAGIC;
+    header.version = KERNEL_FILE_VERSION;
+    header.header_size = sizeof(KernelFileHeader);
+    header.instruction_size = sizeof(Instruction);
+    header.length = info.length;
+    header.return_type = type;
+    header.max_stack = info.max_stack;
+    strcpy(header.name, name);
+
+    for(int type = I32; type <= BOOL; type++) {
+        header.slot_count[type] = info.slot_count[type];
+        header.slot_read_first[type] = info.slot_read_first[type];
+    }
+
+    for(int k = 0; k < MAX_ARGS; k++) {
+        header.args[k].type = KERNEL_ARG_UNUSED;
+        if(!info.arg_used[k]) continue;
+
+        header.num_args = k + 1;
+        header.args[k].type = info.arg_types[k];
+    }
+
+    for(uint32_t k = 0; arg_names != nullptr && k < header.num_args; k++) {
+        if(arg_names[k] == nullptr) continue;
+        if(strlen(arg_names[k]) >= KERNEL_ARG_NAME_SIZE) return -1;
+        strcpy(header.args[k].name, arg_names[k]);
+    }
+
+    header.checksum = kernel_checksum(header, bytecode);
+
+    std::string temp = std::string(path) + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if(file == nullptr) return -1;
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(bytecode, sizeof(Instruction), info.length, file) == (size_t)info.length;
+
+    if(fclose(file) != 0 || !written || rename(temp.c_str(), path) != 0) {
+        remove(temp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check everything the header claims against the limits of this build and
+ * the size of the file, then the checksum and finally the verifier.
+ */
+static bool valid_kernel_file(const KernelFileHeader& header, size_t size) {
+    if(header.magic != KERNEL_FILE_MAGIC || header.version != KERNEL_FILE_VERSION) return false;
+    if(header.header_size != sizeof(KernelFileHeader) || header.instruction_size != sizeof(Instruction)) return false;
+    if(header.length == 0 || size != sizeof(KernelFileHeader) + (size_t)header.length * sizeof(Instruction)) return false;
+    if(header.return_type >= KERNEL_ERROR || header.num_args > MAX_ARGS) return false;
+    if(header.max_stack == 0 || header.max_stack > MAX_STACK) return false;
+    if(memchr(header.name, 0, KERNEL_NAME_SIZE) == nullptr) return false;
+
+    for(int type = I32; type <= BOOL; type++) {
+        if(header.slot_count[type] > MAX_SLOTS) return false;
+    }
+
+    for(int k = 0; k < MAX_ARGS; k++) {
+        const KernelFileArg& arg = header.args[k];
+        if(memchr(arg.name, 0, KERNEL_ARG_NAME_SIZE) == nullptr) return false;
+        if(arg.type != KERNEL_ARG_UNUSED && (arg.type > BOOL || k >= (int)header.num_args)) return false;
+    }
+
+    const Instruction *bytecode = (const Instruction *)(&header + 1);
+    if(bytecode[header.length - 1].opcode != RETURN) return false;
+    if(kernel_checksum(header, bytecode) != header.checksum) return false;
+
+    KernelInfo info;
+    return verify_kernel_file(header, bytecode, &info) == 0;
+}
+
+MappedKernel::~MappedKernel() {
+    if(header != nullptr) munmap((void *)header, size);
+}
+
+/*
+ * Map a kernel file read-only. Nothing is copied or decoded: the bytecode
+ * is used straight from the mapping, which is released with the last
+ * reference to the kernel.
+ * Arguments:
+ *     const char *path - File written by write_kernel_file().
+ *     std::shared_ptr<const MappedKernel> *kernel - Receives the mapping.
+ * Returns:
+ *     int - 0 on success, -1 if the file is missing, truncated, corrupt or
+ *           from an incompatible writer.
+ */
+int map_kernel_file(const char *path, std::shared_ptr<const MappedKernel> *kernel) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KernelFileHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return -1;
+
+    auto mapped = std::make_shared<MappedKernel>();
+    mapped->header = (const KernelFileHeader *)data;
+    mapped->size = size;
+    if(!valid_kernel_file(*mapped->header, size)) return -1;
+
+    mapped->bytecode = (const Instruction *)(mapped->header + 1);
+    *kernel = mapped;
+    return 0;
+}
+
+/*
+ * Verify a mapped kernel's bytecode and check the verifier proves exactly
+ * what the header claims. The checksum only catches accidents, so the
+ * header's facts are never trusted on their own: the frame is sized and
+ * the unchecked handlers run from them.
+ * Arguments:
+ *     const KernelFileHeader& header - Header of a mapped kernel.
+ *     const Instruction *bytecode - The bytecode that follows it.
+ *     KernelInfo *info - Filled with the kernel's metadata.
+ * Returns:
+ *     int - 0 on success, -1 if the bytecode is rejected or disagrees with
+ *           the header.
+ */
+int verify_kernel_file(const KernelFileHeader& header, const Instruction *bytecode, KernelInfo *info) {
+    if(header.return_type >= KERNEL_ERROR || header.num_args > MAX_ARGS) return -1;
+    if(verify_bytecode(bytecode, header.length, (VMReturnType)header.return_type, info) < 0) return -1;
+    if((uint32_t)info->length != header.length || (uint32_t)info->max_stack != header.max_stack) return -1;
+
+    for(int type = I32; type <= BOOL; type++) {
+        if((uint32_t)info->slot_count[type] != header.slot_count[type]) return -1;
+        if(info->slot_read_first[type] != header.slot_read_first[type]) return -1;
+    }
+
+    for(int k = 0; k < MAX_ARGS; k++) {
+        uint32_t type = (uint32_t)k < header.num_args ? header.args[k].type : KERNEL_ARG_UNUSED;
+        if(info->arg_used[k] != (type != KERNEL_ARG_UNUSED)) return -1;
+        if(info->arg_used[k] && (uint32_t)info->arg_types[k] != type) return -1;
+    }
+    if(header.num_args > 0 && !info->arg_used[header.num_args - 1]) return -1;
+
+    return 0;
+}
+
+/*
+ * Check that a task's columns match the arguments a kernel declares.
+ * Arguments:
+ *     const KernelFileHeader& header - Header of the kernel to run.
+ *     const Column *columns - Columns of the task, by argument index.
+ *     int num_columns - Number of columns.
+ * Returns:
+ *     int - 0 if every argument the kernel reads has a column of its type,
+ *           -1 otherwise.
+ */
+int check_kernel_columns(const KernelFileHeader& header, const Column *columns, int num_columns) {
+    if(num_columns < (int)header.num_args) return -1;
+
+    for(uint32_t k = 0; k < header.num_args; k++) {
+        if(header.args[k].type == KERNEL_ARG_UNUSED) continue;
+        if(columns[k].data == nullptr || (uint32_t)columns[k].type != header.args[k].type) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include <math.h>
+#include <string.h>
+
+#include "optimizer.h"
+
+/*
+ * A value on the simulated stack. Straight-line bytecode computes every
+ * stack value with a contiguous run of instructions, starting at start and
+ * ending where the value above it starts.
+ */
+struct Value {
+    size_t start;
+    bool pure;      // No stores, RAND or trapping divisions, safe to delete
+};
+
+/*
+ * Bytecode being rewritten, with the stack of values it produces.
+ */
+struct Rewriter {
+    std::vector<Instruction> *out;
+    std::vector<Value> stack;
+
+    size_t end(size_t i) const {
+        return i + 1 < stack.size() ? stack[i+1].start : out->size();
+    }
+
+    /* Is the value i down from the top a single PUSH_CONST? */
+    bool is_const(size_t depth) const {
+        size_t i = stack.size() - 1 - depth;
+        return end(i) - stack[i].start == 1 && (*out)[stack[i].start].opcode == PUSH_CONST;
+    }
+
+    const Instruction& constant(size_t depth) const {
+        return (*out)[stack[stack.size() - 1 - depth].start];
+    }
+
+    /* Delete the instructions of the value depth down, keeping those above. */
+    void erase(size_t depth) {
+        size_t i = stack.size() - 1 - depth;
+        size_t start = stack[i].start, count = end(i) - start;
+        out->erase(out->begin() + start, out->begin() + start + count);
+        for(size_t k = i + 1; k < stack.size(); k++) stack[k].start -= count;
+        stack.erase(stack.begin() + i);
+    }
+
+    void push_const(TypeTag type, uint32_t bits) {
+        Instruction instr = { .opcode = PUSH_CONST, .type = type, .const_int = 0 };
+        if(type == BOOL) {
+            instr.const_bool = bits != 0;
+        } else {
+            memcpy(&instr.const_int, &bits, sizeof(bits));
+        }
+        stack.push_back({ out->size(), true });
+        out->push_back(instr);
+    }
+};
+
+/*
+ * Lane value of a PUSH_CONST, with booleans widened to a full mask.
+ */
+static uint32_t bits_of(const Instruction& instr) {
+    if(instr.type == BOOL) return instr.const_bool ? 0xFFFFFFFF : 0;
+
+    uint32_t bits;
+    memcpy(&bits, &instr.const_int, sizeof(bits));
+    return bits;
+}
+
+static float float_of(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static uint32_t bits_of(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/*
+ * Returns k if bits is the I32 constant 2^k with 1 <= k <= 30, else 0.
+ */
+static int log2_of(uint32_t bits) {
+    if(bits < 2 || bits > (1u << 30) || (bits & (bits - 1)) != 0) return 0;
+    return __builtin_ctz(bits);
+}
+
+/*
+ * Evaluate a binary operation on two constants exactly as the VM would.
+ * Arguments:
+ *     const Instruction& instr - Operation.
+ *     uint32_t a, b - Operand bits.
+ *     uint32_t *result - Result bits.
+ * Returns:
+ *     bool - False if the operation must be left to run time.
+ */
+static bool fold(const Instruction& instr, uint32_t a, uint32_t b, uint32_t *result) {
+    if(instr.type == I32) {
+        int32_t x = (int32_t)a, y = (int32_t)b;
+        switch(instr.opcode) {
+        case ADD: *result = a + b; return true;
+        case SUB: *result = a - b; return true;
+        case MUL: *result = a * b; return true;
+        case DIV:
+        case MOD:
+            // Division by zero must still fail when the kernel runs
+            if(y == 0 || (x == INT32_MIN && y == -1)) return false;
+            *result = instr.opcode == DIV ? x / y : x % y;
+            return true;
+        case CMP_LT: *result = x < y ? 0xFFFFFFFF : 0; return true;
+        case CMP_LTE: *result = x <= y ? 0xFFFFFFFF : 0; return true;
+        case CMP_GT: *result = x > y ? 0xFFFFFFFF : 0; return true;
+        case CMP_GTE: *result = x >= y ? 0xFFFFFFFF : 0; return true;
+        case CMP_EQ: *result = x == y ? 0xFFFFFFFF : 0; return true;
+        case CMP_NE: *result = x != y ? 0xFFFFFFFF : 0; return true;
+        default: return false;
+        }
+    }
+
+    if(instr.type == F32) {
+        float x = float_of(a), y = float_of(b);
+        switch(instr.opcode) {
+        case ADD: *result = bits_of(x + y); return true;
+        case SUB: *result = bits_of(x - y); return true;
+        case MUL: *result = bits_of(x * y); return true;
+        case DIV: *result = bits_of(x / y); return true;
+        case CMP_LT: *result = x < y ? 0xFFFFFFFF : 0; return true;
+        case CMP_LTE: *result = x <= y ? 0xFFFFFFFF : 0; return true;
+        case CMP_GT: *result = x > y ? 0xFFFFFFFF : 0; return true;
+        case CMP_GTE: *result = x >= y ? 0xFFFFFFFF : 0; return true;
+        case CMP_EQ: *result = x == y ? 0xFFFFFFFF : 0; return true;
+        case CMP_NE:
+            // SSE and AVX disagree on NaN != NaN, leave it to the VM
+            if(isnan(x) || isnan(y)) return false;
+            *result = x != y ? 0xFFFFFFFF : 0;
+            return true;
+        default: return false;
+        }
+    }
+
+    switch(instr.opcode) {
+    case AND: *result = a & b; return true;
+    case OR: *result = a | b; return true;
+    default: return false;
+    }
+}
+
+/*
+ * Is the constant c, on the right of op, an identity (x op c == x)?
+ */
+static bool right_identity(const Instruction& instr, uint32_t c) {
+    if(instr.type == I32) {
+        switch(instr.opcode) {
+        case ADD: case SUB: return c == 0;
+        case MUL: case DIV: return c == 1;
+        default: return false;
+        }
+    }
+    if(instr.type == F32) {
+        // x + 0.0 is not x for x = -0.0, but x + -0.0 and x - 0.0 are. These
+        // only differ from the VM for signalling NaNs, which it would quiet
+        switch(instr.opcode) {
+        case ADD: return c == 0x80000000;
+        case SUB: return c == 0;
+        case MUL: case DIV: return c == 0x3F800000;
+        default: return false;
+        }
+    }
+    switch(instr.opcode) {
+    case AND: return c == 0xFFFFFFFF;
+    case OR: return c == 0;
+    default: return false;
+    }
+}
+
+/*
+ * Is the constant c, on the left of op, an identity (c op x == x)?
+ */
+static bool left_identity(const Instruction& instr, uint32_t c) {
+    if(instr.opcode == SUB || instr.opcode == DIV) return false;
+    return right_identity(instr, c);
+}
+
+/*
+ * Does c on either side force the result regardless of the other operand?
+ * Returns:
+ *     bool - True with *result set if it does.
+ */
+static bool annihilator(const Instruction& instr, uint32_t c, bool right, uint32_t *result) {
+    if(instr.type == I32) {
+        if(instr.opcode == MUL && c == 0) { *result = 0; return true; }
+        if(instr.opcode == MOD && right && c == 1) { *result = 0; return true; }
+        return false;
+    }
+    if(instr.type == BOOL) {
+        if(instr.opcode == AND && c == 0) { *result = 0; return true; }
+        if(instr.opcode == OR && c == 0xFFFFFFFF) { *result = 0xFFFFFFFF; return true; }
+    }
+    return false;
+}
+
+/*
+ * Optimize a verified kernel: fold constant subtrees, apply algebraic
+ * identities per type, remove double negations and SELECTs on constant
+ * conditions, and turn integer MUL/DIV/MOD by powers of two into
+ * SHL/DIV_POW2/MOD_POW2. Results are bit-exact with the original kernel,
+ * including divide by zero errors and the sequence of RAND values.
+ * Arguments:
+ *     const Instruction *bytecode - Verified kernel.
+ *     const KernelInfo& info - Metadata from verify_bytecode().
+ *     std::vector<Instruction> *optimized - Receives the optimized kernel.
+ * Returns:
+ *     int - 0 on success.
+ */
+int optimize_bytecode(const Instruction *bytecode, const KernelInfo& info, std::vector<Instruction> *optimized) {
+    optimized->clear();
+    Rewriter rw = { optimized, {} };
+    std::vector<Instruction>& out = *optimized;
+
+    for(int pc = 0; pc < info.length; pc++) {
+        const Instruction& instr = bytecode[pc];
+
+        switch(instr.opcode) {
+        case PUSH_CONST:
+        case LOAD_VAR:
+        case LOAD_ARG:
+        case SQUARE_VAR:
+            rw.stack.push_back({ out.size(), true });
+            out.push_back(instr);
+            break;
+        case RAND:
+            // Dropping a RAND would shift every later random number
+            rw.stack.push_back({ out.size(), false });
+            out.push_back(instr);
+            break;
+        case STORE_VAR:
+            rw.stack.pop_back();
+            out.push_back(instr);
+
+            // The store now sits inside the value below, which must stay
+            if(!rw.stack.empty()) rw.stack.back().pure = false;
+            break;
+        case NOT:
+            if(rw.is_const(0)) {
+                uint32_t bits = bits_of(rw.constant(0));
+                rw.erase(0);
+                rw.push_const(BOOL, ~bits);
+            } else if(out.back().opcode == NOT) {
+                out.pop_back();
+            } else {
+                out.push_back(instr);
+            }
+            break;
+        case SHL:
+        case DIV_POW2:
+        case MOD_POW2:
+            out.push_back(instr);
+            break;
+        case CMP_SELECT_CONST: {
+            // Copy the compare together with its two operand words
+            Value b = rw.stack.back();
+            rw.stack.pop_back();
+            rw.stack.back().pure = rw.stack.back().pure && b.pure;
+            out.insert(out.end(), &bytecode[pc], &bytecode[pc+3]);
+            pc += 2;
+            break;
+        }
+        case FMA:
+        case SELECT: {
+            if(instr.opcode == FMA || !rw.is_const(2)) {
+                Value a = rw.stack[rw.stack.size() - 2], b = rw.stack.back();
+                rw.stack.pop_back();
+                rw.stack.pop_back();
+                rw.stack.back().pure = rw.stack.back().pure && a.pure && b.pure;
+                out.push_back(instr);
+                break;
+            }
+
+            // Constant condition, keep the chosen value if the other can go
+            bool taken = bits_of(rw.constant(2)) != 0;
+            Value a = rw.stack[rw.stack.size() - 2], b = rw.stack.back();
+            if(taken && b.pure) {
+                rw.erase(0);
+                rw.erase(1);
+            } else if(!taken && a.pure) {
+                rw.erase(1);
+                rw.erase(1);
+            } else {
+                rw.stack.pop_back();
+                rw.stack.pop_back();
+                rw.stack.back().pure = a.pure && b.pure;
+                out.push_back(instr);
+            }
+            break;
+        }
+        case RETURN:
+            out.push_back(instr);
+            return 0;
+        default: {
+            // Binary operations
+            bool a_const = rw.is_const(1), b_const = rw.is_const(0);
+            uint32_t a_bits = a_const ? bits_of(rw.constant(1)) : 0;
+            uint32_t b_bits = b_const ? bits_of(rw.constant(0)) : 0;
+            uint32_t result;
+            bool is_int = instr.type == I32;
+            TypeTag result_type = instr.opcode >= CMP_LT && instr.opcode <= CMP_NE ? BOOL : instr.type;
+
+            if(a_const && b_const && fold(instr, a_bits, b_bits, &result)) {
+                rw.erase(0);
+                rw.erase(0);
+                rw.push_const(result_type, result);
+                break;
+            }
+
+            if(b_const && right_identity(instr, b_bits)) {
+                rw.erase(0);
+                break;
+            }
+            if(a_const && left_identity(instr, a_bits)) {
+                rw.erase(1);
+                break;
+            }
+
+            if(b_const && rw.stack[rw.stack.size() - 2].pure && annihilator(instr, b_bits, true, &result)) {
+                rw.erase(0);
+                rw.erase(0);
+                rw.push_const(result_type, result);
+                break;
+            }
+            if(a_const && rw.stack.back().pure && annihilator(instr, a_bits, false, &result)) {
+                rw.erase(0);
+                rw.erase(0);
+                rw.push_const(result_type, result);
+                break;
+            }
+
+            // Strength reduction of integer MUL/DIV/MOD by 2^k
+            int k = is_int && b_const ? log2_of(b_bits) : 0;
+            if(k > 0 && (instr.opcode == MUL || instr.opcode == DIV || instr.opcode == MOD)) {
+                static const OpCode reduced[] = { SHL, DIV_POW2, MOD_POW2 };
+                rw.erase(0);
+                out.push_back({ .opcode = reduced[instr.opcode - MUL], .type = I32, .shift = k });
+                break;
+            }
+            k = is_int && a_const ? log2_of(a_bits) : 0;
+            if(k > 0 && instr.opcode == MUL) {
+                rw.erase(1);
+                out.push_back({ .opcode = SHL, .type = I32, .shift = k });
+                break;
+            }
+
+            Value b = rw.stack.back();
+            rw.stack.pop_back();
+
+            // Integer division can trap, so it can never be deleted
+            Value& a = rw.stack.back();
+            a.pure = a.pure && b.pure && !(is_int && (instr.opcode == DIV || instr.opcode == MOD));
+            out.push_back(instr);
+            break;
+        }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Fuse common instruction sequences of a verified kernel into
+ * superinstructions:
+ *     LOAD_VAR s; LOAD_VAR s; MUL             -> SQUARE_VAR s
+ *     MUL; ADD                                -> FMA
+ *     CMP_x; PUSH_CONST t; PUSH_CONST f; SELECT -> CMP_SELECT_CONST x; t; f
+ * Integer MUL; ADD always fuses. Float MUL; ADD only fuses when contract is
+ * set, since a fused multiply-add rounds once and can differ in the last bit
+ * from the separate MUL and ADD.
+ * Arguments:
+ *     const Instruction *bytecode - Verified kernel.
+ *     const KernelInfo& info - Metadata from verify_bytecode().
+ *     std::vector<Instruction> *fused - Receives the fused kernel.
+ *     bool contract - Allow float MUL; ADD to become FMA.
+ * Returns:
+ *     int - 0 on success.
+ */
+int fuse_superinstructions(const Instruction *bytecode, const KernelInfo& info, std::vector<Instruction> *fused, bool contract) {
+    fused->clear();
+    std::vector<Instruction>& out = *fused;
+
+    for(int pc = 0; pc < info.length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        size_t n = out.size();
+
+        switch(instr.opcode) {
+        case MUL:
+            if(n >= 2 && out[n-1].opcode == LOAD_VAR && out[n-2].opcode == LOAD_VAR &&
+               out[n-1].type == instr.type && out[n-2].type == instr.type && out[n-1].slot == out[n-2].slot) {
+                out.pop_back();
+                out.back().opcode = SQUARE_VAR;
+                continue;
+            }
+            break;
+        case ADD:
+            if(n >= 1 && out[n-1].opcode == MUL && out[n-1].type == instr.type && (instr.type == I32 || contract)) {
+                out.back().opcode = FMA;
+                continue;
+            }
+            break;
+        case SELECT:
+            if(n >= 3 && out[n-3].opcode >= CMP_LT && out[n-3].opcode <= CMP_NE &&
+               out[n-2].opcode == PUSH_CONST && out[n-1].opcode == PUSH_CONST) {
+                Instruction& compare = out[n-3];
+                compare.compare = compare.opcode;
+                compare.opcode = CMP_SELECT_CONST;
+                continue;
+            }
+            break;
+        case CMP_SELECT_CONST:
+            // The operand words must stay behind their compare, not fuse on
+            out.insert(out.end(), &bytecode[pc], &bytecode[pc+3]);
+            pc += 2;
+            continue;
+        case RETURN:
+            out.push_back(instr);
+            return 0;
+        default:
+            break;
+        }
+
+        out.push_back(instr);
+    }
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include "scheduler.h"
+#include "verifier.h"
+
+/*
+ * Static cost model. Each opcode costs a few units per vector, roughly
+ * cycles on a core at nominal clock including dispatch. I32 DIV/MOD by a
+ * value that is not a constant converts to double vectors and divides
+ * there, the dearest operation in the VM; by a constant the register form
+ * turns it into a multiply and shifts.
+ */
+
+/* Units per vector, by OpCode. */
+static const double vector_units[] = {
+    1,      // PUSH_CONST
+    1,      // LOAD_VAR
+    1,      // STORE_VAR
+    1,      // ADD
+    1,      // SUB
+    2,      // MUL
+    4,      // DIV, F32 or I32 by a constant
+    5,      // MOD, I32 by a constant
+    1,      // CMP_LT
+    1,      // CMP_LTE
+    1,      // CMP_GT
+    1,      // CMP_GTE
+    1,      // CMP_EQ
+    1,      // CMP_NE
+    1,      // AND
+    1,      // OR
+    1,      // NOT
+    2,      // SELECT
+    8,      // RAND
+    1,      // RETURN
+    2,      // LOAD_ARG
+    1,      // SHL
+    3,      // DIV_POW2
+    3,      // MOD_POW2
+    2,      // SQUARE_VAR
+    2,      // FMA
+    3,      // CMP_SELECT_CONST, operand words included
+};
+
+static_assert(sizeof(vector_units) / sizeof(vector_units[0]) == NUM_OPCODES, "one weight per opcode");
+
+/* Units per vector of an I32 DIV/MOD by a value that is not a constant. */
+constexpr double VECTOR_DIVIDE_UNITS = 24;
+
+/*
+ * Estimate what one instance of a kernel costs from its bytecode alone.
+ * The stack is followed to tell which divisors are constants the VM
+ * divides by with a multiply, wherever they were pushed.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel.
+ *     int length - Instructions up to and including RETURN.
+ *     KernelCost *cost - Receives the estimate.
+ * Returns:
+ *     int - 0 on success, -1 if an opcode is unknown or the stack underflows.
+ */
+int estimate_cost(const Instruction *bytecode, int length, KernelCost *cost) {
+    cost->vector_units = 0;
+
+    // Per stack value, is it an I32 constant the VM has a magic divisor for?
+    std::vector<bool> constant;
+    for(int pc = 0; pc < length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        if(instr.opcode < PUSH_CONST || instr.opcode >= NUM_OPCODES) return -1;
+
+        int pops, pushes = 1;
+        switch(instr.opcode) {
+        case PUSH_CONST:
+        case LOAD_VAR:
+        case LOAD_ARG:
+        case RAND:
+        case SQUARE_VAR:
+            pops = 0;
+            break;
+        case STORE_VAR:
+            pops = 1;
+            pushes = 0;
+            break;
+        case SHL:
+        case DIV_POW2:
+        case MOD_POW2:
+        case NOT:
+            pops = 1;
+            break;
+        case SELECT:
+        case FMA:
+            pops = 3;
+            break;
+        case RETURN:
+            pops = 1;
+            pushes = 0;
+            break;
+        default:
+            // Binary operations and CMP_SELECT_CONST
+            pops = 2;
+            break;
+        }
+        if((int)constant.size() < pops) return -1;
+
+        bool by_column = (instr.opcode == DIV || instr.opcode == MOD) && instr.type == I32 && !constant.back();
+        cost->vector_units += by_column ? VECTOR_DIVIDE_UNITS : vector_units[instr.opcode];
+
+        constant.resize(constant.size() - pops);
+        if(pushes > 0) {
+            constant.push_back(instr.opcode == PUSH_CONST && instr.type == I32
+                && instr.const_int != 0 && instr.const_int != 1 && instr.const_int != -1);
+        }
+
+        // The two constants to select between are operands, not instructions
+        if(instr.opcode == CMP_SELECT_CONST) pc += 2;
+        if(instr.opcode == RETURN) break;
+    }
+
+    return 0;
+}
+
+/*
+ * Cost of one instance on a node with the given vector width.
+ */
+double instance_cost(const KernelCost& cost, int lanes) {
+    return cost.vector_units / lanes;
+}
+
+/*
+ * Register a node.
+ * Arguments:
+ *     int lanes - 32-bit lanes per vector.
+ *     int cores - Cores the node runs workers on.
+ *     double throughput - Cost units per second per core, 0 if unmeasured.
+ * Returns:
+ *     int - Id of the node, -1 if the description is invalid.
+ */
+int NodeRegistry::add_node(int lanes, int cores, double throughput) {
+    if(lanes <= 0 || cores <= 0 || throughput < 0) return -1;
+
+    nodes.push_back({ next_id, lanes, cores, throughput });
+    return next_id++;
+}
+
+/*
+ * Drop a node, e.g. when it leaves the cluster.
+ * Returns:
+ *     int - 0 on success, -1 if no node has this id.
+ */
+int NodeRegistry::remove_node(int id) {
+    for(size_t i = 0; i < nodes.size(); i++) {
+        if(nodes[i].id != id) continue;
+
+        nodes.erase(nodes.begin() + i);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Look up a node.
+ * Returns:
+ *     const NodeInfo * - The node, nullptr if no node has this id.
+ */
+const NodeInfo *NodeRegistry::find(int id) const {
+    for(const NodeInfo& node : nodes) {
+        if(node.id == id) return &node;
+    }
+    return nullptr;
+}
+
+/*
+ * Fold a finished run into a node's throughput, so later placements
+ * follow what the node actually delivers.
+ * Arguments:
+ *     int id - Node that ran the work.
+ *     double cost_units - Estimated cost of the work, count * instance_cost().
+ *     double seconds - Wall time the node took.
+ * Returns:
+ *     int - 0 on success, -1 for an unknown node or an empty run.
+ */
+int NodeRegistry::record_run(int id, double cost_units, double seconds) {
+    if(cost_units <= 0 || seconds <= 0) return -1;
+
+    for(NodeInfo& node : nodes) {
+        if(node.id != id) continue;
+
+        double measured = cost_units / seconds / node.cores;
+        if(node.throughput == 0) node.throughput = measured;
+        else node.throughput += THROUGHPUT_SMOOTHING * (measured - node.throughput);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Split a task over the registered nodes so that all of them are predicted
+ * to finish together: each node's share of the range is proportional to
+ * its cores times throughput over its cost per instance. Shares are whole
+ * vectors of the node, and the instances rounding leaves over go to
+ * whichever node then finishes first.
+ * Arguments:
+ *     const Task& task - Task to place, checked by the verifier.
+ *     const NodeRegistry& registry - Nodes to place on.
+ *     std::vector<Placement> *placements - Receives contiguous slices of
+ *         the task in node order, nodes with nothing to do left out.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is invalid or there are no nodes.
+ */
+int place_task(const Task& task, const NodeRegistry& registry, std::vector<Placement> *placements) {
+    placements->clear();
+
+    KernelInfo info;
+    KernelCost cost;
+    if(verify_bytecode(task.bytecode, task.length, task.return_type, &info) < 0) return -1;
+    if(estimate_cost(task.bytecode, info.length, &cost) < 0) return -1;
+
+    const std::vector<NodeInfo>& nodes = registry.list();
+    if(nodes.empty()) return -1;
+
+    // Instances per second of each node
+    std::vector<double> rates;
+    double total = 0;
+    for(const NodeInfo& node : nodes) {
+        double throughput = node.throughput > 0 ? node.throughput : DEFAULT_THROUGHPUT;
+        rates.push_back(node.cores * throughput / instance_cost(cost, node.lanes));
+        total += rates.back();
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t left = task.count;
+    for(size_t i = 0; i < nodes.size(); i++) {
+        uint64_t vectors = (uint64_t)(task.count * (rates[i] / total)) / nodes[i].lanes;
+        uint64_t share = vectors * nodes[i].lanes;
+        counts.push_back(share < left ? share : left);
+        left -= counts[i];
+    }
+
+    while(left > 0) {
+        size_t best = 0;
+        double best_finish = 0;
+        for(size_t i = 0; i < nodes.size(); i++) {
+            uint64_t step = left < (uint64_t)nodes[i].lanes ? left : nodes[i].lanes;
+            double finish = (counts[i] + step) / rates[i];
+            if(i == 0 || finish < best_finish) {
+                best = i;
+                best_finish = finish;
+            }
+        }
+
+        uint64_t step = left < (uint64_t)nodes[best].lanes ? left : nodes[best].lanes;
+        counts[best] += step;
+        left -= step;
+    }
+
+    uint64_t first = task.first_instance;
+    for(size_t i = 0; i < nodes.size(); i++) {
+        if(counts[i] == 0) continue;
+
+        placements->push_back({ nodes[i].id, first, counts[i], counts[i] / rates[i] });
+        first += counts[i];
+    }
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "topology.h"
+
+/*
+ * Parse a kernel CPU list such as "0-3,8,10-11".
+ * Arguments:
+ *     const char *text - List as found in /sys.
+ *     std::vector<int> *cpus - Receives the CPUs in the order listed.
+ * Returns:
+ *     int - 0 on success, -1 if the list is malformed.
+ */
+int parse_cpulist(const char *text, std::vector<int> *cpus) {
+    cpus->clear();
+
+    const char *p = text;
+    while(*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0) return -1;
+
+        long last = first;
+        p = end;
+        if(*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first) return -1;
+            p = end;
+        }
+
+        for(long cpu = first; cpu <= last; cpu++) cpus->push_back((int)cpu);
+
+        if(*p == ',') p++;
+        else if(*p != '\0' && *p != '\n') return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read a one-line sysfs file.
+ */
+static int read_line(const char *path, char *line, int size) {
+    FILE *file = fopen(path, "r");
+    if(file == nullptr) return -1;
+
+    bool ok = fgets(line, size, file) != nullptr;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Find the NUMA nodes and the CPUs of each that this process may use,
+ * from /sys/devices/system/node. Nodes left without usable CPUs are
+ * dropped. Without NUMA information every usable CPU is put in node 0.
+ * Arguments:
+ *     Topology *topology - Filled with the nodes and their CPUs.
+ * Returns:
+ *     int - 0 on success, -1 if the usable CPUs cannot be determined.
+ */
+int discover_topology(Topology *topology) {
+    topology->nodes.clear();
+    topology->node_ids.clear();
+
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
+
+    char line[4096];
+    std::vector<int> node_ids, cpus;
+    if(read_line("/sys/devices/system/node/online", line, sizeof(line)) == 0) parse_cpulist(line, &node_ids);
+
+    for(int id : node_ids) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if(read_line(path, line, sizeof(line)) < 0 || parse_cpulist(line, &cpus) < 0) continue;
+
+        std::vector<int> usable;
+        for(int cpu : cpus) {
+            if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) usable.push_back(cpu);
+        }
+        if(usable.empty()) continue;
+
+        topology->nodes.push_back(usable);
+        topology->node_ids.push_back(id);
+    }
+
+    if(topology->nodes.empty()) {
+        std::vector<int> usable;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &allowed)) usable.push_back(cpu);
+        }
+        if(usable.empty()) return -1;
+
+        topology->nodes.push_back(usable);
+        topology->node_ids.push_back(0);
+    }
+
+    return 0;
+}
+
+/*
+ * Pin the calling thread to one CPU.
+ * Arguments:
+ *     int cpu - CPU to run on.
+ * Returns:
+ *     int - 0 on success, -1 if the CPU is not available.
+ */
+int pin_thread(int cpu) {
+    if(cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+/*
+ * Prefer a NUMA node for the whole pages of a buffer and move the pages
+ * already touched there. Partial pages at either end are left alone, as
+ * they are shared with the neighbouring range.
+ * Arguments:
+ *     const void *data - Start of the range.
+ *     size_t bytes - Length of the range.
+ *     int node_id - Kernel number of the node.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel refused.
+ */
+int bind_pages(const void *data, size_t bytes, int node_id) {
+    if(node_id < 0 || node_id >= 64) return -1;
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)data + bytes) & ~(page - 1);
+    if(end <= begin) return 0;
+
+    unsigned long mask = 1UL << node_id;
+    // The kernel reads maxnode - 1 bits of the mask
+    long status = syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE);
+    return status == 0 ? 0 : -1;
+}
@@ -0,0 +1,294 @@
+#include <string.h>
+
+#include "translate.h"
+
+/*
+ * Lane value of a PUSH_CONST, with booleans widened to a full mask.
+ */
+static inline uint32_t constant_bits(const Instruction& instr) {
+    if(instr.type == BOOL) return instr.const_bool ? 0xFFFFFFFF : 0;
+
+    uint32_t bits;
+    memcpy(&bits, &instr.const_int, sizeof(bits));
+    return bits;
+}
+
+/*
+ * Compute the magic number for signed division by a constant, following
+ * Granlund and Montgomery as given in Hacker's Delight (10-1).
+ * Arguments:
+ *     int32_t divisor - Constant divisor.
+ *     DivMagic *magic - Filled with the multiplier and shift.
+ * Returns:
+ *     int - 0 on success, -1 for divisors -1, 0 and 1 that have no magic.
+ */
+int div_magic(int32_t divisor, DivMagic *magic) {
+    if(divisor >= -1 && divisor <= 1) return -1;
+
+    const uint32_t two31 = 0x80000000;
+    uint32_t ad = divisor < 0 ? 0u - (uint32_t)divisor : (uint32_t)divisor;
+    uint32_t t = two31 + ((uint32_t)divisor >> 31);
+    uint32_t anc = t - 1 - t % ad;     // |nc|, the largest multiple of ad below t
+    int p = 31;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+
+    uint32_t multiplier = q2 + 1;
+    if(divisor < 0) multiplier = 0u - multiplier;
+
+    magic->divisor = divisor;
+    magic->multiplier = (int32_t)multiplier;
+    magic->shift = p - 32;
+    magic->adjust = 0;
+    if(divisor > 0 && magic->multiplier < 0) magic->adjust = 1;
+    if(divisor < 0 && magic->multiplier > 0) magic->adjust = -1;
+    return 0;
+}
+
+/*
+ * Typed register opcode for a stack opcode and its operand type.
+ * Arguments:
+ *     OpCode opcode - Stack opcode.
+ *     TypeTag type - Operand type.
+ * Returns:
+ *     RegOp - Register opcode specialized for the type.
+ */
+static RegOp typed_op(OpCode opcode, TypeTag type) {
+    bool is_float = type == F32;
+
+    switch(opcode) {
+    case STORE_VAR: return MOVE;
+    case LOAD_ARG: return type == BOOL ? LOAD_MASK : LOAD_COLUMN;
+    case ADD: return is_float ? ADD_F32 : ADD_I32;
+    case SUB: return is_float ? SUB_F32 : SUB_I32;
+    case MUL: return is_float ? MUL_F32 : MUL_I32;
+    case DIV: return is_float ? DIV_F32 : DIV_I32;
+    case MOD: return MOD_I32;
+    case SHL: return SHL_I32;
+    case DIV_POW2: return DIV_POW2_I32;
+    case MOD_POW2: return MOD_POW2_I32;
+    case CMP_LT:
+    case CMP_LTE:
+    case CMP_GT:
+    case CMP_GTE:
+    case CMP_EQ:
+    case CMP_NE:
+        return (RegOp)((is_float ? CMP_LT_F32 : CMP_LT_I32) + (opcode - CMP_LT));
+    case FMA: return is_float ? FMA_F32 : FMA_I32;
+    case AND: return AND_BOOL;
+    case OR: return OR_BOOL;
+    case NOT: return NOT_BOOL;
+    case SELECT: return BLEND;
+    case RAND: return RAND_F32;
+    default: return RET;
+    }
+}
+
+/*
+ * Translate verified stack bytecode into register form. The stack is
+ * simulated with register numbers instead of values: constants and
+ * variable loads just push their register, so most PUSH_CONST/LOAD_VAR
+ * instructions disappear, and a STORE_VAR right after the instruction that
+ * computed the value becomes that instruction's destination. Every
+ * instruction is given its typed opcode here, once, at load time.
+ * Arguments:
+ *     const Instruction *bytecode - Verified kernel.
+ *     const KernelInfo& info - Metadata from verify_bytecode().
+ *     RegProgram *program - Filled with the register form.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel needs more than MAX_REGS registers.
+ */
+int translate_bytecode(const Instruction *bytecode, const KernelInfo& info, RegProgram *program) {
+    program->code.clear();
+    program->constants.clear();
+    program->divisors.clear();
+
+    int next = 0;
+    for(int type = I32; type <= BOOL; type++) {
+        program->slot_base[type] = next;
+        next += info.slot_count[type];
+    }
+    program->num_slot_regs = next;
+
+    // Constants are deduplicated by type and bit pattern
+    std::vector<TypeTag> constant_types;
+    for(int pc = 0; pc < info.length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        if(instr.opcode != PUSH_CONST) continue;
+
+        uint32_t bits = constant_bits(instr);
+
+        bool found = false;
+        for(size_t k = 0; k < program->constants.size(); k++) {
+            if(program->constants[k].bits == bits && constant_types[k] == instr.type) found = true;
+        }
+        if(found) continue;
+
+        if(next >= MAX_REGS) return -1;
+        program->constants.push_back({ (uint8_t)next++, bits });
+        constant_types.push_back(instr.type);
+    }
+
+    int const_base = program->num_slot_regs;
+    int temp_base = next;
+    if(temp_base + info.max_stack > MAX_REGS) return -1;
+    program->num_regs = temp_base + info.max_stack;
+
+    uint8_t stack[MAX_STACK];
+    int depth = 0;
+
+    for(int pc = 0; pc < info.length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        RegInstruction out = { typed_op(instr.opcode, instr.type), 0, 0, 0, 0, 0 };
+
+        switch(instr.opcode) {
+        case PUSH_CONST: {
+            uint32_t bits = constant_bits(instr);
+
+            for(size_t k = 0; k < program->constants.size(); k++) {
+                if(program->constants[k].bits == bits && constant_types[k] == instr.type) {
+                    stack[depth++] = program->constants[k].reg;
+                    break;
+                }
+            }
+            continue;
+        }
+        case LOAD_VAR:
+            stack[depth++] = program->slot_base[instr.type] + instr.slot;
+            continue;
+        case SQUARE_VAR:
+            out.op = typed_op(MUL, instr.type);
+            out.a = out.b = program->slot_base[instr.type] + instr.slot;
+            out.dst = temp_base + depth;
+            stack[depth++] = out.dst;
+            break;
+        case CMP_SELECT_CONST: {
+            // Registers need no fusing, emit the compare and the select
+            out.op = typed_op(instr.compare, instr.type);
+            out.b = stack[--depth];
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            program->code.push_back(out);
+
+            uint8_t values[2];
+            for(int k = 0; k < 2; k++) {
+                const Instruction& value = bytecode[pc + 1 + k];
+                for(size_t j = 0; j < program->constants.size(); j++) {
+                    if(program->constants[j].bits == constant_bits(value) && constant_types[j] == value.type) {
+                        values[k] = program->constants[j].reg;
+                    }
+                }
+            }
+
+            out = { BLEND, out.dst, out.dst, values[0], values[1], 0 };
+            pc += 2;
+            break;
+        }
+        case LOAD_ARG:
+        case RAND:
+            out.dst = temp_base + depth;
+            out.arg = instr.opcode == LOAD_ARG ? instr.arg : 0;
+            stack[depth++] = out.dst;
+            break;
+        case STORE_VAR: {
+            uint8_t value = stack[--depth];
+            uint8_t slot = program->slot_base[instr.type] + instr.slot;
+
+            // Values still on the stack that were loaded from this slot must
+            // keep the old value, copy them out before it is overwritten
+            bool spilled = false;
+            for(int i = 0; i < depth; i++) {
+                if(stack[i] != slot) continue;
+                program->code.push_back({ MOVE, (uint8_t)(temp_base + i), slot, 0, 0, 0 });
+                stack[i] = temp_base + i;
+                spilled = true;
+            }
+
+            if(value == slot) continue;
+
+            // Write the result straight into the slot instead of copying it
+            if(!spilled && value == temp_base + depth && !program->code.empty()
+                    && program->code.back().dst == value && program->code.back().op != RET) {
+                program->code.back().dst = slot;
+                continue;
+            }
+
+            out.dst = slot;
+            out.a = value;
+            break;
+        }
+        case NOT:
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            stack[depth-1] = out.dst;
+            break;
+        case SHL:
+        case DIV_POW2:
+        case MOD_POW2:
+            out.arg = instr.shift;
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            stack[depth-1] = out.dst;
+            break;
+        case FMA:
+        case SELECT:
+            out.c = stack[--depth];
+            out.b = stack[--depth];
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            stack[depth-1] = out.dst;
+            break;
+        case RETURN:
+            out.a = stack[depth-1];
+            break;
+        case DIV:
+        case MOD: {
+            out.b = stack[--depth];
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            stack[depth-1] = out.dst;
+
+            // Constant divisors divide with a precomputed magic number, as
+            // long as the index still fits the arg byte
+            DivMagic magic;
+            int k = out.b - const_base;
+            if(instr.type == I32 && k >= 0 && out.b < temp_base && program->divisors.size() <= UINT8_MAX
+                    && div_magic((int32_t)program->constants[k].bits, &magic) == 0) {
+                out.op = instr.opcode == MOD ? MOD_MAGIC_I32 : DIV_MAGIC_I32;
+                out.arg = program->divisors.size();
+                program->divisors.push_back(magic);
+            }
+            break;
+        }
+        default:
+            // Binary operations
+            out.b = stack[--depth];
+            out.a = stack[depth-1];
+            out.dst = temp_base + depth - 1;
+            stack[depth-1] = out.dst;
+            break;
+        }
+
+        program->code.push_back(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "tuner.h"
+
+/*
+ * Startup calibration. The widest ISA is not always the fastest, so each
+ * engine configuration the host supports runs a representative kernel per
+ * shape for a short budget, and the fastest is kept in a host profile.
+ * Workers load the profile on boot instead of calibrating again.
+ */
+
+static const char *const shape_names[SHAPE_COUNT] = { "int", "float", "divide", "random" };
+static const char *const mode_names[ENGINE_MODE_COUNT] = { "stack", "register", "jit" };
+
+/* Lanes per calibration batch, a multiple of every engine's width. */
+constexpr size_t CALIBRATE_N = 4096;
+
+/* Representative kernels, indexed by KernelShape. */
+static const Instruction int_kernel[] = {
+    { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+    { .opcode = PUSH_CONST, .type = I32, .const_int = 65537 },
+    { .opcode = MUL, .type = I32, .const_int = 0 },
+    { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+    { .opcode = ADD, .type = I32, .const_int = 0 },
+    { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+    { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+    { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+    { .opcode = CMP_LT, .type = I32, .const_int = 0 },
+    { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+    { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+    { .opcode = SELECT, .type = I32, .const_int = 0 },
+    { .opcode = RETURN, .type = I32, .const_int = 0 },
+};
+
+static const Instruction float_kernel[] = {
+    { .opcode = LOAD_ARG, .type = F32, .arg = 2 },
+    { .opcode = STORE_VAR, .type = F32, .slot = 0 },
+    { .opcode = LOAD_ARG, .type = F32, .arg = 3 },
+    { .opcode = STORE_VAR, .type = F32, .slot = 1 },
+    { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+    { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+    { .opcode = MUL, .type = F32, .const_int = 0 },
+    { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+    { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+    { .opcode = MUL, .type = F32, .const_int = 0 },
+    { .opcode = ADD, .type = F32, .const_int = 0 },
+    { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+    { .opcode = SUB, .type = F32, .const_int = 0 },
+    { .opcode = RETURN, .type = F32, .const_int = 0 },
+};
+
+static const Instruction divide_kernel[] = {
+    { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+    { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+    { .opcode = DIV, .type = I32, .const_int = 0 },
+    { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+    { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+    { .opcode = MOD, .type = I32, .const_int = 0 },
+    { .opcode = ADD, .type = I32, .const_int = 0 },
+    { .opcode = RETURN, .type = I32, .const_int = 0 },
+};
+
+static const Instruction random_kernel[] = {
+    { .opcode = RAND, .type = F32, .const_int = 0 },
+    { .opcode = RAND, .type = F32, .const_int = 0 },
+    { .opcode = MUL, .type = F32, .const_int = 0 },
+    { .opcode = PUSH_CONST, .type = F32, .const_float = 0.25f },
+    { .opcode = CMP_LT, .type = F32, .const_int = 0 },
+    { .opcode = RETURN, .type = BOOL, .const_int = 0 },
+};
+
+struct CalibrationKernel {
+    const Instruction *bytecode;
+    int length;
+    VMReturnType type;
+};
+
+static const CalibrationKernel kernels[SHAPE_COUNT] = {
+    { int_kernel, sizeof(int_kernel) / sizeof(Instruction), KERNEL_I32 },
+    { float_kernel, sizeof(float_kernel) / sizeof(Instruction), KERNEL_F32 },
+    { divide_kernel, sizeof(divide_kernel) / sizeof(Instruction), KERNEL_I32 },
+    { random_kernel, sizeof(random_kernel) / sizeof(Instruction), KERNEL_BOOL },
+};
+
+/*
+ * Classify a kernel by the work that dominates it.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel to classify.
+ *     int length - Instructions up to and including RETURN.
+ * Returns:
+ *     KernelShape - The shape whose calibrated engine should run the kernel.
+ */
+KernelShape kernel_shape(const Instruction *bytecode, int length) {
+    bool divides = false;
+    int float_ops = 0, int_ops = 0;
+    for(int pc = 0; pc < length; pc++) {
+        const Instruction& instr = bytecode[pc];
+        if(instr.opcode == RAND) return SHAPE_RANDOM;
+        if((instr.opcode == DIV || instr.opcode == MOD) && instr.type == I32) divides = true;
+        if(instr.type == F32) float_ops++;
+        if(instr.type == I32) int_ops++;
+        if(instr.opcode == CMP_SELECT_CONST) pc += 2;
+    }
+
+    if(divides) return SHAPE_DIVIDE;
+    return float_ops > int_ops ? SHAPE_FLOAT : SHAPE_INT;
+}
+
+/*
+ * Build an engine and prepare the kernel as far as the config asks. The
+ * kernel is verified and optimized in every mode, so the stack interpreter
+ * is timed on the same unchecked handlers and bytecode workers run. A mode the kernel cannot reach, such
+ * as a JIT the kernel does not compile with, is an error so calibration
+ * skips it.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, read until the engine is built.
+ *     int length - Instructions up to and including RETURN.
+ *     VMReturnType type - Return type of the kernel.
+ *     const EngineConfig& config - Engine to build.
+ *     std::unique_ptr<Engine> *engine - Receives the engine.
+ * Returns:
+ *     int - 0 on success, -1 if the host lacks the engine or the kernel
+ *           fails verification or cannot use the mode.
+ */
+int build_engine(const Instruction *bytecode, int length, VMReturnType type, const EngineConfig& config, std::unique_ptr<Engine> *engine) {
+    std::unique_ptr<Engine> built;
+    if(create_engine(bytecode, config.isa, config.unroll, &built) < 0) return -1;
+    built->set_return_type(type);
+
+    if(built->verify(length) < 0) return -1;
+    if(built->optimize() < 0) return -1;
+    if(config.mode >= ENGINE_REGISTER && built->translate() < 0) return -1;
+    if(config.mode >= ENGINE_JIT && built->compile_jit() < 0) return -1;
+
+    *engine = std::move(built);
+    return 0;
+}
+
+/* Lanes per second of one engine on one kernel, or a negative value if it cannot run it. */
+static double measure(const CalibrationKernel& kernel, const EngineConfig& config, const Column *inputs, int num_inputs, double budget_ms) {
+    std::unique_ptr<Engine> engine;
+    if(build_engine(kernel.bytecode, kernel.length, kernel.type, config, &engine) < 0) return -1.0;
+
+    std::vector<int32_t> output(CALIBRATE_N);
+    if(engine->run_batch(inputs, num_inputs, CALIBRATE_N, output.data()) < 0) return -1.0;
+
+    auto start = std::chrono::steady_clock::now();
+    double elapsed_ms = 0.0;
+    size_t runs = 0;
+    do {
+        engine->run_batch(inputs, num_inputs, CALIBRATE_N, output.data());
+        runs++;
+        elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    } while(elapsed_ms < budget_ms);
+
+    return (double)(runs * CALIBRATE_N) / elapsed_ms;
+}
+
+/*
+ * Time every engine configuration the host supports on each shape's
+ * representative kernel. select_isa() bounds the ISAs tried, so MOSAIC_ISA
+ * also caps what calibration may pick.
+ * Arguments:
+ *     double budget_ms - Time spent running each configuration on each kernel.
+ *     HostProfile *profile - Receives the fastest configuration per shape.
+ * Returns:
+ *     int - 0 on success, -1 if the host has no engine at all.
+ */
+int calibrate(double budget_ms, HostProfile *profile) {
+    Isa widest = select_isa();
+    if(widest == ISA_COUNT) return -1;
+
+    std::vector<int32_t> x(CALIBRATE_N), y(CALIBRATE_N);
+    std::vector<float> u(CALIBRATE_N), v(CALIBRATE_N);
+    uint32_t state = 2463534242u;
+    for(size_t i = 0; i < CALIBRATE_N; i++) {
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+        x[i] = (int32_t)state;
+        y[i] = (int32_t)(state >> 16) | 1;
+        u[i] = (float)(state & 0xFFFF) / 65536.0f;
+        v[i] = (float)(state >> 16) / 65536.0f;
+    }
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+        { .type = I32, .data = y.data() },
+        { .type = F32, .data = u.data() },
+        { .type = F32, .data = v.data() },
+    };
+
+    profile->host = widest;
+    for(int shape = 0; shape < SHAPE_COUNT; shape++) {
+        double best = -1.0;
+        profile->best[shape] = { ISA_SSE41, 1, ENGINE_STACK };
+
+        for(int isa = 0; isa <= widest; isa++) {
+            for(int unroll : ENGINE_UNROLLS) {
+                for(int mode = 0; mode < ENGINE_MODE_COUNT; mode++) {
+                    EngineConfig config = { (Isa)isa, unroll, (EngineMode)mode };
+                    double rate = measure(kernels[shape], config, inputs, 4, budget_ms);
+                    if(rate > best) {
+                        best = rate;
+                        profile->best[shape] = config;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write a profile as text: a "mosaic-profile 1" line, a "host avx2" line,
+ * then one line per shape such as "int avx2 4 jit". The file is written
+ * beside the target and renamed over it, so a worker booting at the same
+ * time never reads half a profile.
+ * Arguments:
+ *     const char *path - File to write.
+ *     const HostProfile& profile - Profile to save.
+ * Returns:
+ *     int - 0 on success, -1 if the file cannot be written.
+ */
+int save_profile(const char *path, const HostProfile& profile) {
+    std::string temp = std::string(path) + ".tmp";
+    FILE *file = fopen(temp.c_str(), "w");
+    if(file == nullptr) return -1;
+
+    fprintf(file, "mosaic-profile 1\n");
+    fprintf(file, "host %s\n", isa_name(profile.host));
+    for(int shape = 0; shape < SHAPE_COUNT; shape++) {
+        const EngineConfig& config = profile.best[shape];
+        fprintf(file, "%s %s %d %s\n", shape_names[shape], isa_name(config.isa), config.unroll, mode_names[config.mode]);
+    }
+
+    if(fclose(file) != 0 || rename(temp.c_str(), path) != 0) {
+        remove(temp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read a profile written by save_profile(). A profile calibrated on a host
+ * with a different widest ISA, or under a different MOSAIC_ISA, is stale
+ * and rejected.
+ * Arguments:
+ *     const char *path - File to read.
+ *     HostProfile *profile - Receives the profile.
+ * Returns:
+ *     int - 0 on success, -1 if the file is missing, malformed or stale.
+ */
+int load_profile(const char *path, HostProfile *profile) {
+    FILE *file = fopen(path, "r");
+    if(file == nullptr) return -1;
+
+    HostProfile loaded;
+    bool seen[SHAPE_COUNT] = {};
+    char word[4][32];
+    int version, unroll;
+    bool ok = fscanf(file, "mosaic-profile %d host %31s", &version, word[0]) == 2 && version == 1
+        && parse_isa(word[0], &loaded.host) == 0 && loaded.host == select_isa();
+
+    while(ok && fscanf(file, "%31s %31s %d %31s", word[1], word[2], &unroll, word[3]) == 4) {
+        int shape = 0, mode = 0;
+        while(shape < SHAPE_COUNT && strcmp(word[1], shape_names[shape]) != 0) shape++;
+        while(mode < ENGINE_MODE_COUNT && strcmp(word[3], mode_names[mode]) != 0) mode++;
+
+        EngineConfig& config = loaded.best[shape < SHAPE_COUNT ? shape : 0];
+        config.unroll = unroll;
+        config.mode = (EngineMode)mode;
+        bool built = false;
+        for(int factor : ENGINE_UNROLLS) built = built || factor == unroll;
+        ok = built && shape < SHAPE_COUNT && mode < ENGINE_MODE_COUNT
+            && parse_isa(word[2], &config.isa) == 0 && config.isa <= loaded.host;
+        if(ok) seen[shape] = true;
+    }
+    fclose(file);
+
+    for(int shape = 0; shape < SHAPE_COUNT; shape++) ok = ok && seen[shape];
+    if(!ok) return -1;
+
+    *profile = loaded;
+    return 0;
+}
+
+/*
+ * Boot path for workers: load the host profile, calibrating and saving a
+ * new one only when it is missing or stale.
+ * Arguments:
+ *     const char *path - Profile file.
+ *     double budget_ms - Calibration budget, see calibrate().
+ *     HostProfile *profile - Receives the profile.
+ * Returns:
+ *     int - 0 on success, even if the new profile could not be saved, -1 if
+ *           the host has no engine at all.
+ */
+int load_or_calibrate(const char *path, double budget_ms, HostProfile *profile) {
+    if(load_profile(path, profile) == 0) return 0;
+    if(calibrate(budget_ms, profile) < 0) return -1;
+    save_profile(path, *profile);
+    return 0;
+}
+
+/*
+ * Profile to run on until one is loaded: the select_isa() engine for every
+ * shape, in the fastest mode each kernel allows.
+ * Returns:
+ *     HostProfile - The profile, with host ISA_COUNT if even SSE4.1 is missing.
+ */
+HostProfile default_profile() {
+    HostProfile profile;
+    profile.host = select_isa();
+    for(EngineConfig& config : profile.best) config = { profile.host, 1, ENGINE_JIT };
+    return profile;
+}
+
+/*
+ * Build the engine the profile picked for this kernel's shape. When the
+ * kernel cannot use that mode the next simpler one is used instead, down
+ * to the stack interpreter.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, read until the engine is built.
+ *     int length - Instructions up to and including RETURN.
+ *     VMReturnType type - Return type of the kernel.
+ *     const HostProfile& profile - Calibrated configurations.
+ *     std::unique_ptr<Engine> *engine - Receives the engine.
+ * Returns:
+ *     int - 0 on success, -1 if no engine could be built.
+ */
+int create_tuned_engine(const Instruction *bytecode, int length, VMReturnType type, const HostProfile& profile, std::unique_ptr<Engine> *engine) {
+    EngineConfig config = profile.best[kernel_shape(bytecode, length)];
+    for(int mode = config.mode; mode >= ENGINE_STACK; mode--) {
+        config.mode = (EngineMode)mode;
+        if(build_engine(bytecode, length, type, config, engine) == 0) return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,171 @@
+#include <string.h>
+
+#include "verifier.h"
+
+/*
+ * Is the type tag one of the value types?
+ */
+static inline bool valid_type(TypeTag type) {
+    return type == I32 || type == F32 || type == BOOL;
+}
+
+/*
+ * Statically check a kernel before it is run. Bytecode has no branches, so
+ * a single pass simulating the types on the stack proves that the kernel
+ * never under- or overflows the stack, only touches valid slots and
+ * arguments, applies every operation to operands of the right type and
+ * ends with a RETURN of the declared return type within MAX_KERNEL_LENGTH
+ * instructions. Instructions past that limit are never read; a kernel
+ * without a RETURN inside it is rejected with too_long set and error_pc at
+ * MAX_KERNEL_LENGTH.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel to check.
+ *     int length - Number of instructions available in bytecode.
+ *     VMReturnType return_type - Declared return type of the kernel.
+ *     KernelInfo *info - Filled with the kernel's metadata.
+ * Returns:
+ *     int - 0 if the kernel is valid, -1 otherwise.
+ */
+int verify_bytecode(const Instruction *bytecode, int length, VMReturnType return_type, KernelInfo *info) {
+    memset(info, 0, sizeof(*info));
+
+    TypeTag types[MAX_STACK];
+    int depth = 0;
+    uint32_t stored[3] = {};
+
+    int limit = length < MAX_KERNEL_LENGTH ? length : MAX_KERNEL_LENGTH;
+    for(int pc = 0; pc < limit; pc++) {
+        const Instruction& instr = bytecode[pc];
+        info->error_pc = pc;
+
+        switch(instr.opcode) {
+        case PUSH_CONST:
+        case LOAD_VAR:
+        case LOAD_ARG:
+        case RAND: {
+            if(depth >= MAX_STACK) return -1;
+
+            TypeTag type = instr.opcode == RAND ? F32 : instr.type;
+            if(!valid_type(type)) return -1;
+
+            if(instr.opcode == LOAD_VAR) {
+                if(instr.slot < 0 || instr.slot >= MAX_SLOTS) return -1;
+                if(instr.slot >= info->slot_count[type]) info->slot_count[type] = instr.slot + 1;
+                if(!(stored[type] & 1u << instr.slot)) info->slot_read_first[type] |= 1u << instr.slot;
+            } else if(instr.opcode == LOAD_ARG) {
+                if(instr.arg < 0 || instr.arg >= MAX_ARGS) return -1;
+
+                // An argument has a single type for the whole kernel
+                if(info->arg_used[instr.arg] && info->arg_types[instr.arg] != type) return -1;
+                info->arg_used[instr.arg] = true;
+                info->arg_types[instr.arg] = type;
+            }
+
+            types[depth++] = type;
+            break;
+        }
+        case STORE_VAR:
+            if(depth < 1) return -1;
+            if(instr.slot < 0 || instr.slot >= MAX_SLOTS) return -1;
+            if(types[depth-1] != instr.type) return -1;
+            if(instr.slot >= info->slot_count[instr.type]) info->slot_count[instr.type] = instr.slot + 1;
+            stored[instr.type] |= 1u << instr.slot;
+            depth--;
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case MOD:
+        case CMP_LT:
+        case CMP_LTE:
+        case CMP_GT:
+        case CMP_GTE:
+        case CMP_EQ:
+        case CMP_NE:
+            if(depth < 2) return -1;
+            if(instr.type != I32 && instr.type != F32) return -1;
+            if(instr.opcode == MOD && instr.type != I32) return -1;
+            if(types[depth-2] != instr.type || types[depth-1] != instr.type) return -1;
+
+            depth--;
+            types[depth-1] = instr.opcode >= CMP_LT && instr.opcode <= CMP_NE ? BOOL : instr.type;
+            break;
+        case SHL:
+        case DIV_POW2:
+        case MOD_POW2:
+            if(depth < 1) return -1;
+            if(instr.type != I32 || types[depth-1] != I32) return -1;
+            if(instr.shift < 1 || instr.shift > (instr.opcode == SHL ? 31 : 30)) return -1;
+            break;
+        case AND:
+        case OR:
+            if(depth < 2) return -1;
+            if(instr.type != BOOL) return -1;
+            if(types[depth-2] != BOOL || types[depth-1] != BOOL) return -1;
+            depth--;
+            break;
+        case NOT:
+            if(depth < 1) return -1;
+            if(instr.type != BOOL || types[depth-1] != BOOL) return -1;
+            break;
+        case SQUARE_VAR:
+            if(depth >= MAX_STACK) return -1;
+            if(instr.type != I32 && instr.type != F32) return -1;
+            if(instr.slot < 0 || instr.slot >= MAX_SLOTS) return -1;
+            if(instr.slot >= info->slot_count[instr.type]) info->slot_count[instr.type] = instr.slot + 1;
+            if(!(stored[instr.type] & 1u << instr.slot)) info->slot_read_first[instr.type] |= 1u << instr.slot;
+            types[depth++] = instr.type;
+            break;
+        case FMA:
+            if(depth < 3) return -1;
+            if(instr.type != I32 && instr.type != F32) return -1;
+            if(types[depth-3] != instr.type || types[depth-2] != instr.type || types[depth-1] != instr.type) return -1;
+            depth -= 2;
+            break;
+        case CMP_SELECT_CONST: {
+            if(depth < 2) return -1;
+            if(instr.type != I32 && instr.type != F32) return -1;
+            if(instr.compare < CMP_LT || instr.compare > CMP_NE) return -1;
+            if(types[depth-2] != instr.type || types[depth-1] != instr.type) return -1;
+
+            // The two constants to select between follow as operands
+            if(pc + 2 >= limit) return -1;
+            const Instruction& if_true = bytecode[pc+1];
+            const Instruction& if_false = bytecode[pc+2];
+            if(if_true.opcode != PUSH_CONST || if_false.opcode != PUSH_CONST) return -1;
+            if(!valid_type(if_true.type) || if_true.type != if_false.type) return -1;
+
+            depth--;
+            types[depth-1] = if_true.type;
+            pc += 2;
+            break;
+        }
+        case SELECT:
+            if(depth < 3) return -1;
+            if(!valid_type(instr.type)) return -1;
+            if(types[depth-3] != BOOL) return -1;
+            if(types[depth-2] != instr.type || types[depth-1] != instr.type) return -1;
+            depth -= 2;
+            types[depth-1] = instr.type;
+            break;
+        case RETURN:
+            if(depth < 1) return -1;
+
+            // Kernel return types mirror the TypeTag order
+            if(return_type == KERNEL_ERROR || types[depth-1] != (TypeTag)return_type) return -1;
+            info->length = pc + 1;
+            info->error_pc = -1;
+            return 0;
+        default:
+            return -1;
+        }
+
+        if(depth > info->max_stack) info->max_stack = depth;
+    }
+
+    // Ran off the end, or past the length limit, without a RETURN
+    info->too_long = length > MAX_KERNEL_LENGTH;
+    info->error_pc = limit;
+    return -1;
+}
@@ -1,28 +1,51 @@
+#include <math.h>
 #include "simd.h"
 
 #include "vm.h"
+#include "optimizer.h"
 
-const VM::OpHandler VM::dispatch[] = {
-    &VM::simd_push_const,
-    &VM::simd_load_var,
-    &VM::simd_store_var,
-    &VM::simd_add,
-    &VM::simd_sub,
-    &VM::simd_mul,
-    &VM::simd_div,
-    &VM::simd_mod,
-    &VM::simd_cmp_lt,
-    &VM::simd_cmp_lte,
-    &VM::simd_cmp_gt,
-    &VM::simd_cmp_gte,
-    &VM::simd_cmp_eq,
-    &VM::simd_cmp_ne,
-    &VM::simd_and,
-    &VM::simd_or,
-    &VM::simd_not,
-    &VM::simd_select,
-    &VM::simd_rand,
-    &VM::simd_return,
+MOSAIC_ISA_BEGIN
+
+/*
+ * With MOSAIC_THREADED_DISPATCH the interpreter loop jumps between labels
+ * with computed gotos, and every handler is inlined into that loop.
+ */
+#ifdef MOSAIC_THREADED_DISPATCH
+#define HANDLER __attribute__((always_inline)) inline
+#else
+#define HANDLER
+#endif
+
+// Must stay in OpCode order
+template<bool Checked>
+const ExecutionContext::OpHandler ExecutionContext::dispatch[] = {
+    &ExecutionContext::simd_push_const<Checked>,
+    &ExecutionContext::simd_load_var<Checked>,
+    &ExecutionContext::simd_store_var<Checked>,
+    &ExecutionContext::simd_add<Checked>,
+    &ExecutionContext::simd_sub<Checked>,
+    &ExecutionContext::simd_mul<Checked>,
+    &ExecutionContext::simd_div<Checked>,
+    &ExecutionContext::simd_mod<Checked>,
+    &ExecutionContext::simd_cmp_lt<Checked>,
+    &ExecutionContext::simd_cmp_lte<Checked>,
+    &ExecutionContext::simd_cmp_gt<Checked>,
+    &ExecutionContext::simd_cmp_gte<Checked>,
+    &ExecutionContext::simd_cmp_eq<Checked>,
+    &ExecutionContext::simd_cmp_ne<Checked>,
+    &ExecutionContext::simd_and<Checked>,
+    &ExecutionContext::simd_or<Checked>,
+    &ExecutionContext::simd_not<Checked>,
+    &ExecutionContext::simd_select<Checked>,
+    &ExecutionContext::simd_rand<Checked>,
+    &ExecutionContext::simd_return<Checked>,
+    &ExecutionContext::simd_load_arg<Checked>,
+    &ExecutionContext::simd_shl<Checked>,
+    &ExecutionContext::simd_div_pow2<Checked>,
+    &ExecutionContext::simd_mod_pow2<Checked>,
+    &ExecutionContext::simd_square_var<Checked>,
+    &ExecutionContext::simd_fma<Checked>,
+    &ExecutionContext::simd_cmp_select_const<Checked>,
 };
 
 /*
@@ -32,20 +55,22 @@ const VM::OpHandler VM::dispatch[] = {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_push_const(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_push_const(const Instruction& instruction) {
     stack.sp++;
     int sp = stack.sp;
-    if(sp >= MAX_STACK) return -1;
-
-    if(instruction.type == I32) {
-        __veci const_vec = _vec_bcsti(instruction.const_int);
-        _vec_storei(stack.data[sp].i32, const_vec);
-    } else if(instruction.type == F32) {
-        __vecf const_vec = _vec_bcstf(instruction.const_float);
-        _vec_storef(stack.data[stack.sp].f32, const_vec);
-    } else if(instruction.type == BOOL) {
-        __veci const_vec = _vec_bcsti(instruction.const_bool ? -1 : 0);
-        _vec_storei(stack.data[sp].b, const_vec);
+    if(Checked && sp >= MAX_STACK) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci const_vec = _vec_bcsti(instruction.const_int);
+            _vec_storei(stack.data[sp].i32 + o, const_vec);
+        } else if(instruction.type == F32) {
+            __vecf const_vec = _vec_bcstf(instruction.const_float);
+            _vec_storef(stack.data[stack.sp].f32 + o, const_vec);
+        } else if(instruction.type == BOOL) {
+            _vec_storeb(stack.data[sp].b + o, _vec_bcstb(instruction.const_bool));
+        }
     }
     
     return 0;
@@ -58,29 +83,32 @@ int VM::simd_push_const(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_load_var(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_load_var(const Instruction& instruction) {
     stack.sp++;
     int sp = stack.sp;
-    if(sp >= MAX_STACK) return -1;
-    if(instruction.slot >= MAX_SLOTS || instruction.slot < 0) return -1;
+    if(Checked && sp >= MAX_STACK) return -1;
+    if(Checked && (instruction.slot >= MAX_SLOTS || instruction.slot < 0)) return -1;
     
-    if(instruction.type == I32) {
-        _vec_storei(
-            stack.data[sp].i32, 
-            _vec_loadi(slots.i32_slot[instruction.slot])
-        );
-    } else if(instruction.type == F32) {
-        _vec_storef(
-            stack.data[sp].f32, 
-            _vec_loadf(slots.f32_slot[instruction.slot])
-        );
-    } else if(instruction.type == BOOL) {
-        _vec_storei(
-            stack.data[sp].b, 
-            _vec_loadi(slots.bool_slot[instruction.slot])
-        );
-    } else {
-        return -1;
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            _vec_storei(
+                stack.data[sp].i32 + o, 
+                _vec_loadi(slot(I32, instruction.slot).i32 + o)
+            );
+        } else if(instruction.type == F32) {
+            _vec_storef(
+                stack.data[sp].f32 + o, 
+                _vec_loadf(slot(F32, instruction.slot).f32 + o)
+            );
+        } else if(instruction.type == BOOL) {
+            _vec_storeb(
+                stack.data[sp].b + o,
+                _vec_loadb(slot(BOOL, instruction.slot).b + o)
+            );
+        } else {
+            return -1;
+        }
     }
 
     return 0;
@@ -93,35 +121,84 @@ int VM::simd_load_var(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_store_var(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_store_var(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 0) return -1;
-    if(instruction.slot >= MAX_SLOTS || instruction.slot < 0) return -1;
-
-    if(instruction.type == I32) {
-        _vec_storei(
-            slots.i32_slot[instruction.slot],
-            _vec_loadi(stack.data[sp].i32)
-        );
-    } else if(instruction.type == F32) {
-        _vec_storef(
-            slots.f32_slot[instruction.slot],
-            _vec_loadf(stack.data[sp].f32)
-        );
-    } else if(instruction.type == BOOL) {
-        _vec_storei(
-            slots.bool_slot[instruction.slot],
-            _vec_loadi(stack.data[sp].b)
-        );
-    } else {
-        return -1;
+    if(Checked && sp < 0) return -1;
+    if(Checked && (instruction.slot >= MAX_SLOTS || instruction.slot < 0)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            _vec_storei(
+                slot(I32, instruction.slot).i32 + o,
+                _vec_loadi(stack.data[sp].i32 + o)
+            );
+        } else if(instruction.type == F32) {
+            _vec_storef(
+                slot(F32, instruction.slot).f32 + o,
+                _vec_loadf(stack.data[sp].f32 + o)
+            );
+        } else if(instruction.type == BOOL) {
+            _vec_storeb(
+                slot(BOOL, instruction.slot).b + o,
+                _vec_loadb(stack.data[sp].b + o)
+            );
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
     return 0;
 }
 
+/*
+ * Read LANES values of a column at the current batch offset.
+ * Arguments:
+ *     const Column& column - Bound column.
+ *     int o - Offset of the vector within the lane group.
+ * Returns:
+ *     __veci - Column values as stored, booleans are any nonzero value.
+ */
+inline __veci ExecutionContext::load_column(const Column& column, int o) {
+    const int32_t *src = (const int32_t *)column.data + batch_offset + o;
+    if(active_lanes - o >= LANES) return _vec_loadi(src);
+
+    // Partial group, don't read past the end of the column
+    return _vec_maskloadi(src, _vec_lanemask(active_lanes - o));
+}
+
+/*
+ * Push a kernel argument onto the stack, reading WIDTH values directly from
+ * its bound column at the current batch offset.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_load_arg(const Instruction& instruction) {
+    stack.sp++;
+    int sp = stack.sp;
+    if(Checked && sp >= MAX_STACK) return -1;
+    if(Checked && (instruction.arg >= MAX_ARGS || instruction.arg < 0)) return -1;
+
+    // Verified kernels have their columns checked once before running
+    const Column& column = columns[instruction.arg];
+    if(Checked && (column.data == nullptr || column.type != instruction.type)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __veci value = load_column(column, o);
+        if(column.type == BOOL) {
+            _vec_storeb(stack.data[sp].b + o, _vec_i2b(value));
+        } else {
+            _vec_storei(stack.data[sp].i32 + o, value);
+        }
+    }
+    return 0;
+}
+
 /*
  * Execute an ADD instruction.
  * Arguments:
@@ -129,27 +206,30 @@ int VM::simd_store_var(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_add(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_add(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        __veci result = _vec_addi(a, b);
+            __veci result = _vec_addi(a, b);
 
-        _vec_storei(stack.data[sp-1].i32, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storei(stack.data[sp-1].i32 + o, result);
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_addf(a, b);
+            __vecf result = _vec_addf(a, b);
 
-        _vec_storef(stack.data[sp-1].f32, result);
-    } else {
-        return -1;
+            _vec_storef(stack.data[sp-1].f32 + o, result);
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -163,27 +243,30 @@ int VM::simd_add(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_sub(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_sub(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        __veci result = _vec_subi(a, b);
+            __veci result = _vec_subi(a, b);
 
-        _vec_storei(stack.data[sp-1].i32, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storei(stack.data[sp-1].i32 + o, result);
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_subf(a, b);
+            __vecf result = _vec_subf(a, b);
 
-        _vec_storef(stack.data[sp-1].f32, result);
-    } else {
-        return -1;
+            _vec_storef(stack.data[sp-1].f32 + o, result);
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -197,33 +280,83 @@ int VM::simd_sub(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_mul(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_mul(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        __veci result = _vec_muli(a, b);
+            __veci result = _vec_muli(a, b);
 
-        _vec_storei(stack.data[sp-1].i32, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storei(stack.data[sp-1].i32 + o, result);
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_mulf(a, b);
+            __vecf result = _vec_mulf(a, b);
 
-        _vec_storef(stack.data[sp-1].f32, result);
-    } else {
-        return -1;
+            _vec_storef(stack.data[sp-1].f32 + o, result);
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
     return 0;
 }
 
+/*
+ * Vector signed division, a / b (or a % b) rounding toward zero. Zero
+ * divisors are found with one compare for the whole group, padding lanes
+ * of a partial group are ignored. INT32_MIN / -1 wraps to INT32_MIN.
+ * Arguments:
+ *     __veci a - Dividends.
+ *     __veci b - Divisors.
+ *     int active_lanes - Lanes holding real instances.
+ *     bool modulo - Compute the remainder instead of the quotient.
+ *     __veci *result - Receives the quotients or remainders.
+ * Returns:
+ *     int - 0 on success, -1 on divide by zero.
+ */
+static inline int divide_vectors(__veci a, __veci b, int active_lanes, bool modulo, __veci *result) {
+    __vecb zero = _vec_cmpeqi(b, _vec_bcsti(0));
+    if(_vec_anyb(_vec_andb(zero, _vec_lanemask(active_lanes)))) return -1;
+
+    // Padding lanes divide by 1 instead of 0
+    b = _vec_blendi(zero, _vec_bcsti(1), b);
+
+    __veci q = _vec_divi(a, b);
+    *result = modulo ? _vec_subi(a, _vec_muli(q, b)) : q;
+    return 0;
+}
+
+/*
+ * Signed division by a constant with a precomputed magic number, a high
+ * multiply and shifts instead of a divide.
+ * Arguments:
+ *     __veci a - Dividends.
+ *     const DivMagic& magic - From div_magic() for the divisor.
+ *     bool modulo - Compute the remainder instead of the quotient.
+ * Returns:
+ *     __veci - Quotients or remainders.
+ */
+static inline __veci divide_magic(__veci a, const DivMagic& magic, bool modulo) {
+    __veci q = _vec_mulhii(a, _vec_bcsti(magic.multiplier));
+    if(magic.adjust > 0) q = _vec_addi(q, a);
+    if(magic.adjust < 0) q = _vec_subi(q, a);
+    q = _vec_srai(q, magic.shift);
+
+    // Round toward zero, negative quotients are one too small
+    q = _vec_addi(q, _vec_sri(q, 31));
+
+    return modulo ? _vec_subi(a, _vec_muli(q, _vec_bcsti(magic.divisor))) : q;
+}
+
 /*
  * Execute a DIV instruction.
  * Arguments:
@@ -231,31 +364,31 @@ int VM::simd_mul(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_div(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_div(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        // Intel does not support vector division of integers, do it manually
-        for(int i = 0; i < LANES; i++) {
-            int32_t a = stack.data[sp-1].i32[i];
-            int32_t b = stack.data[sp].i32[i];
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-            // Divide by zero error
-            if(b == 0) return -1;
+            __veci result;
+            if(divide_vectors(a, b, active_lanes - o, false, &result) < 0) return -1;
 
-            stack.data[sp-1].i32[i] = a / b;
-        }
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storei(stack.data[sp-1].i32 + o, result);
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_divf(a, b);
+            __vecf result = _vec_divf(a, b);
 
-        _vec_storef(stack.data[sp-1].f32, result);
-    } else {
-        return -1;
+            _vec_storef(stack.data[sp-1].f32 + o, result);
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -269,24 +402,24 @@ int VM::simd_div(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_mod(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_mod(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-    if(instruction.type == I32) {
-        for(int i = 0; i < LANES; i++) {
-            // Intel does not support vector modulo of integers, do it manually
-            int32_t a = stack.data[sp-1].i32[i];
-            int32_t b = stack.data[sp].i32[i];
-            
-            // Divide by zero error
-            if(b == 0) return -1;
+            __veci result;
+            if(divide_vectors(a, b, active_lanes - o, true, &result) < 0) return -1;
 
-            stack.data[sp-1].i32[i] = a % b;
+            _vec_storei(stack.data[sp-1].i32 + o, result);
+        } else {
+            return -1;
         }
-    } else {
-        return -1;
     }
 
     stack.sp--;
@@ -294,34 +427,155 @@ int VM::simd_mod(const Instruction& instruction) {
 }
 
 /*
- * Compare a < b.
+ * Signed division by 2^k, rounding toward zero like integer division.
+ * Arguments:
+ *     __veci x - Dividends.
+ *     int k - Power of two, 1 <= k <= 30.
+ * Returns:
+ *     __veci - Quotients.
+ */
+static inline __veci div_pow2(__veci x, int k) {
+    // Negative values are biased by 2^k - 1 before the arithmetic shift
+    __veci bias = _vec_sri(_vec_srai(x, 31), 32 - k);
+    return _vec_srai(_vec_addi(x, bias), k);
+}
+
+/*
+ * Signed remainder of division by 2^k, with the sign of the dividend.
+ * Arguments:
+ *     __veci x - Dividends.
+ *     int k - Power of two, 1 <= k <= 30.
+ * Returns:
+ *     __veci - Remainders.
+ */
+static inline __veci mod_pow2(__veci x, int k) {
+    return _vec_subi(x, _vec_sli(div_pow2(x, k), k));
+}
+
+/*
+ * Execute a SHL instruction, a multiplication by 2^shift.
  * Arguments:
  *     const Instruction& instruction - Current context.
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_lt(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_shl(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
-        __veci result = _vec_cmplti(a, b);
+    if(Checked && sp < 0) return -1;
+    if(Checked && (instruction.type != I32 || instruction.shift < 1 || instruction.shift > 31)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __veci a = _vec_loadi(stack.data[sp].i32 + o);
+        _vec_storei(stack.data[sp].i32 + o, _vec_sli(a, instruction.shift));
+    }
+
+    return 0;
+}
+
+/*
+ * Execute a DIV_POW2 instruction, a division by 2^shift.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_div_pow2(const Instruction& instruction) {
+    int sp = stack.sp;
+
+    if(Checked && sp < 0) return -1;
+    if(Checked && (instruction.type != I32 || instruction.shift < 1 || instruction.shift > 30)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __veci a = _vec_loadi(stack.data[sp].i32 + o);
+        _vec_storei(stack.data[sp].i32 + o, div_pow2(a, instruction.shift));
+    }
+
+    return 0;
+}
+
+/*
+ * Execute a MOD_POW2 instruction, a remainder of division by 2^shift.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_mod_pow2(const Instruction& instruction) {
+    int sp = stack.sp;
+
+    if(Checked && sp < 0) return -1;
+    if(Checked && (instruction.type != I32 || instruction.shift < 1 || instruction.shift > 30)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __veci a = _vec_loadi(stack.data[sp].i32 + o);
+        _vec_storei(stack.data[sp].i32 + o, mod_pow2(a, instruction.shift));
+    }
+
+    return 0;
+}
+
+/*
+ * Compare two vectors with one of the CMP_* operations.
+ * Arguments:
+ *     OpCode op - CMP_LT through CMP_NE.
+ *     TypeTag type - I32 or F32.
+ *     __veci a, b - Operands, floats passed as their bits.
+ * Returns:
+ *     __vecb - Lane mask where the comparison holds.
+ */
+static inline __vecb compare(OpCode op, TypeTag type, __veci a, __veci b) {
+    if(type == I32) {
+        switch(op) {
+        case CMP_LT: return _vec_cmplti(a, b);
+        case CMP_LTE: return _vec_notb(_vec_cmplti(b, a));
+        case CMP_GT: return _vec_cmplti(b, a);
+        case CMP_GTE: return _vec_notb(_vec_cmplti(a, b));
+        case CMP_EQ: return _vec_cmpeqi(a, b);
+        default: return _vec_notb(_vec_cmpeqi(a, b));
+        }
+    }
+
+    __vecf x = _vec_castif(a), y = _vec_castif(b);
+    switch(op) {
+    case CMP_LT: return _vec_cmpltf(x, y);
+    case CMP_LTE: return _vec_cmplef(x, y);
+    case CMP_GT: return _vec_cmpgtf(x, y);
+    case CMP_GTE: return _vec_cmpgef(x, y);
+    case CMP_EQ: return _vec_cmpeqf(x, y);
+    default: return _vec_cmpnef(x, y);
+    }
+}
+
+/*
+ * Compare a < b.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_lt(const Instruction& instruction) {
+    int sp = stack.sp;
+    if(Checked && sp < 1) return -1;
 
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        __vecf result = _vec_cmpltf(a, b);
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmplti(a, b));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        _vec_storei(
-            stack.data[sp-1].b, 
-            _vec_castfi(result) 
-        );
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpltf(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -335,32 +589,25 @@ int VM::simd_cmp_lt(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_lte(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_lte(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        __veci ones = _vec_bcsti(-1);
-        __veci result = _vec_xori(
-            _vec_cmplti(b, a),
-            ones
-        );
+            _vec_storeb(stack.data[sp-1].b + o, _vec_notb(_vec_cmplti(b, a)));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
-
-        __vecf result = _vec_cmplef(a, b);
-        _vec_storei(
-            stack.data[sp-1].b,
-            _vec_castfi(result)
-        );
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmplef(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -374,27 +621,25 @@ int VM::simd_cmp_lte(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_gt(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_gt(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
-        __veci result = _vec_cmplti(b, a);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmplti(b, a));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_cmpgtf(a, b);
-        _vec_storei(
-            stack.data[sp-1].b,
-            _vec_castfi(result)
-        );
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpgtf(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -408,32 +653,25 @@ int VM::simd_cmp_gt(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_gte(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_gte(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
-
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
-       
-        __veci ones = _vec_bcsti(-1);
-        __veci result = _vec_xori(
-            _vec_cmplti(a, b),
-            ones
-        );
-
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
-
-        __vecf result = _vec_cmpgef(a, b);
-        _vec_storei(
-            stack.data[sp-1].b,
-            _vec_castfi(result)
-        );
-    } else {
-        return -1;
+    if(Checked && sp < 1) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
+
+            _vec_storeb(stack.data[sp-1].b + o, _vec_notb(_vec_cmplti(a, b)));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
+
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpgef(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -447,27 +685,25 @@ int VM::simd_cmp_gte(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_eq(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_eq(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
-        __veci result = _vec_cmpeqi(a, b);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpeqi(a, b));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
-        __vecf result = _vec_cmpeqf(a, b);
-        _vec_storei(
-            stack.data[sp-1].b,
-            _vec_castfi(result)
-        );
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpeqf(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -481,32 +717,25 @@ int VM::simd_cmp_eq(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_cmp_ne(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_ne(const Instruction& instruction) {
     int sp = stack.sp;
-    if(sp < 1) return -1;
-
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
-        
-        __veci ones = _vec_bcsti(-1);
-        __veci result = _vec_xori(
-            _vec_cmpeqi(b, a),
-            ones
-        );
-
-        _vec_storei(stack.data[sp-1].b, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
-
-        __vecf result = _vec_cmpnef(a, b);
-        _vec_storei(
-            stack.data[sp-1].b,
-            _vec_castfi(result)
-        );
-    } else {
-        return -1;
+    if(Checked && sp < 1) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
+
+            _vec_storeb(stack.data[sp-1].b + o, _vec_notb(_vec_cmpeqi(a, b)));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
+
+            _vec_storeb(stack.data[sp-1].b + o, _vec_cmpnef(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -520,20 +749,21 @@ int VM::simd_cmp_ne(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_and(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_and(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
+    if(Checked && sp < 1) return -1;
 
-    if(instruction.type == BOOL) {
-        __veci a = _vec_loadi(stack.data[sp-1].b);
-        __veci b = _vec_loadi(stack.data[sp].b);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == BOOL) {
+            __vecb a = _vec_loadb(stack.data[sp-1].b + o);
+            __vecb b = _vec_loadb(stack.data[sp].b + o);
 
-        __veci result = _vec_andi(a, b);
-
-        _vec_storei(stack.data[sp-1].b, result);
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_andb(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -547,20 +777,21 @@ int VM::simd_and(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_or(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_or(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 1) return -1;
-
-    if(instruction.type == BOOL) {
-        __veci a = _vec_loadi(stack.data[sp-1].b);
-        __veci b = _vec_loadi(stack.data[sp].b);
+    if(Checked && sp < 1) return -1;
 
-        __veci result = _vec_ori(a, b);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == BOOL) {
+            __vecb a = _vec_loadb(stack.data[sp-1].b + o);
+            __vecb b = _vec_loadb(stack.data[sp].b + o);
 
-        _vec_storei(stack.data[sp-1].b, result);
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp-1].b + o, _vec_orb(a, b));
+        } else {
+            return -1;
+        }
     }
 
     stack.sp--;
@@ -574,21 +805,20 @@ int VM::simd_or(const Instruction& instruction) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_not(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_not(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 0) return -1;
-
-    if(instruction.type == BOOL) {
-        // Intel doesn't support direct NOT but XOR 1 is the same operation
-        __veci a = _vec_loadi(stack.data[sp].b);
-        __veci ones = _vec_bcsti(-1);
+    if(Checked && sp < 0) return -1;
 
-        __veci result = _vec_xori(a, ones);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == BOOL) {
+            __vecb a = _vec_loadb(stack.data[sp].b + o);
 
-        _vec_storei(stack.data[sp].b, result);
-    } else {
-        return -1;
+            _vec_storeb(stack.data[sp].b + o, _vec_notb(a));
+        } else {
+            return -1;
+        }
     }
 
     return 0;
@@ -601,67 +831,97 @@ int VM::simd_not(const Instruction& instruction) {
  * Returns:
  *     int - 0 on succes, -1 on failure.
  */
-int VM::simd_select(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_select(const Instruction& instruction) {
     int sp = stack.sp;
 
-    if(sp < 2) return -1;
+    if(Checked && sp < 2) return -1;
 
-    __veci cond = _vec_loadi(stack.data[sp-2].b);
-
-    if(instruction.type == I32) {
-        __veci a = _vec_loadi(stack.data[sp-1].i32);
-        __veci b = _vec_loadi(stack.data[sp].i32);
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __vecb cond = _vec_loadb(stack.data[sp-2].b + o);
 
         // Select statement is (cond) ? a : b
-        __veci result = _vec_ori(
-            _vec_andi(cond, a),
-            _vec_andnoti(cond, b)
-        );
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
+
+            _vec_storei(stack.data[sp-2].i32 + o, _vec_blendi(cond, a, b));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
+
+            _vec_storef(stack.data[sp-2].f32 + o, _vec_blendf(cond, a, b));
+        } else if(instruction.type == BOOL) {
+            __vecb a = _vec_loadb(stack.data[sp-1].b + o);
+            __vecb b = _vec_loadb(stack.data[sp].b + o);
+
+            _vec_storeb(stack.data[sp-2].b + o, _vec_orb(_vec_andb(cond, a), _vec_andb(_vec_notb(cond), b)));
+        } else {
+            return -1;
+        }
+    }
 
-        _vec_storei(stack.data[sp-2].i32, result);
-    } else if(instruction.type == F32) {
-        __vecf a = _vec_loadf(stack.data[sp-1].f32);
-        __vecf b = _vec_loadf(stack.data[sp].f32);
-        __vecf cond_ps = _vec_castif(cond);
+    stack.sp -= 2;
+    return 0;
+}
 
-        // Select statement is (cond) ? a : b
-        __vecf result = _vec_orf(
-            _vec_andf(cond_ps, a),
-            _vec_andnotf(cond_ps, b)
-        );
+/*
+ * Bijective 32-bit integer hash with full avalanche (lowbias32).
+ * Arguments:
+ *     __veci x - Value to hash.
+ * Returns:
+ *     __veci - Hashed value.
+ */
+static inline __veci mix32(__veci x) {
+    x = _vec_xori(x, _vec_sri(x, 16));
+    x = _vec_muli(x, _vec_bcsti(RAND_MIX1));
+    x = _vec_xori(x, _vec_sri(x, 15));
+    x = _vec_muli(x, _vec_bcsti(RAND_MIX2));
+    x = _vec_xori(x, _vec_sri(x, 16));
+    return x;
+}
 
-        _vec_storef(stack.data[sp-2].f32, result);
-    } else if(instruction.type == BOOL) {
-        __veci a = _vec_loadi(stack.data[sp-1].b);
-        __veci b = _vec_loadi(stack.data[sp].b);
+/*
+ * Hash the seed with the global index of every instance in the lane group.
+ * RAND only adds the call number to this key, so the numbers an instance
+ * draws depend on nothing but the seed, its index and the call, whichever
+ * batch, lane or engine runs it.
+ */
+void ExecutionContext::start_random() {
+    __veci seed_lo = _vec_bcsti((int32_t)rng_seed);
+    __veci seed_hi = _vec_bcsti((int32_t)(rng_seed >> 32));
+    __veci sign = _vec_bcsti(INT32_MIN);
 
-        // Select statement is (cond) ? a : b
-        __veci result = _vec_ori(
-            _vec_andi(cond, a),
-            _vec_andnoti(cond, b)
-        );
+    for(int j = 0; j < UNROLL; j++) {
+        uint64_t start = first_instance + batch_offset + j * LANES;
+        __veci start_lo = _vec_bcsti((int32_t)start);
+        __veci lo = _vec_addi(start_lo, _vec_iota);
 
-        _vec_storei(stack.data[sp-2].b, result);
-    } else {
-        return -1;
-    }
+        // Lanes whose low word wrapped carry into the high word
+        __veci carry = _vec_b2i(_vec_cmplti(_vec_xori(lo, sign), _vec_xori(start_lo, sign)));
+        __veci hi = _vec_subi(_vec_bcsti((int32_t)(start >> 32)), carry);
 
-    stack.sp -= 2;
-    return 0;
+        rng_base[j] = mix32(_vec_addi(mix32(_vec_xori(lo, seed_lo)), mix32(_vec_xori(hi, seed_hi))));
+    }
 }
 
 /*
- * Random number generator that implements xorshift32.
+ * Draw one vector of the call'th RAND of the lane group as floats in
+ * [0.0, 1.0). Calls are independent, there is no state carried between them.
  * Arguments:
- *     __veci x - Seed.
+ *     int j - Vector within the lane group.
+ *     int call - RAND calls the lane group made before this one.
  * Returns:
- *     __veci - Random number.
+ *     __vecf - One random float per lane.
  */
-static inline __veci xorshift32(__veci x) {
-    x = _vec_xori(x, _vec_sli(x, 13));
-    x = _vec_xori(x, _vec_sri(x, 17));
-    x = _vec_xori(x, _vec_sli(x, 5));
-    return x;
+inline __vecf ExecutionContext::next_random(int j, int call) {
+    __veci bits = mix32(_vec_addi(rng_base[j], _vec_bcsti((int32_t)((call + 1) * RAND_STEP))));
+
+    __veci mantissa = _vec_sri(bits, 9);           // Keep 23 bits
+    __veci one = _vec_bcsti(0x3F800000);           // 1.0f
+
+    __vecf f = _vec_castif(_vec_ori(mantissa, one));
+    return _vec_subf(f, _vec_bcstf(1.0f));
 }
 
 /*
@@ -671,23 +931,123 @@ static inline __veci xorshift32(__veci x) {
  * Returns:
  *     int - 0 on success, -1 on failure.
  */
-int VM::simd_rand(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_rand(const Instruction& instruction) {
+    stack.sp++;
+    int sp = stack.sp;
+
+    if(Checked && sp >= MAX_STACK) return -1;
+
+    if(rand_calls == 0) start_random();
+    int call = rand_calls++;
+    for(int o = 0; o < WIDTH; o += LANES) {
+        _vec_storef(stack.data[sp].f32 + o, next_random(o / LANES, call));
+    }
+
+    return 0;
+}
+
+/*
+ * Square a variable, fusing LOAD_VAR a; LOAD_VAR a; MUL.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_square_var(const Instruction& instruction) {
     stack.sp++;
     int sp = stack.sp;
+    if(Checked && sp >= MAX_STACK) return -1;
+    if(Checked && (instruction.slot >= MAX_SLOTS || instruction.slot < 0)) return -1;
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci a = _vec_loadi(slot(I32, instruction.slot).i32 + o);
+            _vec_storei(stack.data[sp].i32 + o, _vec_muli(a, a));
+        } else if(instruction.type == F32) {
+            __vecf a = _vec_loadf(slot(F32, instruction.slot).f32 + o);
+            _vec_storef(stack.data[sp].f32 + o, _vec_mulf(a, a));
+        } else {
+            return -1;
+        }
+    }
 
-    if(sp >= MAX_STACK) return -1;
+    return 0;
+}
 
-    // Advance RNG
-    rng_state = xorshift32(rng_state);
+/*
+ * Multiply-add, fusing MUL; ADD. Computes c + a * b for the stack c a b,
+ * with a single rounding for floats when the CPU has FMA.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_fma(const Instruction& instruction) {
+    int sp = stack.sp;
 
-    __veci mantissa = _vec_sri(rng_state, 9);    // Keep 23 bits
-    __veci one = _vec_bcsti(0x3F800000);           // 1.0f
+    if(Checked && sp < 2) return -1;
 
-    __vecf f = _vec_castif(_vec_ori(mantissa, one));
-    f = _vec_subf(f, _vec_bcstf(1.0f));
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(instruction.type == I32) {
+            __veci c = _vec_loadi(stack.data[sp-2].i32 + o);
+            __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+            __veci b = _vec_loadi(stack.data[sp].i32 + o);
 
-    _vec_storef(stack.data[sp].f32, f);
+            _vec_storei(stack.data[sp-2].i32 + o, _vec_addi(c, _vec_muli(a, b)));
+        } else if(instruction.type == F32) {
+            __vecf c = _vec_loadf(stack.data[sp-2].f32 + o);
+            __vecf a = _vec_loadf(stack.data[sp-1].f32 + o);
+            __vecf b = _vec_loadf(stack.data[sp].f32 + o);
 
+            _vec_storef(stack.data[sp-2].f32 + o, _vec_fmaddf(a, b, c));
+        } else {
+            return -1;
+        }
+    }
+
+    stack.sp -= 2;
+    return 0;
+}
+
+/*
+ * Compare and select between two constants, fusing CMP_*; PUSH_CONST;
+ * PUSH_CONST; SELECT. The two PUSH_CONST instructions follow this one in
+ * the bytecode as its operands and are skipped. Only verified kernels may
+ * use it: unverified bytecode has no known end, so the operand words could
+ * lie past it.
+ * Arguments:
+ *     const Instruction& instruction - Current context.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+template<bool Checked>
+HANDLER int ExecutionContext::simd_cmp_select_const(const Instruction& instruction) {
+    if(Checked) return -1;
+
+    int sp = stack.sp;
+    const Instruction& if_true = (&instruction)[1];
+    const Instruction& if_false = (&instruction)[2];
+
+    for(int o = 0; o < WIDTH; o += LANES) {
+        __veci a = _vec_loadi(stack.data[sp-1].i32 + o);
+        __veci b = _vec_loadi(stack.data[sp].i32 + o);
+        __vecb cond = compare(instruction.compare, instruction.type, a, b);
+
+        if(if_true.type == BOOL) {
+            // Boolean results are masks, like PUSH_CONST stores them
+            __vecb t = _vec_bcstb(if_true.const_bool), f = _vec_bcstb(if_false.const_bool);
+            _vec_storeb(stack.data[sp-1].b + o, _vec_orb(_vec_andb(cond, t), _vec_andb(_vec_notb(cond), f)));
+        } else {
+            __veci t = _vec_bcsti(if_true.const_int), f = _vec_bcsti(if_false.const_int);
+            _vec_storei(stack.data[sp-1].i32 + o, _vec_blendi(cond, t, f));
+        }
+    }
+
+    stack.sp--;
+    pc += 2;
     return 0;
 }
 
@@ -698,26 +1058,30 @@ int VM::simd_rand(const Instruction& instruction) {
  * Returns:
  *     int - 1 on success, -1 on failure.
  */
-int VM::simd_return(const Instruction& instruction) {
+template<bool Checked>
+HANDLER int ExecutionContext::simd_return(const Instruction& instruction) {
     // Bounds check
     int sp = stack.sp;
-    if(sp < 0 || sp >= MAX_STACK) { 
+    if(Checked && (sp < 0 || sp >= MAX_STACK)) { 
         retval.type = KERNEL_ERROR; 
         return -1; 
     }
 
     // Aggregate the final return values
-    if(retval.type == KERNEL_I32) {
-        __veci results = _vec_loadi(stack.data[stack.sp].i32);
-        _vec_storei(retval.result_int, results);
-    } else if(retval.type == KERNEL_F32) {
-        __vecf results = _vec_loadf(stack.data[stack.sp].f32);
-        _vec_storef(retval.result_float, results);
-    } else if(retval.type == KERNEL_BOOL) {
-        __veci results = _vec_loadi(stack.data[stack.sp].b);
-        _vec_storei(retval.result_bool, results);
-    } else {
-        return -1;
+    for(int o = 0; o < WIDTH; o += LANES) {
+        if(retval.type == KERNEL_I32) {
+            __veci results = _vec_loadi(stack.data[stack.sp].i32 + o);
+            _vec_storei(retval.result_int + o, results);
+        } else if(retval.type == KERNEL_F32) {
+            __vecf results = _vec_loadf(stack.data[stack.sp].f32 + o);
+            _vec_storef(retval.result_float + o, results);
+        } else if(retval.type == KERNEL_BOOL) {
+            // Booleans are returned as full -1/0 lane masks
+            __vecb results = _vec_loadb(stack.data[stack.sp].b + o);
+            _vec_storei(retval.result_bool + o, _vec_b2i(results));
+        } else {
+            return -1;
+        }
     }
 
     return 1;
@@ -726,10 +1090,105 @@ int VM::simd_return(const Instruction& instruction) {
 /*
  * Instruction execution dispatcher.
  */
-VMReturnValue& VM::run() {
+#ifdef MOSAIC_THREADED_DISPATCH
+template<bool Checked>
+VMReturnValue& ExecutionContext::execute() {
+    // Must stay in OpCode order
+    static void *const labels[] = {
+        &&op_push_const,
+        &&op_load_var,
+        &&op_store_var,
+        &&op_add,
+        &&op_sub,
+        &&op_mul,
+        &&op_div,
+        &&op_mod,
+        &&op_cmp_lt,
+        &&op_cmp_lte,
+        &&op_cmp_gt,
+        &&op_cmp_gte,
+        &&op_cmp_eq,
+        &&op_cmp_ne,
+        &&op_and,
+        &&op_or,
+        &&op_not,
+        &&op_select,
+        &&op_rand,
+        &&op_return,
+        &&op_load_arg,
+        &&op_shl,
+        &&op_div_pow2,
+        &&op_mod_pow2,
+        &&op_square_var,
+        &&op_fma,
+        &&op_cmp_select_const,
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == NUM_OPCODES, "missing opcode label");
+
+    const Instruction *ip = bytecode + pc;
+    int result;
+
+#define DISPATCH() goto *labels[ip->opcode]
+#define OP(label, handler) \
+    label: \
+        result = handler(*ip); \
+        if(result != 0) goto done; \
+        ip++; \
+        DISPATCH();
+
+    DISPATCH();
+
+    OP(op_push_const, simd_push_const<Checked>)
+    OP(op_load_var, simd_load_var<Checked>)
+    OP(op_store_var, simd_store_var<Checked>)
+    OP(op_load_arg, simd_load_arg<Checked>)
+    OP(op_add, simd_add<Checked>)
+    OP(op_sub, simd_sub<Checked>)
+    OP(op_mul, simd_mul<Checked>)
+    OP(op_div, simd_div<Checked>)
+    OP(op_mod, simd_mod<Checked>)
+    OP(op_shl, simd_shl<Checked>)
+    OP(op_div_pow2, simd_div_pow2<Checked>)
+    OP(op_mod_pow2, simd_mod_pow2<Checked>)
+    OP(op_cmp_lt, simd_cmp_lt<Checked>)
+    OP(op_cmp_lte, simd_cmp_lte<Checked>)
+    OP(op_cmp_gt, simd_cmp_gt<Checked>)
+    OP(op_cmp_gte, simd_cmp_gte<Checked>)
+    OP(op_cmp_eq, simd_cmp_eq<Checked>)
+    OP(op_cmp_ne, simd_cmp_ne<Checked>)
+    OP(op_and, simd_and<Checked>)
+    OP(op_or, simd_or<Checked>)
+    OP(op_not, simd_not<Checked>)
+    OP(op_select, simd_select<Checked>)
+    OP(op_rand, simd_rand<Checked>)
+    OP(op_square_var, simd_square_var<Checked>)
+    OP(op_fma, simd_fma<Checked>)
+
+    // Skips the two constants that follow it
+    op_cmp_select_const:
+        result = simd_cmp_select_const<Checked>(*ip);
+        if(result != 0) goto done;
+        ip += 3;
+        DISPATCH();
+
+    OP(op_return, simd_return<Checked>)
+
+#undef OP
+#undef DISPATCH
+
+done:
+    pc = ip - bytecode;
+    if(result < 0) retval.type = KERNEL_ERROR;
+    return retval;
+}
+#else
+template<bool Checked>
+VMReturnValue& ExecutionContext::execute() {
+    static_assert(sizeof(dispatch<Checked>) / sizeof(dispatch<Checked>[0]) == NUM_OPCODES, "missing opcode handler");
+
     while(true) {
         const Instruction& instr = bytecode[pc];
-        int result = (this->*dispatch[instr.opcode])(instr);
+        int result = (this->*dispatch<Checked>[instr.opcode])(instr);
         if(result < 0) {
             retval.type = KERNEL_ERROR;
             return retval;
@@ -739,19 +1198,723 @@ VMReturnValue& VM::run() {
         pc++;
     }
 }
+#endif
+
+/*
+ * Verify the kernel once so later runs can skip per-instruction checks.
+ * Must be called after set_return_type().
+ * Arguments:
+ *     int length - Number of instructions in the bytecode.
+ * Returns:
+ *     int - 0 if the kernel is valid, -1 if it was rejected.
+ */
+int CompiledKernel::verify(int length) {
+    verified = verify_bytecode(bytecode, length, return_type, &info) == 0;
+    use_registers = false;
+    jit_code.reset();
+    return verified ? 0 : -1;
+}
+
+/*
+ * Rewrite the verified kernel with optimize_bytecode() into an owned copy
+ * and verify the copy again, as the engines trust the verifier's facts.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is unverified or the optimized
+ *           kernel was rejected.
+ */
+int CompiledKernel::optimize() {
+    if(!verified) return -1;
+
+    std::vector<Instruction> optimized;
+    if(optimize_bytecode(bytecode, info, &optimized) < 0) return -1;
+    storage.swap(optimized);
+    bytecode = storage.data();
+    return verify((int)storage.size());
+}
+
+/*
+ * Translate the verified kernel to register form so later runs use the
+ * register interpreter instead of the stack machine.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is unverified or too large.
+ */
+int CompiledKernel::translate() {
+    use_registers = false;
+    if(!verified) return -1;
+    if(translate_bytecode(bytecode, info, &program) < 0) return -1;
+
+    use_registers = true;
+    return 0;
+}
+
+/*
+ * Compile the verified kernel to native code. Full lane groups then run
+ * the generated code, partial groups and kernels the JIT can't handle keep
+ * using the register interpreter.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel couldn't be compiled.
+ */
+int CompiledKernel::compile_jit() {
+    jit_code.reset();
+    if(!use_registers && translate() < 0) return -1;
+
+    // Generated code shares the register interpreter's slot layout
+    return jit_compile(bytecode, info, program.slot_base, &jit_code);
+}
+
+/*
+ * Set the return type of the kernel.
+ * Arguments:
+ *     VMReturnType type - Return type of the kernel.
+ */
+void CompiledKernel::set_return_type(VMReturnType type) {
+    // The verified return type no longer holds
+    if(type != return_type) {
+        verified = false;
+        use_registers = false;
+        jit_code.reset();
+    }
+    return_type = type;
+}
+
+/*
+ * Build a shareable kernel: copy the bytecode, verify it, optionally
+ * optimize it and fuse it into superinstructions, translate it to registers
+ * and optionally compile it. A kernel too large for the register file or
+ * the JIT still runs on the verified stack interpreter.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, copied.
+ *     int length - Instructions up to and including RETURN.
+ *     VMReturnType type - Return type of the kernel.
+ *     bool jit - Compile to native code where the JIT can.
+ *     bool optimize - Run optimize_bytecode() on the copy, before fusing.
+ *     bool fuse - Run fuse_superinstructions() on the copy. Float MUL; ADD
+ *                 is left alone, so results match the unfused kernel.
+ *     std::shared_ptr<const CompiledKernel> *kernel - Receives the kernel.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel was rejected by the verifier.
+ */
+int compile_kernel(const Instruction *bytecode, int length, VMReturnType type, bool jit, bool optimize, bool fuse, std::shared_ptr<const CompiledKernel> *kernel) {
+    auto compiled = std::make_shared<CompiledKernel>(nullptr);
+    compiled->storage.assign(bytecode, bytecode + length);
+    compiled->bytecode = compiled->storage.data();
+    compiled->set_return_type(type);
+
+    if(compiled->verify(length) < 0) return -1;
+    if(optimize && compiled->optimize() < 0) return -1;
+    if(fuse) {
+        // The engines trust the verifier's facts, so the fused copy is checked again
+        std::vector<Instruction> fused;
+        fuse_superinstructions(compiled->bytecode, compiled->info, &fused, false);
+        compiled->storage.swap(fused);
+        compiled->bytecode = compiled->storage.data();
+        if(compiled->verify((int)compiled->storage.size()) < 0) return -1;
+    }
+    if(compiled->translate() == 0 && jit) compiled->compile_jit();
+
+    *kernel = compiled;
+    return 0;
+}
+
+/*
+ * Build a shareable kernel from a mapped kernel file. The bytecode runs in
+ * place from the mapping; it is verified again here, as the engines trust
+ * the verifier's facts and the header alone cannot vouch for them.
+ * Arguments:
+ *     std::shared_ptr<const MappedKernel> file - From map_kernel_file().
+ *     bool jit - Compile to native code where the JIT can.
+ *     std::shared_ptr<const CompiledKernel> *kernel - Receives the kernel.
+ * Returns:
+ *     int - 0 on success, -1 if the mapping is empty or the bytecode does
+ *           not match its header.
+ */
+int load_kernel(std::shared_ptr<const MappedKernel> file, bool jit, std::shared_ptr<const CompiledKernel> *kernel) {
+    if(file == nullptr || file->bytecode == nullptr) return -1;
+
+    auto compiled = std::make_shared<CompiledKernel>(file->bytecode);
+    compiled->file = std::move(file);
+    compiled->set_return_type((VMReturnType)compiled->file->header->return_type);
+    if(verify_kernel_file(*compiled->file->header, compiled->bytecode, &compiled->info) < 0) return -1;
+    compiled->verified = true;
+    if(compiled->translate() == 0 && jit) compiled->compile_jit();
+
+    *kernel = compiled;
+    return 0;
+}
+
+/*
+ * Run the given kernel from now on. The frame is laid out for it and, if
+ * it runs in registers, loaded with its constants.
+ * Arguments:
+ *     std::shared_ptr<const CompiledKernel> kernel - Kernel to run.
+ */
+void ExecutionContext::bind(std::shared_ptr<const CompiledKernel> kernel) {
+    this->kernel = std::move(kernel);
+    bytecode = this->kernel->bytecode;
+    pc = 0;
+    stack.sp = -1;
+    retval.type = this->kernel->return_type;
+    layout_frame();
+}
+
+/*
+ * Size the frame for what is known about the kernel: room for every slot
+ * and the full stack until it is verified, then exactly its slots and
+ * stack depth, or its registers once translated. The frame is zeroed and
+ * only reallocated when its size changes.
+ */
+void ExecutionContext::layout_frame() {
+    const CompiledKernel& k = *kernel;
+
+    int slot_rows = 0;
+    for(int type = I32; type <= BOOL; type++) {
+        slot_base[type] = slot_rows;
+        slot_rows += k.verified ? k.info.slot_count[type] : MAX_SLOTS;
+    }
+
+    int rows = slot_rows + (k.verified ? k.info.max_stack : MAX_STACK);
+    if(k.use_registers && k.program.num_regs > rows) rows = k.program.num_regs;
+
+    if(rows != frame_rows) {
+        size_t bytes = (rows * sizeof(StackSlot) + 63) & ~(size_t)63;
+        frame.reset((StackSlot *)aligned_alloc(64, bytes > 0 ? bytes : 64));
+        frame_rows = rows;
+    }
+    memset(frame.get(), 0, rows * sizeof(StackSlot));
+
+    stack.data = frame.get() + slot_rows;
+    regs = (__veci (*)[UNROLL])frame.get();
+
+    // Constants live in the register file for the lifetime of the program,
+    // slots keep their rows and temporaries take over the stack's
+    if(k.use_registers) {
+        for(const RegConstant& constant : k.program.constants) {
+            for(int j = 0; j < UNROLL; j++) regs[constant.reg][j] = _vec_bcsti(constant.bits);
+        }
+    }
+}
+
+/*
+ * Point the JIT context at this VM's state and bound columns. The slots,
+ * RNG and result pointers are moved to each vector of the lane group as
+ * the generated code runs on it.
+ */
+void ExecutionContext::bind_jit_context() {
+    for(int k = 0; k < MAX_ARGS; k++) {
+        jit_context.args[k] = columns[k].data;
+    }
+}
+
+/*
+ * Register interpreter. Operands are read straight from the register file,
+ * so values never round trip through the stack. Each register holds UNROLL
+ * vectors and every instruction works through all of them back to back.
+ * Opcodes carry their type, so each case is straight-line vector code.
+ */
+VMReturnValue& ExecutionContext::execute_registers() {
+    const RegInstruction *code = kernel->program.code.data();
+    const DivMagic *divisors = kernel->program.divisors.data();
+    __veci ones = _vec_bcsti(-1);
+
+    for(size_t i = 0; ; i++) {
+        const RegInstruction& instr = code[i];
+        __veci *dst = regs[instr.dst];
+        const __veci *a = regs[instr.a];
+        const __veci *b = regs[instr.b];
+        const __veci *c = regs[instr.c];
+
+#define EACH(expr) for(int j = 0; j < UNROLL; j++) dst[j] = (expr)
+#define EACHF(expr) EACH(_vec_castfi(expr))
+#define A _vec_castif(a[j])
+#define B _vec_castif(b[j])
+#define C _vec_castif(c[j])
+
+        switch(instr.op) {
+        case MOVE:
+            EACH(a[j]);
+            break;
+        case LOAD_COLUMN:
+            EACH(load_column(columns[instr.arg], j * LANES));
+            break;
+        case LOAD_MASK:
+            // Registers keep booleans as full -1/0 lane masks
+            EACH(_vec_b2i(_vec_i2b(load_column(columns[instr.arg], j * LANES))));
+            break;
+        case ADD_I32: EACH(_vec_addi(a[j], b[j])); break;
+        case ADD_F32: EACHF(_vec_addf(A, B)); break;
+        case SUB_I32: EACH(_vec_subi(a[j], b[j])); break;
+        case SUB_F32: EACHF(_vec_subf(A, B)); break;
+        case MUL_I32: EACH(_vec_muli(a[j], b[j])); break;
+        case MUL_F32: EACHF(_vec_mulf(A, B)); break;
+        case DIV_F32: EACHF(_vec_divf(A, B)); break;
+        case DIV_I32:
+        case MOD_I32:
+            for(int j = 0; j < UNROLL; j++) {
+                if(divide_vectors(a[j], b[j], active_lanes - j * LANES, instr.op == MOD_I32, &dst[j]) < 0) {
+                    retval.type = KERNEL_ERROR;
+                    return retval;
+                }
+            }
+            break;
+        case DIV_MAGIC_I32: EACH(divide_magic(a[j], divisors[instr.arg], false)); break;
+        case MOD_MAGIC_I32: EACH(divide_magic(a[j], divisors[instr.arg], true)); break;
+        case SHL_I32: EACH(_vec_sli(a[j], instr.arg)); break;
+        case DIV_POW2_I32: EACH(div_pow2(a[j], instr.arg)); break;
+        case MOD_POW2_I32: EACH(mod_pow2(a[j], instr.arg)); break;
+        case CMP_LT_I32: EACH(_vec_b2i(_vec_cmplti(a[j], b[j]))); break;
+        case CMP_LTE_I32: EACH(_vec_b2i(_vec_notb(_vec_cmplti(b[j], a[j])))); break;
+        case CMP_GT_I32: EACH(_vec_b2i(_vec_cmplti(b[j], a[j]))); break;
+        case CMP_GTE_I32: EACH(_vec_b2i(_vec_notb(_vec_cmplti(a[j], b[j])))); break;
+        case CMP_EQ_I32: EACH(_vec_b2i(_vec_cmpeqi(a[j], b[j]))); break;
+        case CMP_NE_I32: EACH(_vec_b2i(_vec_notb(_vec_cmpeqi(a[j], b[j])))); break;
+        case CMP_LT_F32: EACH(_vec_b2i(_vec_cmpltf(A, B))); break;
+        case CMP_LTE_F32: EACH(_vec_b2i(_vec_cmplef(A, B))); break;
+        case CMP_GT_F32: EACH(_vec_b2i(_vec_cmpgtf(A, B))); break;
+        case CMP_GTE_F32: EACH(_vec_b2i(_vec_cmpgef(A, B))); break;
+        case CMP_EQ_F32: EACH(_vec_b2i(_vec_cmpeqf(A, B))); break;
+        case CMP_NE_F32: EACH(_vec_b2i(_vec_cmpnef(A, B))); break;
+        case FMA_I32: EACH(_vec_addi(a[j], _vec_muli(b[j], c[j]))); break;
+        case FMA_F32: EACHF(_vec_fmaddf(B, C, A)); break;
+        case AND_BOOL: EACH(_vec_andi(a[j], b[j])); break;
+        case OR_BOOL: EACH(_vec_ori(a[j], b[j])); break;
+        case NOT_BOOL: EACH(_vec_xori(a[j], ones)); break;
+        case BLEND:
+            EACH(_vec_ori(_vec_andi(a[j], b[j]), _vec_andnoti(a[j], c[j])));
+            break;
+        case RAND_F32: {
+            if(rand_calls == 0) start_random();
+            int call = rand_calls++;
+            EACHF(next_random(j, call));
+            break;
+        }
+        case RET:
+            for(int j = 0; j < UNROLL; j++) _vec_storei(retval.result_int + j * LANES, a[j]);
+            return retval;
+        default:
+            retval.type = KERNEL_ERROR;
+            return retval;
+        }
+
+#undef C
+#undef B
+#undef A
+#undef EACHF
+#undef EACH
+    }
+}
+
+/*
+ * Run one lane group on the fastest engine the kernel has been prepared for.
+ */
+VMReturnValue& ExecutionContext::execute_group() {
+    rand_calls = 0;
+
+    const JitCode *jit_code = kernel->jit_code.get();
+    if(jit_code && active_lanes == WIDTH) {
+        if(jit_code->rand_calls > 0) start_random();
+        for(int j = 0; j < UNROLL; j++) {
+            jit_context.slots = &regs[0][j];
+            jit_context.rng_base = &rng_base[j];
+            jit_context.result = retval.result_int + j * LANES;
+            jit_context.offset = (batch_offset + j * LANES) * sizeof(int32_t);
+            jit_code->entry(&jit_context);
+        }
+        return retval;
+    }
+
+    if(kernel->use_registers) return execute_registers();
+    return kernel->verified ? execute<false>() : execute<true>();
+}
+
+/*
+ * Check that every argument a verified kernel loads is bound to a column
+ * of the right type.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int ExecutionContext::check_columns() {
+    for(int k = 0; k < MAX_ARGS; k++) {
+        if(!kernel->info.arg_used[k]) continue;
+        if(columns[k].data == nullptr || columns[k].type != kernel->info.arg_types[k]) return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run the kernel on one lane group.
+ */
+VMReturnValue& ExecutionContext::run() {
+    if(kernel->verified && check_columns() < 0) {
+        retval.type = KERNEL_ERROR;
+        return retval;
+    }
+    if(kernel->jit_code) bind_jit_context();
+
+    return execute_group();
+}
+
+/*
+ * Bind a caller-owned column to a kernel argument. The column is read in
+ * place by LOAD_ARG and must stay alive while the VM runs.
+ * Arguments:
+ *     int index - Argument index.
+ *     TypeTag type - Type of the values in the column.
+ *     const void *data - Column of 32-bit values.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int ExecutionContext::bind_column(int index, TypeTag type, const void *data) {
+    if(index >= MAX_ARGS || index < 0) return -1;
+    if(type != I32 && type != F32 && type != BOOL) return -1;
+
+    columns[index].type = type;
+    columns[index].data = data;
+    return 0;
+}
+
+/*
+ * Run the kernel over n instances of the bound columns, WIDTH at a time.
+ * A trailing partial group is handled with masked loads and stores, so
+ * neither inputs nor output need padding. Every group starts from zeroed
+ * slots, so no instance sees values stored by another.
+ * Arguments:
+ *     size_t n - Number of instances.
+ *     void *output - Output buffer for n values of the kernel's return type.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int ExecutionContext::run_batch(size_t n, void *output) {
+    if(kernel->verified && check_columns() < 0) return -1;
+    if(kernel->jit_code) bind_jit_context();
+
+    int32_t *out = (int32_t *)output;
+    int status = 0;
+
+    for(batch_offset = 0; batch_offset < n; batch_offset += WIDTH) {
+        active_lanes = n - batch_offset < WIDTH ? (int)(n - batch_offset) : WIDTH;
+
+        pc = 0;
+        stack.sp = -1;
+        retval.type = kernel->return_type;
+        clear_slots();
+
+        VMReturnValue& result = execute_group();
+        if(result.type == KERNEL_ERROR) {
+            status = -1;
+            break;
+        }
+
+        for(int o = 0; o < WIDTH; o += LANES) {
+            __veci results = _vec_loadi(result.result_int + o);
+            if(active_lanes - o >= LANES) {
+                _vec_storei(out + batch_offset + o, results);
+            } else {
+                _vec_maskstorei(out + batch_offset + o, _vec_lanemask(active_lanes - o), results);
+            }
+        }
+    }
+
+    batch_offset = 0;
+    active_lanes = WIDTH;
+    return status;
+}
+
+/*
+ * Bind the given columns to arguments 0..num_inputs-1 and run the kernel
+ * over n instances.
+ * Arguments:
+ *     const Column *inputs - Input columns, each holding n values.
+ *     int num_inputs - Number of input columns.
+ *     size_t n - Number of instances.
+ *     void *output - Output buffer for n values of the kernel's return type.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int ExecutionContext::run_batch(const Column *inputs, int num_inputs, size_t n, void *output) {
+    for(int k = 0; k < num_inputs; k++) {
+        if(bind_column(k, inputs[k].type, inputs[k].data) < 0) return -1;
+    }
+
+    return run_batch(n, output);
+}
+
+/* I32 sums are flushed to 64 bits before 16-bit halves can overflow a lane. */
+constexpr int REDUCE_FLUSH_GROUPS = 1 << 15;
+
+/*
+ * Running vector accumulators of a reduction, one of each per vector of
+ * the lane group. I32 sums are kept as low and high 16-bit halves so the
+ * 32-bit lanes never overflow between flushes to the 64-bit total, and
+ * F32 sums carry a Kahan compensation term.
+ */
+struct Reduction {
+    ReduceOp op;
+    TypeTag type;
+    __veci lo[UNROLL], hi[UNROLL];      // I32 sums and counts
+    __vecf sum[UNROLL], carry[UNROLL];  // F32 sums and their lost low bits
+    __veci best[UNROLL];                // Running MIN or MAX
+    int64_t total;
+    int pending;                        // Groups added since the last flush
+
+    Reduction(ReduceOp op, TypeTag type) : op(op), type(type), total(0), pending(0) {
+        bool is_max = op == REDUCE_MAX;
+        __veci init = type == F32 ? _vec_castfi(_vec_bcstf(is_max ? -INFINITY : INFINITY))
+                                  : _vec_bcsti(is_max ? INT32_MIN : INT32_MAX);
+        for(int j = 0; j < UNROLL; j++) {
+            lo[j] = hi[j] = _vec_bcsti(0);
+            sum[j] = carry[j] = _vec_bcstf(0.0f);
+            best[j] = init;
+        }
+    }
+
+    /*
+     * Fold in one vector of results. Lanes outside mask are padding and
+     * leave the accumulators as they were.
+     */
+    void add(int j, __veci value, __veci mask) {
+        if(type == BOOL) value = _vec_sri(value, 31);
+
+        switch(op) {
+        case REDUCE_COUNT: {
+            // Unordered, so NaN counts as nonzero on every ISA
+            __veci zero = _vec_bcsti(0);
+            __veci nonzero = type == F32 ? _vec_b2i(_vec_cmpneuf(_vec_castif(value), _vec_castif(zero)))
+                                         : _vec_b2i(_vec_notb(_vec_cmpeqi(value, zero)));
+            lo[j] = _vec_subi(lo[j], _vec_andi(nonzero, mask));
+            break;
+        }
+        case REDUCE_MIN:
+        case REDUCE_MAX:
+            // Padding lanes repeat the best so far, NaN results keep it too
+            value = _vec_ori(_vec_andi(mask, value), _vec_andnoti(mask, best[j]));
+            if(type == F32) {
+                __vecf x = _vec_castif(value), y = _vec_castif(best[j]);
+                best[j] = _vec_castfi(op == REDUCE_MIN ? _vec_minf(x, y) : _vec_maxf(x, y));
+            } else {
+                best[j] = op == REDUCE_MIN ? _vec_mini(value, best[j]) : _vec_maxi(value, best[j]);
+            }
+            break;
+        default:
+            value = _vec_andi(value, mask);
+            if(type == F32) {
+                __vecf y = _vec_subf(_vec_castif(value), carry[j]);
+                __vecf t = _vec_addf(sum[j], y);
+                carry[j] = _vec_subf(_vec_subf(t, sum[j]), y);
+                sum[j] = t;
+            } else {
+                lo[j] = _vec_addi(lo[j], _vec_andi(value, _vec_bcsti(0xFFFF)));
+                hi[j] = _vec_addi(hi[j], _vec_srai(value, 16));
+            }
+            break;
+        }
+    }
+
+    /* Called once per lane group, moves the I32 sums to the 64-bit total in time. */
+    void end_group() {
+        if(++pending == REDUCE_FLUSH_GROUPS) flush();
+    }
+
+    void flush() {
+        int32_t l[LANES], h[LANES];
+        for(int j = 0; j < UNROLL; j++) {
+            _vec_storei(l, lo[j]);
+            _vec_storei(h, hi[j]);
+            for(int k = 0; k < LANES; k++) total += (int64_t)h[k] * 65536 + l[k];
+            lo[j] = hi[j] = _vec_bcsti(0);
+        }
+        pending = 0;
+    }
+
+    /*
+     * Combine the lanes into the final aggregate of n instances.
+     * Returns:
+     *     int - 0 on success, -1 for a MIN, MAX or MEAN of no instances.
+     */
+    int finish(size_t n, ReduceValue *result) {
+        if(n == 0 && op != REDUCE_SUM && op != REDUCE_COUNT) return -1;
+
+        if(op == REDUCE_MIN || op == REDUCE_MAX) {
+            int32_t lanes[LANES];
+            float values[LANES];
+            bool is_min = op == REDUCE_MIN;
+            double f = 0;
+            int64_t i = 0;
+            for(int j = 0; j < UNROLL; j++) {
+                _vec_storei(lanes, best[j]);
+                memcpy(values, lanes, sizeof(values));
+                for(int k = 0; k < LANES; k++) {
+                    bool first = j == 0 && k == 0;
+                    if(first || (is_min ? values[k] < f : values[k] > f)) f = values[k];
+                    if(first || (is_min ? lanes[k] < i : lanes[k] > i)) i = lanes[k];
+                }
+            }
+            if(type == F32) result->f64 = f;
+            else result->i64 = i;
+            return 0;
+        }
+
+        double total_f32 = 0;
+        float s[LANES], c[LANES];
+        for(int j = 0; j < UNROLL; j++) {
+            _vec_storef(s, sum[j]);
+            _vec_storef(c, carry[j]);
+            for(int k = 0; k < LANES; k++) total_f32 += (double)s[k] - (double)c[k];
+        }
+        flush();
+
+        if(op == REDUCE_MEAN) result->f64 = (type == F32 ? total_f32 : (double)total) / n;
+        else if(op == REDUCE_SUM && type == F32) result->f64 = total_f32;
+        else result->i64 = total;
+        return 0;
+    }
+};
+
+/*
+ * Run the kernel over n instances of the bound columns and reduce the
+ * results as they are produced, WIDTH at a time into vector accumulators,
+ * so no per-instance output is ever written.
+ * Arguments:
+ *     size_t n - Number of instances.
+ *     ReduceOp op - Aggregate to compute.
+ *     ReduceValue *result - Receives the aggregate.
+ * Returns:
+ *     int - 0 on success, -1 on failure or for a MIN, MAX or MEAN of no
+ *           instances.
+ */
+int ExecutionContext::run_reduce(size_t n, ReduceOp op, ReduceValue *result) {
+    if(kernel->verified && check_columns() < 0) return -1;
+    if(kernel->jit_code) bind_jit_context();
+
+    Reduction reduction(op, (TypeTag)kernel->return_type);
+    __veci all = _vec_bcsti(-1);
+    int status = 0;
+
+    for(batch_offset = 0; batch_offset < n; batch_offset += WIDTH) {
+        active_lanes = n - batch_offset < WIDTH ? (int)(n - batch_offset) : WIDTH;
+
+        pc = 0;
+        stack.sp = -1;
+        retval.type = kernel->return_type;
+        clear_slots();
+
+        VMReturnValue& group = execute_group();
+        if(group.type == KERNEL_ERROR) {
+            status = -1;
+            break;
+        }
+
+        for(int j = 0; j < UNROLL; j++) {
+            int o = j * LANES;
+            __veci mask = active_lanes - o >= LANES ? all : _vec_b2i(_vec_lanemask(active_lanes - o));
+            reduction.add(j, _vec_loadi(group.result_int + o), mask);
+        }
+        reduction.end_group();
+    }
+
+    batch_offset = 0;
+    active_lanes = WIDTH;
+    if(status < 0) return -1;
+    return reduction.finish(n, result);
+}
 
 /*
- * Reset the VM to run again.
+ * Bind the given columns to arguments 0..num_inputs-1 and reduce the
+ * kernel's results over n instances.
+ * Arguments:
+ *     const Column *inputs - Input columns, each holding n values.
+ *     int num_inputs - Number of input columns.
+ *     size_t n - Number of instances.
+ *     ReduceOp op - Aggregate to compute.
+ *     ReduceValue *result - Receives the aggregate.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int ExecutionContext::run_reduce(const Column *inputs, int num_inputs, size_t n, ReduceOp op, ReduceValue *result) {
+    for(int k = 0; k < num_inputs; k++) {
+        if(bind_column(k, inputs[k].type, inputs[k].data) < 0) return -1;
+    }
+
+    return run_reduce(n, op, result);
+}
+
+/*
+ * Zero the variable slots a kernel can read before storing to them. A
+ * verified kernel only needs the slots the verifier saw loaded first,
+ * usually none, in whichever of the slot array or register file it runs on.
  */
-void VM::reset() {
+void ExecutionContext::clear_slots() {
+    if(!kernel->verified) {
+        memset(frame.get(), 0, slot_base[BOOL] * sizeof(StackSlot) + MAX_SLOTS * sizeof(StackSlot));
+        return;
+    }
+
+    // Both interpreters and the JIT keep slot s of a type in the same row
+    for(int type = I32; type <= BOOL; type++) {
+        for(uint32_t mask = kernel->info.slot_read_first[type]; mask != 0; mask &= mask - 1) {
+            memset(&slot((TypeTag)type, __builtin_ctz(mask)), 0, sizeof(StackSlot));
+        }
+    }
+}
+
+/*
+ * Reset the VM to run again. The stack is never read above its top, so
+ * only the slots are cleared, and no system calls are made. The seed and
+ * the first instance index are kept.
+ */
+void ExecutionContext::reset() {
     pc = 0;
-    memset(&stack, 0, sizeof(stack));
     stack.sp = -1;
-    memset(&slots, 0, sizeof(slots));
-    memset(&retval, 0, sizeof(retval));
-    int fd = open("/dev/random", O_RDONLY);
-    read(fd, &rng_seed, sizeof(rng_seed));
-    rng_state = _vec_loadi(rng_seed);
+    rand_calls = 0;
+    clear_slots();
+    retval.type = kernel->return_type;
+}
+
+/*
+ * Set the task seed RAND is keyed by. The seed outlives reset().
+ * Arguments:
+ *     uint64_t seed - Task seed.
+ */
+void ExecutionContext::seed_random(uint64_t seed) {
+    rng_seed = seed;
+}
+
+/*
+ * Set the global index of the first instance of the next run or batch, so
+ * a task split across batches or workers draws the same random numbers as
+ * one run over all of it.
+ * Arguments:
+ *     uint64_t index - Global index of instance 0.
+ */
+void ExecutionContext::set_first_instance(uint64_t index) {
+    first_instance = index;
+}
+
+/*
+ * Verify the kernel, see CompiledKernel::verify().
+ */
+int VM::verify(int length) {
+    int result = kernel->verify(length);
+    context.bind(kernel);
+    return result;
+}
+
+/*
+ * Translate the kernel to registers, see CompiledKernel::translate().
+ */
+int VM::translate() {
+    int result = kernel->translate();
+    context.bind(kernel);
+    return result;
+}
+
+/*
+ * Compile the kernel to native code, see CompiledKernel::compile_jit().
+ */
+int VM::compile_jit() {
+    int result = kernel->compile_jit();
+    context.bind(kernel);
+    return result;
 }
 
 /*
@@ -760,5 +1923,16 @@ void VM::reset() {
  *     VMReturnType type - Return type of the kernel.
  */
 void VM::set_return_type(VMReturnType type) {
-    this->retval.type = type;
-}
\ No newline at end of file
+    kernel->set_return_type(type);
+    context.bind(kernel);
+
+#ifdef MOSAIC_EAGER_JIT
+    // Compile every kernel as soon as its type is known so the whole test
+    // suite runs on the JIT. Kernels end at their first RETURN.
+    int length = 0;
+    while(kernel->bytecode[length].opcode != RETURN) length++;
+    if(verify(length + 1) == 0) compile_jit();
+#endif
+}
+
+MOSAIC_ISA_END
@@ -1,8 +1,23 @@
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
 #include "test.h"
 #include "vm.h"
+#include "optimizer.h"
+#include "engine.h"
+#include "tuner.h"
+#include "worker.h"
+#include "scheduler.h"
+#include "cluster.h"
+#include "wire.h"
 
 /* If the stack is empty, return should fail. */
 bool invalid_return_test() {
@@ -1330,6 +1345,2190 @@ bool random_test() {
     return true;
 }
 
+/* RAND depends only on the seed, the instance index and the call, not on how the work is split. */
+bool random_partition_test() {
+    Instruction bytecode[] = {
+        { .opcode = RAND },
+        { .opcode = RAND },
+        { .opcode = SUB, .type = F32 },
+        { .opcode = RAND },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 1000;
+    std::vector<float> expected(n), output(n);
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_F32);
+    vm.seed_random(0x0123456789ABCDEFull);
+    if(Tester::assert_fail(vm.run_batch(n, expected.data()) == 0)) return false;
+
+    /* Calls within an instance are independent. */
+    size_t distinct = 0;
+    for(size_t i = 1; i < n; i++) distinct += expected[i] != expected[i - 1];
+    if(Tester::assert_fail(distinct > n - 10)) return false;
+
+    /* Any split into batches, on the stack and register interpreters and the JIT. */
+    for(int mode = 0; mode < 3; mode++) {
+        auto split = VM(bytecode);
+        split.set_return_type(KERNEL_F32);
+        split.seed_random(0x0123456789ABCDEFull);
+        if(mode > 0 && Tester::assert_fail(split.verify(6) == 0 && split.translate() == 0)) return false;
+        if(mode > 1) split.compile_jit();
+
+        for(size_t first : { (size_t)0, (size_t)333, (size_t)997 }) {
+            std::fill(output.begin(), output.end(), -1.0f);
+            split.set_first_instance(0);
+            if(Tester::assert_fail(split.run_batch(first, output.data()) == 0)) return false;
+            split.set_first_instance(first);
+            if(Tester::assert_fail(split.run_batch(n - first, output.data() + first) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+        }
+    }
+
+    /* Every ISA build and unroll factor. */
+    for(int isa = 0; isa <= detect_isa(); isa++) {
+        for(int unroll : ENGINE_UNROLLS) {
+            std::unique_ptr<Engine> engine;
+            if(Tester::assert_fail(create_engine(bytecode, (Isa)isa, unroll, &engine) == 0)) return false;
+            engine->set_return_type(KERNEL_F32);
+            engine->seed_random(0x0123456789ABCDEFull);
+            if(Tester::assert_fail(engine->run_batch(n, output.data()) == 0 && output == expected)) return false;
+        }
+    }
+
+    /* Instance indices carry past 2^32 within a lane group. */
+    std::vector<float> across(n);
+    vm.set_first_instance(0xFFFFFFFFull - 5);
+    if(Tester::assert_fail(vm.run_batch(n, across.data()) == 0)) return false;
+    vm.set_first_instance(0x100000000ull);
+    if(Tester::assert_fail(vm.run_batch(n - 6, output.data()) == 0)) return false;
+    if(Tester::assert_fail(std::equal(output.begin(), output.end() - 6, across.begin() + 6))) return false;
+
+    /* Another seed draws other numbers. */
+    vm.set_first_instance(0);
+    vm.seed_random(1);
+    if(Tester::assert_fail(vm.run_batch(n, output.data()) == 0 && output != expected)) return false;
+
+    return true;
+}
+
+/* reset() clears only what the kernel can read first, makes no system calls and keeps the seed. */
+bool reset_test() {
+    /* slot 0 += x; slot 1 is stored before it is loaded. */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 2.0f },
+        { .opcode = STORE_VAR, .type = F32, .slot = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+        { .opcode = STORE_VAR, .type = F32, .slot = 2 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = RETURN },
+    };
+
+    KernelInfo info;
+    if(Tester::assert_fail(verify_bytecode(bytecode, 10, KERNEL_I32, &info) == 0)) return false;
+    if(Tester::assert_fail(info.slot_read_first[I32] == 1 && info.slot_read_first[F32] == 0)) return false;
+
+    int32_t x[WIDTH];
+    for(int i = 0; i < WIDTH; i++) x[i] = i;
+
+    for(int mode = 0; mode < 4; mode++) {
+        auto vm = VM(bytecode);
+        vm.set_return_type(KERNEL_I32);
+        if(mode > 0 && Tester::assert_fail(vm.verify(10) == 0)) return false;
+        if(mode > 1 && Tester::assert_fail(vm.translate() == 0)) return false;
+        if(mode > 2) vm.compile_jit();
+        if(Tester::assert_fail(vm.bind_column(0, I32, x) == 0)) return false;
+
+        /* Slot 0 starts from zero on every run after a reset. */
+        for(int run = 0; run < 3; run++) {
+            auto result = vm.run();
+            if(Tester::assert_fail(result.type == KERNEL_I32)) return false;
+            for(int i = 0; i < WIDTH; i++) {
+                if(Tester::assert_fail(result.result_int[i] == i)) return false;
+            }
+            vm.reset();
+        }
+    }
+
+    /* A failed run is cleared by reset(). */
+    Instruction bytecode_error[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    auto vm = VM(bytecode_error);
+    vm.set_return_type(KERNEL_I32);
+    vm.bind_column(0, I32, x);
+    if(Tester::assert_fail(vm.run().type == KERNEL_ERROR)) return false;
+    vm.reset();
+    x[0] = 1;
+    if(Tester::assert_fail(vm.run().type == KERNEL_I32)) return false;
+
+    /* No descriptors are opened, the lowest free one stays the same. */
+    int before = dup(0);
+    close(before);
+    Instruction bytecode_rand[] = {
+        { .opcode = RAND },
+        { .opcode = RETURN },
+    };
+    float first[WIDTH];
+    for(int k = 0; k < 100; k++) {
+        auto seeded = VM(bytecode_rand, 77);
+        seeded.set_return_type(KERNEL_F32);
+        seeded.run();
+        seeded.reset();
+        auto result = seeded.run();
+        if(k == 0) memcpy(first, result.result_float, sizeof(first));
+
+        /* Equal seeds draw equal numbers, before and after reset(). */
+        if(Tester::assert_fail(memcmp(first, result.result_float, sizeof(first)) == 0)) return false;
+    }
+    int after = dup(0);
+    close(after);
+    if(Tester::assert_fail(before == after)) return false;
+
+    return true;
+}
+
+/* The frame shrinks to the kernel's slots and stack depth once verified. */
+bool frame_size_test() {
+    /* a = x * x; a + 1 */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t row = WIDTH * sizeof(int32_t);
+    auto vm = VM(bytecode);
+    if(Tester::assert_fail(vm.frame_bytes() == (3 * MAX_SLOTS + MAX_STACK) * row)) return false;
+    vm.set_return_type(KERNEL_I32);
+
+    /* One slot and two stack levels. */
+    if(Tester::assert_fail(vm.verify(8) == 0 && vm.frame_bytes() == 3 * row)) return false;
+
+    /* One slot, one constant and two temporaries. */
+    if(Tester::assert_fail(vm.translate() == 0 && vm.frame_bytes() == 4 * row)) return false;
+
+    int32_t x[2 * WIDTH + 1], output[2 * WIDTH + 1];
+    for(int i = 0; i < 2 * WIDTH + 1; i++) x[i] = i - WIDTH;
+    Column inputs[] = {
+        { .type = I32, .data = x },
+    };
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, 2 * WIDTH + 1, output) == 0)) return false;
+    for(int i = 0; i < 2 * WIDTH + 1; i++) {
+        if(Tester::assert_fail(output[i] == x[i] * x[i] + 1)) return false;
+    }
+
+    /* A new return type drops the verified layout. */
+    vm.set_return_type(KERNEL_F32);
+    if(Tester::assert_fail(vm.frame_bytes() == (3 * MAX_SLOTS + MAX_STACK) * row)) return false;
+
+    return true;
+}
+
+/* One compiled kernel runs in many independent contexts. */
+bool compiled_kernel_test() {
+    /* a = x + RAND; a * a */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = RAND },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = STORE_VAR, .type = F32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 10 * WIDTH + 3;
+    std::vector<float> x(n), expected(n), output(n);
+    for(size_t i = 0; i < n; i++) x[i] = (float)i * 0.5f;
+    Column inputs[] = {
+        { .type = F32, .data = x.data() },
+    };
+
+    auto vm = VM(bytecode, 9);
+    vm.set_return_type(KERNEL_F32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, n, expected.data()) == 0)) return false;
+
+    /* Rejected kernels are not compiled. */
+    std::shared_ptr<const CompiledKernel> kernel;
+    if(Tester::assert_fail(compile_kernel(bytecode, 8, KERNEL_I32, true, false, false, &kernel) < 0)) return false;
+
+    for(int mode = 0; mode < 8; mode++) {
+        bool jit = mode & 1, fuse = mode & 2, optimize = mode & 4;
+        if(Tester::assert_fail(compile_kernel(bytecode, 8, KERNEL_F32, jit, optimize, fuse, &kernel) == 0)) return false;
+        if(Tester::assert_fail(kernel->verified && kernel->use_registers)) return false;
+
+        /* Fusion turns the square into one SQUARE_VAR and the results stay the same. */
+        if(Tester::assert_fail(kernel->info.length == (fuse ? 6 : 8))) return false;
+        if(fuse && Tester::assert_fail(kernel->bytecode[4].opcode == SQUARE_VAR)) return false;
+
+        /* Contexts take turns on slices of the batch without disturbing each other. */
+        std::vector<ExecutionContext> contexts;
+        for(int c = 0; c < 3; c++) contexts.emplace_back(kernel, 9);
+        for(size_t first = 0, c = 0; first < n; first += WIDTH + 1, c = (c + 1) % 3) {
+            size_t count = std::min(n - first, (size_t)WIDTH + 1);
+            contexts[c].set_first_instance(first);
+            Column slice[] = {
+                { .type = F32, .data = x.data() + first },
+            };
+            if(Tester::assert_fail(contexts[c].run_batch(slice, 1, count, output.data() + first) == 0)) return false;
+        }
+        if(Tester::assert_fail(output == expected)) return false;
+
+        /* Contexts only hold the frame this kernel needs. */
+        if(Tester::assert_fail(contexts[0].frame_bytes() == kernel->program.num_regs * WIDTH * sizeof(float))) return false;
+    }
+
+    /* Optimization runs ahead of fusion and the optimized kernel is verified again. */
+    Instruction scaled[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 8 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = RETURN },
+    };
+    std::vector<int32_t> ints(n), scaled_output(n);
+    for(size_t i = 0; i < n; i++) ints[i] = (int32_t)i - 20;
+    Column int_inputs[] = {
+        { .type = I32, .data = ints.data() },
+    };
+    if(Tester::assert_fail(compile_kernel(scaled, 4, KERNEL_I32, false, true, true, &kernel) == 0)) return false;
+    if(Tester::assert_fail(kernel->info.length == 3 && kernel->bytecode[1].opcode == SHL)) return false;
+    ExecutionContext scaled_context(kernel, 9);
+    if(Tester::assert_fail(scaled_context.run_batch(int_inputs, 1, n, scaled_output.data()) == 0)) return false;
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(scaled_output[i] == ints[i] * 8)) return false;
+    }
+
+    return true;
+}
+
+/*
+ * Write a copy of a kernel file with an edit applied and the checksum
+ * recomputed, as a deliberate tamperer would.
+ */
+static bool write_tampered(const char *path, const char *copy, void (*edit)(KernelFileHeader *, Instruction *)) {
+    FILE *stream = fopen(path, "rb");
+    if(stream == nullptr) return false;
+    std::vector<uint8_t> data(sizeof(KernelFileHeader) + 64 * sizeof(Instruction));
+    size_t size = fread(data.data(), 1, data.size(), stream);
+    fclose(stream);
+
+    KernelFileHeader *header = (KernelFileHeader *)data.data();
+    Instruction *bytecode = (Instruction *)(header + 1);
+    edit(header, bytecode);
+
+    // FNV-1a of the header with checksum zero, then the bytecode
+    header->checksum = 0;
+    uint32_t hash = 0x811C9DC5;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x01000193;
+    }
+    header->checksum = hash;
+
+    stream = fopen(copy, "wb");
+    if(stream == nullptr) return false;
+    bool written = fwrite(data.data(), 1, size, stream) == size;
+    return fclose(stream) == 0 && written;
+}
+
+/* Kernel files round trip, run in place and reject damage. */
+bool kernel_file_test() {
+    /* x < 0 ? x * 2.5 : y + RAND, argument 1 unused */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.0f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 2.5f },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 2 },
+        { .opcode = RAND },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = SELECT, .type = F32 },
+        { .opcode = RETURN },
+    };
+    const char *arg_names[] = { "x", nullptr, "y" };
+
+    const size_t n = 3 * WIDTH + 5;
+    std::vector<float> x(n), y(n), expected(n), output(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (float)i - 20.0f;
+        y[i] = (float)i * 0.25f;
+    }
+    Column inputs[] = {
+        { .type = F32, .data = x.data() },
+        { .type = I32, .data = nullptr },
+        { .type = F32, .data = y.data() },
+    };
+
+    auto vm = VM(bytecode, 5);
+    vm.set_return_type(KERNEL_F32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 3, n, expected.data()) == 0)) return false;
+
+    char path[] = "/tmp/mosaic_kernel_XXXXXX";
+    int fd = mkstemp(path);
+    if(Tester::assert_fail(fd >= 0)) return false;
+    close(fd);
+
+    /* Kernels the verifier rejects are not written. */
+    if(Tester::assert_fail(write_kernel_file(path, "blend", arg_names, bytecode, 11, KERNEL_I32) < 0)) return false;
+    if(Tester::assert_fail(write_kernel_file(path, "blend", arg_names, bytecode, 11, KERNEL_F32) == 0)) return false;
+
+    std::shared_ptr<const MappedKernel> file;
+    bool mapped = map_kernel_file(path, &file) == 0;
+    if(Tester::assert_fail(mapped)) { unlink(path); return false; }
+
+    const KernelFileHeader& header = *file->header;
+    bool metadata = strcmp(header.name, "blend") == 0 && header.length == 11 && header.return_type == KERNEL_F32
+        && header.num_args == 3 && header.max_stack == 4 && strcmp(header.args[2].name, "y") == 0
+        && header.args[0].type == F32 && header.args[1].type == KERNEL_ARG_UNUSED;
+    bool columns = check_kernel_columns(header, inputs, 3) == 0 && check_kernel_columns(header, inputs, 2) < 0;
+    Column wrong[] = { inputs[0], inputs[1], { .type = I32, .data = y.data() } };
+    columns = columns && check_kernel_columns(header, wrong, 3) < 0;
+
+    /* Loaded kernels run straight from the mapping on every engine. */
+    bool runs = true;
+    for(bool jit : { false, true }) {
+        std::shared_ptr<const CompiledKernel> kernel;
+        runs = runs && load_kernel(file, jit, &kernel) == 0 && kernel->bytecode == file->bytecode;
+        if(!runs) break;
+
+        ExecutionContext context(kernel, 5);
+        std::fill(output.begin(), output.end(), 0.0f);
+        runs = context.run_batch(inputs, 3, n, output.data()) == 0 && output == expected;
+    }
+    file.reset();
+
+    /* A valid checksum does not vouch for the header: the verifier must agree with it. */
+    std::string copy = std::string(path) + ".tampered";
+    bool rejects_tampered = true;
+    void (*edits[])(KernelFileHeader *, Instruction *) = {
+        [](KernelFileHeader *header, Instruction *) { header->max_stack = 1; },
+        [](KernelFileHeader *header, Instruction *) { header->args[2].type = I32; },
+        [](KernelFileHeader *, Instruction *bytecode) { bytecode[3].opcode = (OpCode)200; },
+        [](KernelFileHeader *, Instruction *bytecode) { bytecode[6].arg = MAX_ARGS + 3; },
+    };
+    for(auto edit : edits) {
+        rejects_tampered = rejects_tampered && write_tampered(path, copy.c_str(), edit) && map_kernel_file(copy.c_str(), &file) < 0;
+    }
+    rejects_tampered = rejects_tampered && write_tampered(path, copy.c_str(), [](KernelFileHeader *, Instruction *) {});
+    rejects_tampered = rejects_tampered && map_kernel_file(copy.c_str(), &file) == 0;
+    unlink(copy.c_str());
+
+    KernelInfo info;
+    KernelFileHeader understated = *file->header;
+    understated.max_stack = 2;
+    rejects_tampered = rejects_tampered && verify_kernel_file(*file->header, file->bytecode, &info) == 0 && info.max_stack == 4;
+    rejects_tampered = rejects_tampered && verify_kernel_file(understated, file->bytecode, &info) < 0;
+    file.reset();
+
+    /* A flipped bit in the bytecode fails the checksum, a short file the size check. */
+    FILE *stream = fopen(path, "r+b");
+    fseek(stream, sizeof(KernelFileHeader) + 4, SEEK_SET);
+    fputc(0x40, stream);
+    fclose(stream);
+    bool rejects_corrupt = map_kernel_file(path, &file) < 0;
+
+    if(truncate(path, sizeof(KernelFileHeader) + 5) != 0) rejects_corrupt = false;
+    rejects_corrupt = rejects_corrupt && map_kernel_file(path, &file) < 0;
+    unlink(path);
+    rejects_corrupt = rejects_corrupt && map_kernel_file(path, &file) < 0;
+
+    if(Tester::assert_fail(metadata)) return false;
+    if(Tester::assert_fail(columns)) return false;
+    if(Tester::assert_fail(runs)) return false;
+    if(Tester::assert_fail(rejects_corrupt)) return false;
+    if(Tester::assert_fail(rejects_tampered)) return false;
+
+    return true;
+}
+
+/* Batch execution over a range that is not a multiple of LANES. */
+bool batch_test() {
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 3 * LANES + 3;
+    std::vector<int32_t> x(n), y(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (int32_t)i;
+        y[i] = (int32_t)i + 1;
+    }
+
+    // One extra element to detect writes past the end
+    std::vector<int32_t> output(n + 1, -7);
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+        { .type = I32, .data = y.data() },
+    };
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 2, n, output.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(output[i] == x[i] * y[i])) return false;
+    }
+    if(Tester::assert_fail(output[n] == -7)) return false;
+
+    return true;
+}
+
+/*
+ * Prepare a VM for the stack interpreter (0), registers (1) or the JIT (2).
+ * Hosts the JIT does not support stay on registers.
+ */
+static bool prepare_vm(VM& vm, int length, VMReturnType type, int mode) {
+    vm.set_return_type(type);
+    if(mode > 0 && (vm.verify(length) < 0 || vm.translate() < 0)) return false;
+    if(mode > 1) vm.compile_jit();
+    return true;
+}
+
+/* Reductions agree with the per-instance results on every engine. */
+bool reduce_test() {
+    /* Monte Carlo pi: x = RAND, y = RAND; x * x + y * y <= 1 */
+    Instruction pi[] = {
+        { .opcode = RAND },
+        { .opcode = STORE_VAR, .type = F32, .slot = 0 },
+        { .opcode = RAND },
+        { .opcode = STORE_VAR, .type = F32, .slot = 1 },
+        { .opcode = SQUARE_VAR, .type = F32, .slot = 0 },
+        { .opcode = SQUARE_VAR, .type = F32, .slot = 1 },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.0f },
+        { .opcode = CMP_LTE, .type = F32 },
+        { .opcode = RETURN },
+    };
+    Instruction identity_i32[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = RETURN },
+    };
+    Instruction identity_f32[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 100 * WIDTH + 5;
+    std::vector<int32_t> x(n);
+    std::vector<float> y(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = i % 7 == 0 ? 0 : (int32_t)((i * 2654435761u) ^ 0x5bd1e995);
+        y[i] = (float)i * 0.1f - 37.5f;
+    }
+    Column ints[] = {{ .type = I32, .data = x.data() }};
+    Column floats[] = {{ .type = F32, .data = y.data() }};
+    std::vector<float> z(n);
+    for(size_t i = 0; i < n; i++) z[i] = i % 3 == 0 ? NAN : i % 3 == 1 ? -0.0f : 0.0f;
+    Column special[] = {{ .type = F32, .data = z.data() }};
+    int64_t special_nonzero = (n + 2) / 3;
+
+    int64_t sum = 0, nonzero = 0;
+    double fsum = 0;
+    for(size_t i = 0; i < n; i++) {
+        sum += x[i];
+        nonzero += x[i] != 0;
+        fsum += y[i];
+    }
+
+    for(int mode = 0; mode < 3; mode++) {
+        ReduceValue value, mean, low, high;
+
+        auto vm = VM(pi, 3);
+        if(Tester::assert_fail(prepare_vm(vm, 10, KERNEL_BOOL, mode))) return false;
+        std::vector<int32_t> inside(n);
+        if(Tester::assert_fail(vm.run_batch(n, inside.data()) == 0)) return false;
+        int64_t hits = std::count(inside.begin(), inside.end(), -1);
+
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_COUNT, &value) == 0 && value.i64 == hits)) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_SUM, &value) == 0 && value.i64 == hits)) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_MEAN, &mean) == 0 && mean.f64 == (double)hits / n)) return false;
+
+        vm = VM(identity_i32);
+        if(Tester::assert_fail(prepare_vm(vm, 2, KERNEL_I32, mode))) return false;
+        if(Tester::assert_fail(vm.run_reduce(ints, 1, n, REDUCE_SUM, &value) == 0 && value.i64 == sum)) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_COUNT, &value) == 0 && value.i64 == nonzero)) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_MIN, &low) == 0 && vm.run_reduce(n, REDUCE_MAX, &high) == 0)) return false;
+        if(Tester::assert_fail(low.i64 == *std::min_element(x.begin(), x.end()))) return false;
+        if(Tester::assert_fail(high.i64 == *std::max_element(x.begin(), x.end()))) return false;
+
+        /* Nothing to take the minimum of, but sums of nothing are zero. */
+        if(Tester::assert_fail(vm.run_reduce(0, REDUCE_MIN, &value) < 0)) return false;
+        if(Tester::assert_fail(vm.run_reduce(0, REDUCE_SUM, &value) == 0 && value.i64 == 0)) return false;
+
+        vm = VM(identity_f32);
+        if(Tester::assert_fail(prepare_vm(vm, 2, KERNEL_F32, mode))) return false;
+        if(Tester::assert_fail(vm.run_reduce(floats, 1, n, REDUCE_SUM, &value) == 0)) return false;
+        if(Tester::assert_fail(fabs(value.f64 - fsum) <= 1e-6 * fabs(fsum))) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_MIN, &low) == 0 && low.f64 == y[0])) return false;
+        if(Tester::assert_fail(vm.run_reduce(n, REDUCE_MAX, &high) == 0 && high.f64 == y[n - 1])) return false;
+
+        /* NaN counts as nonzero, negative zero does not. */
+        if(Tester::assert_fail(vm.run_reduce(special, 1, n, REDUCE_COUNT, &value) == 0 && value.i64 == special_nonzero)) return false;
+    }
+    for(int isa = 0; isa <= detect_isa() && isa < ISA_COUNT; isa++) {
+        std::unique_ptr<Engine> engine;
+        ReduceValue count;
+        if(Tester::assert_fail(create_engine(identity_f32, (Isa)isa, &engine) == 0)) return false;
+        engine->set_return_type(KERNEL_F32);
+        if(Tester::assert_fail(engine->run_reduce(special, 1, n, REDUCE_COUNT, &count) == 0 && count.i64 == special_nonzero)) return false;
+    }
+
+    /* I32 sums are exact in 64 bits well past where 32-bit lanes overflow. */
+    Instruction big[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = -2000000000 },
+        { .opcode = RETURN },
+    };
+    const size_t many = (1 << 15) * WIDTH + 3;
+    ReduceValue total;
+    auto vm = VM(big);
+    if(Tester::assert_fail(prepare_vm(vm, 2, KERNEL_I32, 1))) return false;
+    if(Tester::assert_fail(vm.run_reduce(many, REDUCE_SUM, &total) == 0)) return false;
+    if(Tester::assert_fail(total.i64 == -2000000000LL * (int64_t)many)) return false;
+
+    return true;
+}
+
+/* A slot read before it is written starts at zero in every lane group, tail included. */
+bool batch_slot_test() {
+    /* s0 = s0 + x; s0 */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 3 * WIDTH + 3;
+    std::vector<int32_t> x(n), output(n);
+    int64_t sum = 0;
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (int32_t)i + 1;
+        sum += x[i];
+    }
+    Column inputs[] = {{ .type = I32, .data = x.data() }};
+
+    for(int mode = 0; mode < 3; mode++) {
+        auto vm = VM(bytecode);
+        if(Tester::assert_fail(prepare_vm(vm, 6, KERNEL_I32, mode))) return false;
+        if(Tester::assert_fail(vm.run_batch(inputs, 1, n, output.data()) == 0)) return false;
+        for(size_t i = 0; i < n; i++) {
+            if(Tester::assert_fail(output[i] == x[i])) return false;
+        }
+
+        ReduceValue total;
+        if(Tester::assert_fail(vm.run_reduce(inputs, 1, n, REDUCE_SUM, &total) == 0)) return false;
+        if(Tester::assert_fail(total.i64 == sum)) return false;
+    }
+
+    return true;
+}
+
+/* Worker threads agree with a single context, whatever the chunking. */
+bool worker_test() {
+    /* x / y + RAND * 100 < 50 ? x : y, with a scalar division per lane */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RAND },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 100.0f },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 50.0f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 300 * WIDTH + 7;
+    std::vector<int32_t> x(n), y(n), expected(n), output(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (int32_t)(i * 7919) - 1000000;
+        y[i] = (int32_t)(i % 13) + 1;
+    }
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+        { .type = I32, .data = y.data() },
+    };
+
+    std::shared_ptr<const CompiledKernel> kernel;
+    if(Tester::assert_fail(compile_kernel(bytecode, 13, KERNEL_I32, true, false, false, &kernel) == 0)) return false;
+
+    ExecutionContext reference(kernel, 11);
+    reference.set_first_instance(5000);
+    if(Tester::assert_fail(reference.run_batch(inputs, 2, n, expected.data()) == 0)) return false;
+
+    std::unique_ptr<Engine> engine;
+    BatchJob job = { nullptr, inputs, 2, n, 11, 5000 };
+    for(int threads : { 1, 3, 8 }) {
+        WorkerPool pool(threads);
+        if(Tester::assert_fail(pool.size() == threads)) return false;
+        if(Tester::assert_fail(pool.prepare(bytecode, 13, KERNEL_I32, &engine) == 0)) return false;
+        job.engine = engine.get();
+
+        for(size_t groups : { (size_t)1, (size_t)5, WORKER_CHUNK_GROUPS }) {
+            pool.set_chunk_groups(groups);
+            std::fill(output.begin(), output.end(), 0);
+            if(Tester::assert_fail(pool.run_batch(job, output.data()) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+
+            for(ReduceOp op : { REDUCE_SUM, REDUCE_COUNT, REDUCE_MIN, REDUCE_MAX, REDUCE_MEAN }) {
+                ReduceValue value, single;
+                if(Tester::assert_fail(pool.run_reduce(job, op, &value) == 0)) return false;
+                if(Tester::assert_fail(reference.run_reduce(inputs, 2, n, op, &single) == 0)) return false;
+                if(op == REDUCE_MEAN && Tester::assert_fail(fabs(value.f64 - single.f64) < 1e-9 * fabs(single.f64))) return false;
+                if(op != REDUCE_MEAN && Tester::assert_fail(value.i64 == single.i64)) return false;
+            }
+        }
+
+        /* Empty jobs sum to zero, a failing chunk fails the job. */
+        BatchJob empty = job;
+        empty.n = 0;
+        ReduceValue value;
+        if(Tester::assert_fail(pool.run_reduce(empty, REDUCE_SUM, &value) == 0 && value.i64 == 0)) return false;
+        if(Tester::assert_fail(pool.run_reduce(empty, REDUCE_MAX, &value) < 0)) return false;
+
+        int32_t divisor = y[n / 2];
+        y[n / 2] = 0;
+        bool fails = pool.run_batch(job, output.data()) < 0;
+        y[n / 2] = divisor;
+        if(Tester::assert_fail(fails)) return false;
+    }
+
+    return true;
+}
+
+/* Threads are placed node by node and results do not depend on placement. */
+bool worker_placement_test() {
+    std::vector<int> cpus;
+    if(Tester::assert_fail(parse_cpulist("0-3,8,10-11\n", &cpus) == 0)) return false;
+    if(Tester::assert_fail(cpus == std::vector<int>({ 0, 1, 2, 3, 8, 10, 11 }))) return false;
+    if(Tester::assert_fail(parse_cpulist("3-1", &cpus) < 0 && parse_cpulist("0,x", &cpus) < 0)) return false;
+
+    Topology host;
+    if(Tester::assert_fail(discover_topology(&host) == 0 && !host.nodes.empty())) return false;
+    size_t usable = 0;
+    for(const std::vector<int>& node : host.nodes) usable += node.size();
+
+    WorkerPool pool;
+    if(Tester::assert_fail(pool.size() == (int)usable)) return false;
+    if(Tester::assert_fail(host.nodes.size() > 1 || pool.place_job({ nullptr, nullptr, 0, 0, 0, 0 }, nullptr) == 0)) return false;
+
+    /* Without a topology every CPU still gets a thread, unpinned. */
+    WorkerPool unpinned(0, Topology());
+    int reported = std::max(1u, std::thread::hardware_concurrency());
+    if(Tester::assert_fail(unpinned.size() == reported && unpinned.cpu_of(reported - 1) == -1)) return false;
+
+    /* Nor with nodes that list no CPUs. */
+    WorkerPool empty_nodes(3, { { {}, {} }, { 0, 1 } });
+    if(Tester::assert_fail(empty_nodes.size() == 3 && empty_nodes.cpu_of(2) == -1)) return false;
+
+    /* Two nodes sharing this host's first CPU: threads alternate nodes, then sort by node. */
+    int cpu = host.nodes[0][0];
+    Topology dual = { { { cpu, cpu }, { cpu } }, { host.node_ids[0], host.node_ids[0] } };
+    WorkerPool split(5, dual);
+    std::vector<int> nodes;
+    for(int i = 0; i < split.size(); i++) nodes.push_back(split.node_of(i));
+    if(Tester::assert_fail(nodes == std::vector<int>({ 0, 0, 0, 1, 1 }) && split.cpu_of(4) == cpu)) return false;
+
+    /* First touch zeroes the buffer from the workers that own each part. */
+    const size_t n = 40 * WIDTH + 3;
+    int32_t *buffer = (int32_t *)malloc(n * sizeof(int32_t));
+    for(size_t i = 0; i < n; i++) buffer[i] = -1;
+    split.set_chunk_groups(3);
+    bool touched = split.first_touch(buffer, n) == 0 && std::count(buffer, buffer + n, 0) == (long)n;
+
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = RAND },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = RETURN },
+    };
+    std::vector<int32_t> x(n), expected(n);
+    for(size_t i = 0; i < n; i++) x[i] = (int32_t)i - 100;
+    Column inputs[] = {{ .type = I32, .data = x.data() }};
+
+    std::shared_ptr<const CompiledKernel> kernel;
+    std::unique_ptr<Engine> engine;
+    bool runs = compile_kernel(bytecode, 9, KERNEL_I32, false, false, false, &kernel) == 0 && split.prepare(bytecode, 9, KERNEL_I32, &engine) == 0;
+    ExecutionContext reference(kernel, 2);
+    runs = runs && reference.run_batch(inputs, 1, n, expected.data()) == 0;
+    runs = runs && split.run_batch({ engine.get(), inputs, 1, n, 2, 0 }, buffer) == 0 && std::equal(buffer, buffer + n, expected.begin());
+    free(buffer);
+
+    if(Tester::assert_fail(touched)) return false;
+    if(Tester::assert_fail(runs)) return false;
+
+    return true;
+}
+
+/* Nodes get shares of a task in proportion to their predicted speed. */
+bool scheduler_test() {
+    Instruction by_column[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    Instruction by_constant[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    Instruction add[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    KernelCost column_cost, constant_cost, add_cost;
+    if(Tester::assert_fail(estimate_cost(by_column, 4, &column_cost) == 0)) return false;
+    if(Tester::assert_fail(estimate_cost(by_constant, 4, &constant_cost) == 0)) return false;
+    if(Tester::assert_fail(estimate_cost(add, 4, &add_cost) == 0)) return false;
+    if(Tester::assert_fail(instance_cost(column_cost, 8) > instance_cost(constant_cost, 8))) return false;
+    if(Tester::assert_fail(instance_cost(constant_cost, 8) > instance_cost(add_cost, 8))) return false;
+    if(Tester::assert_fail(instance_cost(add_cost, 16) < instance_cost(add_cost, 8))) return false;
+
+    /* A constant divisor counts as one wherever it was pushed. */
+    Instruction stored_between[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    Instruction stored_before[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    KernelCost between_cost, before_cost;
+    if(Tester::assert_fail(estimate_cost(stored_between, 6, &between_cost) == 0)) return false;
+    if(Tester::assert_fail(estimate_cost(stored_before, 6, &before_cost) == 0)) return false;
+    if(Tester::assert_fail(between_cost.vector_units == before_cost.vector_units)) return false;
+
+    /* CMP_SELECT_CONST's operand words are neither instructions nor constant divisors. */
+    Instruction fused[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = CMP_SELECT_CONST, .type = I32, .compare = CMP_LT },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    Instruction unfused[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = CMP_LT, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    KernelCost fused_cost, unfused_cost;
+    if(Tester::assert_fail(estimate_cost(fused, 8, &fused_cost) == 0)) return false;
+    if(Tester::assert_fail(estimate_cost(unfused, 9, &unfused_cost) == 0)) return false;
+    if(Tester::assert_fail(fused_cost.vector_units < unfused_cost.vector_units)) return false;
+    if(Tester::assert_fail(fused_cost.vector_units > column_cost.vector_units)) return false;
+
+    NodeRegistry registry;
+    int narrow = registry.add_node(8, 4);
+    int wide = registry.add_node(16, 4);
+    if(Tester::assert_fail(narrow >= 0 && wide > narrow)) return false;
+    if(Tester::assert_fail(registry.add_node(0, 4) < 0 && registry.add_node(8, 0) < 0)) return false;
+
+    /* Slices are contiguous, whole vectors and predicted to end together. */
+    Task task = { 1, add, 4, KERNEL_I32, 1000, 100003, 5 };
+    std::vector<Placement> placements;
+    if(Tester::assert_fail(place_task(task, registry, &placements) == 0 && placements.size() == 2)) return false;
+
+    uint64_t next = task.first_instance;
+    for(const Placement& placement : placements) {
+        if(Tester::assert_fail(placement.first_instance == next)) return false;
+        next += placement.count;
+    }
+    if(Tester::assert_fail(next == task.first_instance + task.count)) return false;
+    /* Only the odd instances at the end of the range leave a vector partly filled. */
+    if(Tester::assert_fail((placements[0].count % 8 != 0) + (placements[1].count % 16 != 0) == 1)) return false;
+    if(Tester::assert_fail(fabs(placements[0].seconds - placements[1].seconds) < 0.01 * placements[0].seconds)) return false;
+    if(Tester::assert_fail(placements[1].count > placements[0].count)) return false;
+    double add_share = (double)placements[1].count / task.count;
+
+    /* Division runs in vectors too, so the wide node keeps its share of a divide-heavy kernel. */
+    task.bytecode = by_column;
+    if(Tester::assert_fail(place_task(task, registry, &placements) == 0)) return false;
+    if(Tester::assert_fail(fabs((double)placements[1].count / task.count - add_share) < 16.0 / task.count)) return false;
+
+    /* A slow measured run moves work away from the node. */
+    double before = (double)placements[0].count;
+    if(Tester::assert_fail(registry.record_run(narrow, 1e6, 0.01) == 0)) return false;
+    if(Tester::assert_fail(registry.find(narrow)->throughput == 1e6 / 0.01 / 4)) return false;
+    if(Tester::assert_fail(place_task(task, registry, &placements) == 0 && placements[0].count < before)) return false;
+
+    /* Small tasks may leave a node idle, but never lose instances. */
+    task.count = 5;
+    if(Tester::assert_fail(place_task(task, registry, &placements) == 0)) return false;
+    uint64_t placed = 0;
+    for(const Placement& placement : placements) placed += placement.count;
+    if(Tester::assert_fail(placed == 5)) return false;
+
+    if(Tester::assert_fail(registry.record_run(99, 1, 1) < 0 && registry.remove_node(99) < 0)) return false;
+    if(Tester::assert_fail(registry.remove_node(wide) == 0 && registry.find(wide) == nullptr)) return false;
+
+    Instruction invalid[] = {
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+    task.bytecode = invalid;
+    task.length = 2;
+    if(Tester::assert_fail(place_task(task, registry, &placements) < 0)) return false;
+
+    NodeRegistry empty;
+    task.bytecode = add;
+    task.length = 4;
+    if(Tester::assert_fail(place_task(task, empty, &placements) < 0)) return false;
+
+    return true;
+}
+
+/* Worker processes run slices of a job in shared memory and survive a lost peer. */
+bool cluster_test() {
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = RAND },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    LocalCluster cluster;
+    const size_t n = 30 * WIDTH + 5;
+    if(Tester::assert_fail(cluster.start(3, 1 << 20) == 0 && cluster.size() == 3)) return false;
+    if(Tester::assert_fail(cluster.start(1, 1 << 20) < 0)) return false;
+
+    int32_t *x = (int32_t *)cluster.allocate(n * sizeof(int32_t));
+    int32_t *y = (int32_t *)cluster.allocate(n * sizeof(int32_t));
+    int32_t *output = (int32_t *)cluster.allocate(n * sizeof(int32_t));
+    if(Tester::assert_fail(x != nullptr && y != nullptr && output != nullptr)) return false;
+    if(Tester::assert_fail(cluster.allocate(1 << 20) == nullptr)) return false;
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (int32_t)(i * 7) - 500;
+        y[i] = (int32_t)(i % 11) + 1;
+    }
+    Column inputs[] = {
+        { .type = I32, .data = x },
+        { .type = I32, .data = y },
+    };
+
+    std::shared_ptr<const CompiledKernel> kernel;
+    std::vector<int32_t> expected(n);
+    if(Tester::assert_fail(compile_kernel(bytecode, 11, KERNEL_I32, false, false, false, &kernel) == 0)) return false;
+    ExecutionContext reference(kernel, 11);
+    if(Tester::assert_fail(reference.run_batch(inputs, 2, n, expected.data()) == 0)) return false;
+
+    int id = cluster.add_kernel(bytecode, 11, KERNEL_I32);
+    if(Tester::assert_fail(id >= 0 && cluster.add_kernel(bytecode, 3, KERNEL_I32) < 0)) return false;
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, output) == 0)) return false;
+    if(Tester::assert_fail(std::equal(output, output + n, expected.begin()))) return false;
+
+    /* Slices are placed by the scheduler, which learns from the runs. */
+    for(const NodeInfo& node : cluster.nodes().list()) {
+        if(Tester::assert_fail(node.lanes == isa_lanes(select_isa()) && node.throughput > 0)) return false;
+    }
+
+    /* Only shared memory can cross to the workers. */
+    std::vector<int32_t> private_output(n);
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, private_output.data()) < 0)) return false;
+    if(Tester::assert_fail(cluster.run_batch(id + 1, inputs, 2, n, 11, output) < 0)) return false;
+
+    /* A kernel failing in a worker fails the job but keeps the worker. */
+    int32_t divisor = y[n - 1];
+    y[n - 1] = 0;
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, output) < 0 && cluster.size() == 3)) return false;
+    y[n - 1] = divisor;
+
+    /* A worker that dies is dropped and the others take its share. */
+    pid_t pid = cluster.pid_of(1);
+    siginfo_t info;
+    kill(pid, SIGKILL);
+    if(Tester::assert_fail(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0)) return false;
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, output) < 0 && cluster.size() == 2)) return false;
+    memset(output, 0, n * sizeof(int32_t));
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, output) == 0)) return false;
+    if(Tester::assert_fail(std::equal(output, output + n, expected.begin()))) return false;
+
+    if(Tester::assert_fail(cluster.stop() == 0 && cluster.size() == 0)) return false;
+    if(Tester::assert_fail(cluster.run_batch(id, inputs, 2, n, 11, output) < 0)) return false;
+
+    return true;
+}
+
+/* Kernels, task batches and results survive a round trip over loopback TCP. */
+bool wire_test() {
+    Instruction bytecode[] = {
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.5f },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = -2.0f },
+        { .opcode = SELECT, .type = F32 },
+        { .opcode = RETURN },
+    };
+
+    uint16_t port;
+    int listener = wire_listen(0, &port);
+    if(Tester::assert_fail(listener >= 0)) return false;
+    int client_fd = wire_connect(port), server_fd = wire_accept(listener);
+    WireConnection client(client_fd);
+    WireConnection server(server_fd);
+    close(listener);
+    if(Tester::assert_fail(wire_connect(port) < 0)) return false;
+
+    /* The kernel crosses once, then tasks name it by hash. */
+    uint64_t hash, again;
+    WireMessage message;
+    if(Tester::assert_fail(client.send_kernel(bytecode, 5, KERNEL_F32, &hash) == 0)) return false;
+    if(Tester::assert_fail(client.send_kernel(bytecode, 5, KERNEL_F32, &again) == 0 && again == hash)) return false;
+    if(Tester::assert_fail(hash == kernel_hash(bytecode, 5, KERNEL_F32) && hash != kernel_hash(bytecode, 5, KERNEL_I32))) return false;
+    if(Tester::assert_fail(client.send_kernel(bytecode, 3, KERNEL_F32, &again) < 0)) return false;
+
+    std::vector<WireTask> tasks(70000);
+    for(size_t i = 0; i < tasks.size(); i++) tasks[i] = { i, hash, i * 64, 64, 7 };
+    WireTask unknown = { 0, hash + 1, 0, 64, 7 };
+    if(Tester::assert_fail(client.send_tasks(&unknown, 1) < 0)) return false;
+
+    bool sent = false;
+    std::thread sender([&] { sent = client.send_tasks(tasks.data(), tasks.size()) == 0; });
+    bool decoded = server.receive(&message) == 0 && message.type == WIRE_KERNEL && message.kernel == hash;
+    decoded = decoded && server.receive(&message) == 0 && message.type == WIRE_TASKS && message.tasks.size() == UINT16_MAX;
+    decoded = decoded && server.receive(&message) == 0 && message.type == WIRE_TASKS && message.tasks.size() == 70000 - UINT16_MAX;
+    if(!decoded) {
+        // Nothing drains the socket any more, wake the sender from its send
+        shutdown(client_fd, SHUT_RDWR);
+        shutdown(server_fd, SHUT_RDWR);
+    }
+    sender.join();
+    if(Tester::assert_fail(sent && decoded)) return false;
+    if(Tester::assert_fail(message.tasks.back().id == 69999 && message.tasks.back().first_instance == 69999 * 64)) return false;
+
+    const WireKernel *kernel = server.find_kernel(hash);
+    if(Tester::assert_fail(kernel != nullptr && kernel->return_type == KERNEL_F32 && kernel->bytecode.size() == 5)) return false;
+    if(Tester::assert_fail(kernel->bytecode[0].const_bool && kernel->bytecode[2].const_float == -2.0f)) return false;
+
+    /* Run what arrived and send the lanes back. */
+    auto vm = VM(kernel->bytecode.data());
+    vm.set_return_type(kernel->return_type);
+    auto retval = vm.run();
+    if(Tester::assert_fail(retval.type == KERNEL_F32)) return false;
+    WireResult result = { 42, WIDTH, 0, retval.type };
+    if(Tester::assert_fail(server.send_result(result, retval.result_float) == 0)) return false;
+    if(Tester::assert_fail(client.receive(&message) == 0 && message.type == WIRE_RESULT)) return false;
+    if(Tester::assert_fail(message.result.id == 42 && message.result.count == WIDTH && message.result.status == 0)) return false;
+    const float *values = (const float *)message.values;
+    for(int i = 0; i < WIDTH; i++) {
+        if(Tester::assert_fail(values[i] == 1.5f)) return false;
+    }
+
+    /* A task for a kernel the peer never sent is a protocol error. */
+    WireHeader header = { WIRE_MAGIC, WIRE_VERSION, WIRE_TASKS, 1, sizeof(WireTask) };
+    int fds[2];
+    if(Tester::assert_fail(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)) return false;
+    WireConnection peer(fds[1]);
+    bool rejected = write(fds[0], &header, sizeof(header)) == sizeof(header) && write(fds[0], &unknown, sizeof(unknown)) == sizeof(unknown);
+    rejected = rejected && peer.receive(&message) < 0;
+
+    /* Frames larger than any legal message are refused before their payload is read. */
+    WireHeader huge = { WIRE_MAGIC, WIRE_VERSION, WIRE_KERNEL, 1, 1u << 27 };
+    rejected = rejected && write(fds[0], &huge, sizeof(huge)) == sizeof(huge) && peer.receive(&message) < 0;
+    WireHeader unasked = { WIRE_MAGIC, WIRE_VERSION, WIRE_RESULT, 1, sizeof(WireResult) + sizeof(int32_t) };
+    rejected = rejected && write(fds[0], &unasked, sizeof(unasked)) == sizeof(unasked) && peer.receive(&message) < 0;
+    header.magic = 0;
+    rejected = rejected && write(fds[0], &header, sizeof(header)) == sizeof(header) && peer.receive(&message) < 0;
+    close(fds[0]);
+    rejected = rejected && peer.receive(&message) < 0;
+    if(Tester::assert_fail(rejected)) return false;
+
+    return true;
+}
+
+/* Padding lanes of a partial group must not trigger divide by zero. */
+bool batch_tail_div_test() {
+    Instruction bytecode[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 100 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = LANES + 1;
+    std::vector<int32_t> x(n, 4), output(n);
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+    };
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, n, output.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(output[i] == 25)) return false;
+    }
+
+    /* A real zero divisor in the tail is still an error. */
+    x[n-1] = 0;
+    vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, n, output.data()) == -1)) return false;
+
+    return true;
+}
+
+/* Every batch size up to two groups, so each vector of an unrolled group is a tail once. */
+bool group_width_test() {
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t max_n = 2 * WIDTH;
+    std::vector<int32_t> x(max_n);
+    for(size_t i = 0; i < max_n; i++) x[i] = (int32_t)i + 1;
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+    };
+
+    for(size_t n = 1; n <= max_n; n++) {
+        for(bool registers : { false, true }) {
+            std::vector<int32_t> output(n + 1, -7);
+            auto vm = VM(bytecode);
+            vm.set_return_type(KERNEL_I32);
+            if(registers && Tester::assert_fail(vm.verify(6) == 0 && vm.translate() == 0)) return false;
+            if(Tester::assert_fail(vm.run_batch(inputs, 1, n, output.data()) == 0)) return false;
+
+            for(size_t i = 0; i < n; i++) {
+                if(Tester::assert_fail(output[i] == 3)) return false;
+            }
+            if(Tester::assert_fail(output[n] == -7)) return false;
+        }
+    }
+
+    return true;
+}
+
+/* Reference signed division, INT32_MIN / -1 wraps like the VM. */
+static int32_t reference_divide(int32_t a, int32_t b, bool modulo) {
+    if(a == INT32_MIN && b == -1) return modulo ? 0 : INT32_MIN;
+    return modulo ? a % b : a / b;
+}
+
+/* Vector I32 DIV/MOD by columns and by constants on every engine. */
+bool int_division_test() {
+    const int32_t edges[] = { INT32_MIN, INT32_MIN + 1, -65536, -7, -1, 0, 1, 6, 7, 65535, INT32_MAX - 1, INT32_MAX };
+    const size_t n = 1000;
+    std::vector<int32_t> x(n), y(n), output(n);
+    uint32_t state = 12345;
+    for(size_t i = 0; i < n; i++) {
+        state = state * 1664525 + 1013904223;
+        x[i] = i < 12 * 12 ? edges[i % 12] : (int32_t)state >> (i % 31);
+        y[i] = i < 12 * 12 ? edges[i / 12] : (int32_t)(state * 2654435761u) >> (i % 29);
+        if(y[i] == 0) y[i] = 3;
+    }
+
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+        { .type = I32, .data = y.data() },
+    };
+
+    for(OpCode op : { DIV, MOD }) {
+        /* Divisors from a column. */
+        Instruction bytecode[] = {
+            { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+            { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+            { .opcode = op, .type = I32 },
+            { .opcode = RETURN },
+        };
+
+        for(bool registers : { false, true }) {
+            auto vm = VM(bytecode);
+            vm.set_return_type(KERNEL_I32);
+            if(registers && Tester::assert_fail(vm.verify(4) == 0 && vm.translate() == 0)) return false;
+            if(Tester::assert_fail(vm.run_batch(inputs, 2, n, output.data()) == 0)) return false;
+
+            for(size_t i = 0; i < n; i++) {
+                if(Tester::assert_fail(output[i] == reference_divide(x[i], y[i], op == MOD))) return false;
+            }
+        }
+
+        /* Constant divisors use magic numbers once translated. */
+        for(int32_t divisor : { INT32_MIN, -1000000007, -641, -7, -2, -1, 1, 2, 3, 5, 7, 10, 641, 1 << 20, 1000000007, INT32_MAX }) {
+            Instruction bytecode_const[] = {
+                { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+                { .opcode = PUSH_CONST, .type = I32, .const_int = divisor },
+                { .opcode = op, .type = I32 },
+                { .opcode = RETURN },
+            };
+
+            for(bool registers : { false, true }) {
+                auto vm = VM(bytecode_const);
+                vm.set_return_type(KERNEL_I32);
+                if(registers && Tester::assert_fail(vm.verify(4) == 0 && vm.translate() == 0)) return false;
+                if(Tester::assert_fail(vm.run_batch(inputs, 2, n, output.data()) == 0)) return false;
+
+                for(size_t i = 0; i < n; i++) {
+                    if(Tester::assert_fail(output[i] == reference_divide(x[i], divisor, op == MOD))) return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Test LOAD_ARG from bound columns. */
+bool load_arg_test() {
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 1 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 2 },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = STORE_VAR, .type = BOOL, .slot = 0 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 2 * LANES + 1;
+    std::vector<float> x(n), w(n), output(n);
+    std::vector<uint32_t> flags(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (float)i;
+        w[i] = 0.5f;
+        flags[i] = i % 2;
+    }
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_F32);
+    vm.bind_column(0, F32, x.data());
+    vm.bind_column(1, F32, w.data());
+    vm.bind_column(2, BOOL, flags.data());
+    if(Tester::assert_fail(vm.run_batch(n, output.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(output[i] == x[i] * 0.5f)) return false;
+    }
+
+    /* Any nonzero BOOL column value loads as a full lane mask. */
+    Instruction bytecode_mask[] = {
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 0 },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = RETURN },
+    };
+
+    std::vector<uint32_t> mask(n);
+    for(size_t i = 0; i < n; i++) flags[i] = i % 3 == 0 ? 0 : (uint32_t)i * 0x10001;
+
+    vm = VM(bytecode_mask);
+    vm.set_return_type(KERNEL_BOOL);
+    vm.bind_column(0, BOOL, flags.data());
+    if(Tester::assert_fail(vm.run_batch(n, mask.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(mask[i] == (flags[i] != 0 ? 0 : 0xFFFFFFFF))) return false;
+    }
+
+    /* Argument type must match the bound column. */
+    Instruction bytecode_mismatch[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = RETURN },
+    };
+
+    vm = VM(bytecode_mismatch);
+    vm.set_return_type(KERNEL_I32);
+    vm.bind_column(0, F32, x.data());
+    auto result = vm.run();
+
+    if(Tester::assert_fail(result.type == KERNEL_ERROR)) return false;
+
+    /* Unbound arguments fail. */
+    vm = VM(bytecode_mismatch);
+    vm.set_return_type(KERNEL_I32);
+    result = vm.run();
+
+    if(Tester::assert_fail(result.type == KERNEL_ERROR)) return false;
+
+    return true;
+}
+
+/* The verifier accepts well-formed kernels and reports their metadata. */
+bool verify_test() {
+    Instruction bytecode[] = {
+        { .opcode = RAND },
+        { .opcode = STORE_VAR, .type = F32, .slot = 0 },
+        { .opcode = RAND },
+        { .opcode = STORE_VAR, .type = F32, .slot = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.0f },
+        { .opcode = CMP_LTE, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    int length = sizeof(bytecode) / sizeof(bytecode[0]);
+
+    KernelInfo info;
+    if(Tester::assert_fail(verify_bytecode(bytecode, length, KERNEL_I32, &info) == 0)) return false;
+    if(Tester::assert_fail(info.length == length)) return false;
+    if(Tester::assert_fail(info.max_stack == 3)) return false;
+    if(Tester::assert_fail(info.slot_count[F32] == 2 && info.slot_count[I32] == 0)) return false;
+
+    /* Declared return type must match. */
+    if(Tester::assert_fail(verify_bytecode(bytecode, length, KERNEL_F32, &info) == -1)) return false;
+
+    /* A verified VM runs the unchecked handlers. */
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.verify(length) == 0)) return false;
+    auto result = vm.run();
+
+    if(Tester::assert_fail(result.type == KERNEL_I32)) return false;
+    for(int i = 0; i < LANES; i++) {
+        if(Tester::assert_fail(result.result_int[i] == 0 || result.result_int[i] == 1)) return false;
+    }
+
+    return true;
+}
+
+/* The verifier rejects malformed kernels. */
+bool verify_reject_test() {
+    KernelInfo info;
+
+    /* Stack underflow. */
+    Instruction underflow[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(verify_bytecode(underflow, 3, KERNEL_I32, &info) == -1)) return false;
+    if(Tester::assert_fail(info.error_pc == 1)) return false;
+
+    /* Slot out of range. */
+    Instruction bad_slot[] = {
+        { .opcode = LOAD_VAR, .type = I32, .slot = MAX_SLOTS },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(verify_bytecode(bad_slot, 2, KERNEL_I32, &info) == -1)) return false;
+
+    /* Operand types don't match the instruction. */
+    Instruction bad_type[] = {
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.0f },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(verify_bytecode(bad_type, 4, KERNEL_I32, &info) == -1)) return false;
+    if(Tester::assert_fail(info.error_pc == 2)) return false;
+
+    /* Float MOD is not allowed. */
+    Instruction float_mod[] = {
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.0f },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 2.0f },
+        { .opcode = MOD, .type = F32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(verify_bytecode(float_mod, 4, KERNEL_F32, &info) == -1)) return false;
+
+    /* Stack overflow. */
+    std::vector<Instruction> overflow;
+    for(int i = 0; i <= MAX_STACK; i++) {
+        overflow.push_back({ .opcode = PUSH_CONST, .type = I32, .const_int = 1 });
+    }
+    overflow.push_back({ .opcode = RETURN });
+    if(Tester::assert_fail(verify_bytecode(overflow.data(), overflow.size(), KERNEL_I32, &info) == -1)) return false;
+
+    /* Missing RETURN. */
+    Instruction no_return[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+    };
+    if(Tester::assert_fail(verify_bytecode(no_return, 1, KERNEL_I32, &info) == -1)) return false;
+
+    /* RETURN must come within MAX_KERNEL_LENGTH instructions. */
+    std::vector<Instruction> long_kernel(MAX_KERNEL_LENGTH + 1, { .opcode = NOT, .type = BOOL, .const_int = 0 });
+    long_kernel[0] = { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true };
+    long_kernel[MAX_KERNEL_LENGTH - 1] = { .opcode = RETURN, .type = BOOL, .const_int = 0 };
+    if(Tester::assert_fail(verify_bytecode(long_kernel.data(), long_kernel.size(), KERNEL_BOOL, &info) == 0)) return false;
+    if(Tester::assert_fail(info.length == MAX_KERNEL_LENGTH && !info.too_long)) return false;
+    long_kernel[MAX_KERNEL_LENGTH - 1] = long_kernel[1];
+    long_kernel[MAX_KERNEL_LENGTH] = { .opcode = RETURN, .type = BOOL, .const_int = 0 };
+    if(Tester::assert_fail(verify_bytecode(long_kernel.data(), long_kernel.size(), KERNEL_BOOL, &info) == -1)) return false;
+    if(Tester::assert_fail(info.too_long && info.error_pc == MAX_KERNEL_LENGTH)) return false;
+    if(Tester::assert_fail(verify_bytecode(no_return, 1, KERNEL_I32, &info) == -1 && !info.too_long)) return false;
+
+    /* A rejected kernel still runs with the checked handlers. */
+    auto vm = VM(underflow);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.verify(3) == -1)) return false;
+    if(Tester::assert_fail(vm.run().type == KERNEL_ERROR)) return false;
+
+    return true;
+}
+
+/* The register interpreter matches the stack machine. */
+bool register_test() {
+    /* a = x; a = a * (a + 1); (a / 3) % 5 > 1 ? a : -a */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = MOD, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = CMP_GT, .type = I32 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = SUB, .type = I32 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    int length = sizeof(bytecode) / sizeof(bytecode[0]);
+
+    const size_t n = 4 * LANES + 3;
+    std::vector<int32_t> x(n), expected(n), output(n);
+    for(size_t i = 0; i < n; i++) x[i] = (int32_t)i - 10;
+
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+    };
+
+    auto stack_vm = VM(bytecode);
+    stack_vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(stack_vm.run_batch(inputs, 1, n, expected.data()) == 0)) return false;
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+#ifndef MOSAIC_EAGER_JIT
+    if(Tester::assert_fail(vm.translate() == -1)) return false;
+#endif
+    if(Tester::assert_fail(vm.verify(length) == 0)) return false;
+    if(Tester::assert_fail(vm.translate() == 0)) return false;
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, n, output.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        int32_t a = x[i] * (x[i] + 1);
+        int32_t value = (a / 3) % 5 > 1 ? a : -a;
+        if(Tester::assert_fail(expected[i] == value)) return false;
+        if(Tester::assert_fail(output[i] == value)) return false;
+    }
+
+    /* Float kernel with NOT and AND. */
+    Instruction bytecode_float[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 4.0f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = false },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = AND, .type = BOOL },
+        { .opcode = RETURN },
+    };
+    length = sizeof(bytecode_float) / sizeof(bytecode_float[0]);
+
+    std::vector<float> y(n);
+    std::vector<uint32_t> flags(n);
+    for(size_t i = 0; i < n; i++) y[i] = (float)i * 0.25f;
+
+    vm = VM(bytecode_float);
+    vm.set_return_type(KERNEL_BOOL);
+    vm.bind_column(0, F32, y.data());
+    if(Tester::assert_fail(vm.verify(length) == 0 && vm.translate() == 0)) return false;
+    if(Tester::assert_fail(vm.run_batch(n, flags.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        uint32_t value = y[i] * y[i] < 4.0f ? 0xFFFFFFFF : 0;
+        if(Tester::assert_fail(flags[i] == value)) return false;
+    }
+
+    /* Divide by zero still fails. */
+    Instruction bytecode_div[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    vm = VM(bytecode_div);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.verify(4) == 0 && vm.translate() == 0)) return false;
+    if(Tester::assert_fail(vm.run().type == KERNEL_ERROR)) return false;
+
+    return true;
+}
+
+/* Translation gives every instruction an opcode specialized for its type. */
+bool register_encoding_test() {
+    /* a = (x / 3 + y % 4) * x; z * 0.5 < z ? a : y */
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 4 },
+        { .opcode = MOD, .type = I32 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 2 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 2 },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 1 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    int length = sizeof(bytecode) / sizeof(bytecode[0]);
+
+    KernelInfo info;
+    RegProgram program;
+    if(Tester::assert_fail(verify_bytecode(bytecode, length, KERNEL_I32, &info) == 0)) return false;
+    if(Tester::assert_fail(translate_bytecode(bytecode, info, &program) == 0)) return false;
+
+    std::vector<RegOp> ops;
+    for(const RegInstruction& instr : program.code) ops.push_back(instr.op);
+
+    std::vector<RegOp> expected = {
+        LOAD_COLUMN, DIV_MAGIC_I32, LOAD_COLUMN, MOD_MAGIC_I32, ADD_I32, LOAD_COLUMN, MUL_I32,
+        LOAD_COLUMN, MUL_F32, LOAD_COLUMN, CMP_LT_F32, LOAD_COLUMN, BLEND, RET,
+    };
+    if(Tester::assert_fail(sizeof(RegInstruction) == 6)) return false;
+    if(Tester::assert_fail(ops == expected)) return false;
+    if(Tester::assert_fail(program.code[1].arg == 0 && program.divisors[0].divisor == 3)) return false;
+
+    /* NOT has no operand, leftover bytes in the instruction don't reach the register code. */
+    Instruction negated[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = NOT, .type = BOOL, .const_int = 0 },
+        { .opcode = RETURN },
+    };
+    RegProgram clean, dirty;
+    if(Tester::assert_fail(verify_bytecode(negated, 5, KERNEL_BOOL, &info) == 0)) return false;
+    if(Tester::assert_fail(translate_bytecode(negated, info, &clean) == 0)) return false;
+    negated[3].const_int = 0x5a;
+    if(Tester::assert_fail(verify_bytecode(negated, 5, KERNEL_BOOL, &info) == 0)) return false;
+    if(Tester::assert_fail(translate_bytecode(negated, info, &dirty) == 0)) return false;
+    if(Tester::assert_fail(clean.code.size() == dirty.code.size())) return false;
+    if(Tester::assert_fail(memcmp(clean.code.data(), dirty.code.data(), clean.code.size() * sizeof(RegInstruction)) == 0)) return false;
+
+    return true;
+}
+
+/*
+ * Run a kernel over the same inputs on the JIT and on the checked stack
+ * interpreter and compare the outputs bit for bit.
+ */
+static bool jit_matches(const Instruction *bytecode, int length, VMReturnType type, const Column *inputs, int num_inputs, size_t n) {
+    std::vector<int32_t> expected(n), output(n);
+
+    auto reference = VM(bytecode);
+    reference.set_return_type(type);
+    if(reference.run_batch(inputs, num_inputs, n, expected.data()) < 0) return false;
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(type);
+    if(vm.verify(length) < 0 || vm.compile_jit() < 0) return false;
+    if(vm.run_batch(inputs, num_inputs, n, output.data()) < 0) return false;
+
+    return expected == output;
+}
+
+/* The JIT agrees with the interpreter on every operation it compiles. */
+bool jit_test() {
+    if(LANES > 8) {
+        /* AVX-512 builds have no JIT and keep running on the interpreters. */
+        Instruction bytecode[] = {
+            { .opcode = PUSH_CONST, .type = I32, .const_int = 42 },
+            { .opcode = RETURN },
+        };
+        auto vm = VM(bytecode);
+        vm.set_return_type(KERNEL_I32);
+        if(Tester::assert_fail(vm.verify(2) == 0 && vm.compile_jit() == -1)) return false;
+        if(Tester::assert_fail(vm.run().result_int[LANES-1] == 42)) return false;
+        return true;
+    }
+
+    const size_t n = 5 * LANES + 3;
+    std::vector<int32_t> xi(n), yi(n);
+    std::vector<float> xf(n), yf(n);
+    std::vector<uint32_t> flags(n);
+    for(size_t i = 0; i < n; i++) {
+        xi[i] = (int32_t)(i * 7) % 11 - 5;
+        yi[i] = (int32_t)(i * 3) % 7 - 3;
+        xf[i] = xi[i] * 0.5f;
+        yf[i] = yi[i] * 0.75f;
+        flags[i] = i % 3 == 0 ? 0 : 1;
+    }
+
+    Column ints[] = { { .type = I32, .data = xi.data() }, { .type = I32, .data = yi.data() } };
+    Column floats[] = { { .type = F32, .data = xf.data() }, { .type = F32, .data = yf.data() } };
+
+    /* Binary operations on both types. */
+    OpCode binary[] = { ADD, SUB, MUL, DIV, CMP_LT, CMP_LTE, CMP_GT, CMP_GTE, CMP_EQ, CMP_NE };
+    for(OpCode op : binary) {
+        for(TypeTag type : { I32, F32 }) {
+            if(op == DIV && type == I32) continue;
+
+            Instruction bytecode[] = {
+                { .opcode = LOAD_ARG, .type = type, .arg = 0 },
+                { .opcode = LOAD_ARG, .type = type, .arg = 1 },
+                { .opcode = op, .type = type },
+                { .opcode = RETURN },
+            };
+            VMReturnType ret = op >= CMP_LT ? KERNEL_BOOL : (VMReturnType)type;
+            if(Tester::assert_fail(jit_matches(bytecode, 4, ret, type == I32 ? ints : floats, 2, n))) return false;
+        }
+    }
+
+    /* Variables, logic, select and boolean columns. */
+    Instruction bytecode_logic[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = STORE_VAR, .type = F32, .slot = 3 },
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 3 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.0f },
+        { .opcode = CMP_GT, .type = F32 },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = OR, .type = BOOL },
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+        { .opcode = AND, .type = BOOL },
+        { .opcode = STORE_VAR, .type = BOOL, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = BOOL, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 3 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 3 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = -1.5f },
+        { .opcode = SELECT, .type = F32 },
+        { .opcode = RETURN },
+    };
+    Column mixed[] = { { .type = F32, .data = xf.data() }, { .type = BOOL, .data = flags.data() } };
+    if(Tester::assert_fail(jit_matches(bytecode_logic, 18, KERNEL_F32, mixed, 2, n))) return false;
+
+    /* RAND stays in [0.0, 1.0) and draws the interpreters' numbers. */
+    Instruction bytecode_rand[] = {
+        { .opcode = RAND },
+        { .opcode = RAND },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = RETURN },
+    };
+
+    std::vector<float> output(n);
+    auto vm = VM(bytecode_rand);
+    vm.set_return_type(KERNEL_F32);
+    if(Tester::assert_fail(vm.verify(4) == 0 && vm.compile_jit() == 0)) return false;
+    if(Tester::assert_fail(vm.run_batch(n, output.data()) == 0)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(Tester::assert_fail(output[i] >= 0.0f && output[i] < 2.0f)) return false;
+    }
+
+    /* Integer division by a constant compiles to a magic number multiply. */
+    Instruction bytecode_div[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = -7 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 2 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    vm = VM(bytecode_div);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.verify(4) == 0)) return false;
+    if(Tester::assert_fail(vm.compile_jit() == 0)) return false;
+
+    auto result = vm.run();
+    if(Tester::assert_fail(result.type == KERNEL_I32 && result.result_int[0] == -3)) return false;
+
+    /* Any other integer divisor is left to the interpreter. */
+    Instruction bytecode_div_var[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 2 },
+        { .opcode = STORE_VAR, .type = I32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = I32, .slot = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    vm = VM(bytecode_div_var);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.verify(6) == 0)) return false;
+    if(Tester::assert_fail(vm.compile_jit() == -1)) return false;
+
+    result = vm.run();
+    if(Tester::assert_fail(result.type == KERNEL_I32 && result.result_int[0] == 3)) return false;
+
+    return true;
+}
+
+/*
+ * Optimize a kernel, check the result still verifies and has the expected
+ * length, and compare its output with the original over the inputs.
+ */
+static bool optimized_matches(const Instruction *bytecode, int length, VMReturnType type, int expected_length, const Column *inputs, int num_inputs, size_t n) {
+    KernelInfo info;
+    std::vector<Instruction> optimized;
+    if(verify_bytecode(bytecode, length, type, &info) < 0) return false;
+    optimize_bytecode(bytecode, info, &optimized);
+    if((int)optimized.size() != expected_length) return false;
+    if(verify_bytecode(optimized.data(), optimized.size(), type, &info) < 0) return false;
+
+    std::vector<int32_t> expected(n), output(n);
+    auto reference = VM(bytecode);
+    reference.set_return_type(type);
+    if(reference.run_batch(inputs, num_inputs, n, expected.data()) < 0) return false;
+
+    auto vm = VM(optimized.data());
+    vm.set_return_type(type);
+    if(vm.run_batch(inputs, num_inputs, n, output.data()) < 0) return false;
+
+    return expected == output;
+}
+
+/* Constant folding, identities and strength reduction keep results exact. */
+bool optimizer_test() {
+    const size_t n = 4 * LANES + 1;
+    std::vector<int32_t> x(n);
+    std::vector<uint32_t> flags(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = ((int32_t)i - 16) * 37;
+        flags[i] = i % 2;
+    }
+    x[0] = INT32_MIN;
+    x[1] = INT32_MAX;
+
+    Column inputs[] = { { .type = I32, .data = x.data() }, { .type = BOOL, .data = flags.data() } };
+
+    /* Constant subtrees fold to one PUSH_CONST. */
+    Instruction bytecode_fold[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 2 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 4 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = CMP_GT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(optimized_matches(bytecode_fold, 8, KERNEL_BOOL, 2, inputs, 2, n))) return false;
+
+    /* Identities on both sides disappear. */
+    Instruction bytecode_identity[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(optimized_matches(bytecode_identity, 8, KERNEL_I32, 2, inputs, 2, n))) return false;
+
+    /* NOT NOT and a SELECT on a constant condition. */
+    Instruction bytecode_logic[] = {
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = false },
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 1 },
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 1 },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = NOT, .type = BOOL },
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+        { .opcode = AND, .type = BOOL },
+        { .opcode = SELECT, .type = BOOL },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(optimized_matches(bytecode_logic, 9, KERNEL_BOOL, 2, inputs, 2, n))) return false;
+
+    /* MUL, DIV and MOD by powers of two become shifts. */
+    for(OpCode op : { MUL, DIV, MOD }) {
+        for(int32_t divisor : { 2, 8, 1024, 1 << 30 }) {
+            Instruction bytecode_pow2[] = {
+                { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+                { .opcode = PUSH_CONST, .type = I32, .const_int = divisor },
+                { .opcode = op, .type = I32 },
+                { .opcode = RETURN },
+            };
+            if(Tester::assert_fail(optimized_matches(bytecode_pow2, 4, KERNEL_I32, 3, inputs, 2, n))) return false;
+        }
+    }
+
+    /* Division by a constant zero still fails at run time. */
+    Instruction bytecode_div_0[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    KernelInfo info;
+    std::vector<Instruction> optimized;
+    verify_bytecode(bytecode_div_0, 4, KERNEL_I32, &info);
+    optimize_bytecode(bytecode_div_0, info, &optimized);
+    if(Tester::assert_fail(optimized.size() == 4)) return false;
+
+    auto vm = VM(optimized.data());
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run().type == KERNEL_ERROR)) return false;
+
+    /* RAND is never dropped, later random numbers depend on it. */
+    Instruction bytecode_rand[] = {
+        { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = RAND },
+        { .opcode = SELECT, .type = F32 },
+        { .opcode = RETURN },
+    };
+    verify_bytecode(bytecode_rand, 5, KERNEL_F32, &info);
+    optimize_bytecode(bytecode_rand, info, &optimized);
+    if(Tester::assert_fail(optimized.size() == 5)) return false;
+
+    /* Nor is a SELECT whose branches hold a trapping DIV, even times zero. */
+    Instruction bytecode_select_div[] = {
+        { .opcode = LOAD_ARG, .type = BOOL, .arg = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = DIV, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = RETURN },
+    };
+    verify_bytecode(bytecode_select_div, 9, KERNEL_I32, &info);
+    optimize_bytecode(bytecode_select_div, info, &optimized);
+    if(Tester::assert_fail(optimized.size() == 9)) return false;
+
+    /* Nor is a CMP_SELECT_CONST whose compared operand holds a RAND. */
+    Instruction bytecode_cmp_select_rand[] = {
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = RAND },
+        { .opcode = CMP_SELECT_CONST, .type = F32, .compare = CMP_LT },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = RETURN },
+    };
+    verify_bytecode(bytecode_cmp_select_rand, 8, KERNEL_I32, &info);
+    optimize_bytecode(bytecode_cmp_select_rand, info, &optimized);
+    if(Tester::assert_fail(optimized.size() == 8)) return false;
+
+    return true;
+}
+
+/*
+ * Fuse a kernel into superinstructions, check the result still verifies and
+ * has the expected length, and compare its output with the original on the
+ * stack and register interpreters.
+ */
+static bool fused_matches(const Instruction *bytecode, int length, VMReturnType type, int expected_length, bool contract, const Column *inputs, int num_inputs, size_t n) {
+    KernelInfo info;
+    std::vector<Instruction> fused;
+    if(verify_bytecode(bytecode, length, type, &info) < 0) return false;
+    fuse_superinstructions(bytecode, info, &fused, contract);
+    if((int)fused.size() != expected_length) return false;
+    if(verify_bytecode(fused.data(), fused.size(), type, &info) < 0) return false;
+
+    std::vector<int32_t> expected(n), output(n);
+    auto reference = VM(bytecode);
+    reference.set_return_type(type);
+    if(reference.run_batch(inputs, num_inputs, n, expected.data()) < 0) return false;
+
+    auto vm = VM(fused.data());
+    vm.set_return_type(type);
+    if(vm.verify(fused.size()) < 0) return false;
+    if(vm.run_batch(inputs, num_inputs, n, output.data()) < 0 || expected != output) return false;
+
+    vm = VM(fused.data());
+    vm.set_return_type(type);
+    if(vm.verify(fused.size()) < 0 || vm.translate() < 0) return false;
+    if(vm.run_batch(inputs, num_inputs, n, output.data()) < 0) return false;
+
+    return expected == output;
+}
+
+/* SQUARE_VAR, FMA and CMP_SELECT_CONST give the same results as the sequences they replace. */
+bool superinstruction_test() {
+    const size_t n = 4 * LANES + 3;
+    std::vector<float> x(n), y(n);
+    std::vector<int32_t> z(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (float)i * 0.125f - 1.5f;
+        y[i] = 1.0f - (float)i * 0.0625f;
+        z[i] = ((int32_t)i - 9) * 1001;
+    }
+
+    Column inputs[] = {
+        { .type = F32, .data = x.data() },
+        { .type = F32, .data = y.data() },
+        { .type = I32, .data = z.data() },
+    };
+
+    /* Monte Carlo pi: x*x + y*y <= 1 ? 1 : 0 */
+    Instruction bytecode_pi[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = STORE_VAR, .type = F32, .slot = 0 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 1 },
+        { .opcode = STORE_VAR, .type = F32, .slot = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 0 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+        { .opcode = LOAD_VAR, .type = F32, .slot = 1 },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 1.0f },
+        { .opcode = CMP_LTE, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 0 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(fused_matches(bytecode_pi, 17, KERNEL_I32, 12, false, inputs, 3, n))) return false;
+
+    /* Integer MUL; ADD always fuses, wrapping like the separate operations. */
+    Instruction bytecode_int_fma[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 2 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 2 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 65537 },
+        { .opcode = MUL, .type = I32 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(fused_matches(bytecode_int_fma, 6, KERNEL_I32, 5, false, inputs, 3, n))) return false;
+
+    /* Float MUL; ADD only fuses when contraction is allowed. */
+    Instruction bytecode_float_fma[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 1 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 4.0f },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = ADD, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_GT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = -2.0f },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 3.0f },
+        { .opcode = SELECT, .type = F32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(fused_matches(bytecode_float_fma, 11, KERNEL_F32, 10, false, inputs, 3, n))) return false;
+    if(Tester::assert_fail(fused_matches(bytecode_float_fma, 11, KERNEL_F32, 9, true, inputs, 3, n))) return false;
+
+    /* Every compare works in the fused form, for both types. */
+    for(OpCode op : { CMP_LT, CMP_LTE, CMP_GT, CMP_GTE, CMP_EQ, CMP_NE }) {
+        Instruction bytecode_cmp[] = {
+            { .opcode = LOAD_ARG, .type = I32, .arg = 2 },
+            { .opcode = PUSH_CONST, .type = I32, .const_int = 1001 },
+            { .opcode = op, .type = I32 },
+            { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+            { .opcode = PUSH_CONST, .type = BOOL, .const_bool = false },
+            { .opcode = SELECT, .type = BOOL },
+            { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+            { .opcode = PUSH_CONST, .type = F32, .const_float = 0.25f },
+            { .opcode = op, .type = F32 },
+            { .opcode = PUSH_CONST, .type = BOOL, .const_bool = false },
+            { .opcode = PUSH_CONST, .type = BOOL, .const_bool = true },
+            { .opcode = SELECT, .type = BOOL },
+            { .opcode = OR, .type = BOOL },
+            { .opcode = RETURN },
+        };
+        if(Tester::assert_fail(fused_matches(bytecode_cmp, 14, KERNEL_BOOL, 12, false, inputs, 3, n))) return false;
+    }
+
+    /* Unverified bytecode cannot use CMP_SELECT_CONST, its operand words could lie past the end. */
+    Instruction bytecode_unverified[] = {
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 1 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 2 },
+        { .opcode = CMP_SELECT_CONST, .type = I32, .compare = CMP_LT },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 3 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 5 },
+        { .opcode = RETURN },
+    };
+    auto vm = VM(bytecode_unverified);
+    if(Tester::assert_fail(vm.run().type == KERNEL_ERROR)) return false;
+    if(Tester::assert_fail(vm.verify(6) == 0 && vm.run().result_int[0] == 3)) return false;
+
+    return true;
+}
+
+/* Every ISA build the host supports gives the same results as this build. */
+bool engine_test() {
+    Instruction bytecode[] = {
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = MOD, .type = I32 },
+        { .opcode = LOAD_ARG, .type = F32, .arg = 1 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 100 },
+        { .opcode = LOAD_ARG, .type = I32, .arg = 0 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = ADD, .type = I32 },
+        { .opcode = RETURN },
+    };
+
+    const size_t n = 3 * 16 + 5;
+    std::vector<int32_t> x(n), expected(n);
+    std::vector<float> y(n);
+    for(size_t i = 0; i < n; i++) {
+        x[i] = (int32_t)(i * 37) - 500;
+        y[i] = (float)i / n;
+    }
+    Column inputs[] = {
+        { .type = I32, .data = x.data() },
+        { .type = F32, .data = y.data() },
+    };
+
+    auto vm = VM(bytecode);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 2, n, expected.data()) == 0)) return false;
+
+    Isa detected = detect_isa();
+    if(Tester::assert_fail(detected != ISA_COUNT)) return false;
+
+    for(int i = 0; i < ISA_COUNT; i++) {
+        Isa isa = (Isa)i;
+        std::unique_ptr<Engine> engine;
+        if(isa > detected) {
+            if(Tester::assert_fail(create_engine(bytecode, isa, &engine) < 0)) return false;
+            continue;
+        }
+
+        for(int mode = 0; mode < 3; mode++) {
+            if(Tester::assert_fail(create_engine(bytecode, isa, &engine) == 0)) return false;
+            if(Tester::assert_fail(engine->isa() == isa && engine->lanes() == isa_lanes(isa))) return false;
+            engine->set_return_type(KERNEL_I32);
+            if(mode > 0 && Tester::assert_fail(engine->verify(11) == 0 && engine->translate() == 0)) return false;
+            if(mode > 1) engine->compile_jit();
+
+            std::vector<int32_t> output(n);
+            if(Tester::assert_fail(engine->run_batch(inputs, 2, n, output.data()) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+
+            /* A shared engine runs the same kernel in a frame of its own, but cannot prepare it. */
+            std::unique_ptr<Engine> shared;
+            if(Tester::assert_fail(engine->share(&shared) == 0 && shared->isa() == isa)) return false;
+            if(Tester::assert_fail(shared->verify(11) < 0 && shared->return_type() == KERNEL_I32)) return false;
+            std::fill(output.begin(), output.end(), 0);
+            if(Tester::assert_fail(shared->run_batch(inputs, 2, n, output.data()) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+
+            /* Preparing the kernel after sharing it leaves the shared engine's kernel alone. */
+            if(Tester::assert_fail(engine->verify(11) == 0 && engine->translate() == 0)) return false;
+            engine->compile_jit();
+            std::fill(output.begin(), output.end(), 0);
+            if(Tester::assert_fail(shared->run_batch(inputs, 2, n, output.data()) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+            std::fill(output.begin(), output.end(), 0);
+            if(Tester::assert_fail(engine->run_batch(inputs, 2, n, output.data()) == 0)) return false;
+            if(Tester::assert_fail(output == expected)) return false;
+        }
+    }
+
+    /* MOSAIC_ISA forces a narrower engine, unknown or unsupported names are ignored. */
+    Isa parsed;
+    if(Tester::assert_fail(parse_isa(isa_name(ISA_AVX2), &parsed) == 0 && parsed == ISA_AVX2)) return false;
+    if(Tester::assert_fail(parse_isa("neon", &parsed) < 0)) return false;
+
+    setenv("MOSAIC_ISA", "sse4.1", 1);
+    if(Tester::assert_fail(select_isa() == ISA_SSE41)) return false;
+    std::unique_ptr<Engine> engine;
+    if(Tester::assert_fail(create_engine(bytecode, &engine) == 0 && engine->isa() == ISA_SSE41)) return false;
+    setenv("MOSAIC_ISA", "neon", 1);
+    if(Tester::assert_fail(select_isa() == detected)) return false;
+    unsetenv("MOSAIC_ISA");
+    if(Tester::assert_fail(select_isa() == detected)) return false;
+
+    return true;
+}
+
+/* Calibration picks a runnable engine per shape and the profile round trips through a file. */
+bool tuner_test() {
+    Instruction bytecode_divide[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 0.5f },
+        { .opcode = CMP_LT, .type = F32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 90 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 7 },
+        { .opcode = MOD, .type = I32 },
+        { .opcode = PUSH_CONST, .type = I32, .const_int = 2 },
+        { .opcode = SELECT, .type = I32 },
+        { .opcode = RETURN },
+    };
+    Instruction bytecode_random[] = {
+        { .opcode = RAND, .type = F32 },
+        { .opcode = RETURN },
+    };
+    Instruction bytecode_float[] = {
+        { .opcode = LOAD_ARG, .type = F32, .arg = 0 },
+        { .opcode = PUSH_CONST, .type = F32, .const_float = 2.0f },
+        { .opcode = MUL, .type = F32 },
+        { .opcode = RETURN },
+    };
+    if(Tester::assert_fail(kernel_shape(bytecode_divide, 9) == SHAPE_DIVIDE)) return false;
+    if(Tester::assert_fail(kernel_shape(bytecode_random, 2) == SHAPE_RANDOM)) return false;
+    if(Tester::assert_fail(kernel_shape(bytecode_float, 4) == SHAPE_FLOAT)) return false;
+
+    HostProfile profile;
+    if(Tester::assert_fail(calibrate(0.05, &profile) == 0 && profile.host == detect_isa())) return false;
+    for(const EngineConfig& config : profile.best) {
+        if(Tester::assert_fail(config.isa <= profile.host && config.mode < ENGINE_MODE_COUNT)) return false;
+    }
+
+    /* Saved profiles load back unchanged, broken or foreign ones are rejected. */
+    char path[] = "/tmp/mosaic_profile_XXXXXX";
+    int fd = mkstemp(path);
+    if(Tester::assert_fail(fd >= 0)) return false;
+    close(fd);
+
+    HostProfile loaded;
+    bool round_trip = save_profile(path, profile) == 0 && load_profile(path, &loaded) == 0 && loaded.host == profile.host;
+    for(int shape = 0; shape < SHAPE_COUNT; shape++) {
+        round_trip = round_trip && loaded.best[shape].isa == profile.best[shape].isa
+            && loaded.best[shape].unroll == profile.best[shape].unroll
+            && loaded.best[shape].mode == profile.best[shape].mode;
+    }
+
+    FILE *file = fopen(path, "w");
+    fprintf(file, "mosaic-profile 1\nhost %s\nint sse4.1 3 stack\n", isa_name(detect_isa()));
+    fclose(file);
+    bool rejects_broken = load_profile(path, &loaded) < 0;
+
+    /* A missing profile is calibrated and saved, then loaded on the next boot. */
+    unlink(path);
+    bool boots = load_or_calibrate(path, 0.01, &loaded) == 0 && load_profile(path, &loaded) == 0;
+    unlink(path);
+    if(Tester::assert_fail(round_trip && rejects_broken && boots)) return false;
+
+    /* Tuned engines give the same results as this build. */
+    const size_t n = 100;
+    std::vector<float> x(n);
+    std::vector<int32_t> expected(n), output(n);
+    for(size_t i = 0; i < n; i++) x[i] = (float)i / n;
+    Column inputs[] = {
+        { .type = F32, .data = x.data() },
+    };
+
+    auto vm = VM(bytecode_divide);
+    vm.set_return_type(KERNEL_I32);
+    if(Tester::assert_fail(vm.run_batch(inputs, 1, n, expected.data()) == 0)) return false;
+
+    for(int mode = 0; mode < ENGINE_MODE_COUNT; mode++) {
+        profile.best[SHAPE_DIVIDE].mode = (EngineMode)mode;
+        std::unique_ptr<Engine> engine;
+        if(Tester::assert_fail(create_tuned_engine(bytecode_divide, 9, KERNEL_I32, profile, &engine) == 0)) return false;
+        if(Tester::assert_fail(engine->run_batch(inputs, 1, n, output.data()) == 0 && output == expected)) return false;
+    }
+
+    /* Even the stack interpreter only runs kernels the verifier accepts. */
+    EngineConfig stack = { ISA_SSE41, 1, ENGINE_STACK };
+    std::unique_ptr<Engine> engine;
+    if(Tester::assert_fail(build_engine(bytecode_float, 4, KERNEL_F32, stack, &engine) == 0)) return false;
+    if(Tester::assert_fail(build_engine(bytecode_float, 4, KERNEL_I32, stack, &engine) == -1)) return false;
+
+    /* Pools and clusters boot on the saved profile and run their workers on its engines. */
+    profile.best[SHAPE_DIVIDE] = { ISA_SSE41, 4, ENGINE_REGISTER };
+    if(Tester::assert_fail(save_profile(path, profile) == 0)) return false;
+
+    WorkerPool pool(2);
+    if(Tester::assert_fail(pool.host_profile().best[SHAPE_DIVIDE].mode == ENGINE_JIT)) return false;
+    bool tuned = pool.tune(path) == 0 && pool.prepare(bytecode_divide, 9, KERNEL_I32, &engine) == 0
+        && engine->isa() == ISA_SSE41 && engine->unroll() == 4;
+    std::fill(output.begin(), output.end(), 0);
+    BatchJob job = { engine.get(), inputs, 1, n, 0, 0 };
+    tuned = tuned && pool.run_batch(job, output.data()) == 0 && output == expected;
+
+    LocalCluster cluster;
+    tuned = tuned && cluster.start(2, 1 << 16, path) == 0;
+    unlink(path);
+    float *shared_x = (float *)cluster.allocate(n * sizeof(float));
+    int32_t *shared_output = (int32_t *)cluster.allocate(n * sizeof(int32_t));
+    tuned = tuned && shared_x != nullptr && shared_output != nullptr;
+    if(Tester::assert_fail(tuned)) return false;
+
+    std::copy(x.begin(), x.end(), shared_x);
+    Column shared_inputs[] = {{ .type = F32, .data = shared_x }};
+    int id = cluster.add_kernel(bytecode_divide, 9, KERNEL_I32);
+    if(Tester::assert_fail(cluster.run_batch(id, shared_inputs, 1, n, 0, shared_output) == 0)) return false;
+    if(Tester::assert_fail(std::equal(shared_output, shared_output + n, expected.begin()))) return false;
+
+    return true;
+}
+
 /*
  * Run several tests on the VM.
  */
@@ -1342,6 +3541,11 @@ int main(int argc, char **argv) {
     test_suite.add_test("Invalid stack size test", stack_size_test);
     test_suite.add_test("STORE/LOAD test", store_load_test);
     test_suite.add_test("Invalid slot test", invalid_slot_test);
+    test_suite.add_test("Reset test", reset_test);
+    test_suite.add_test("Frame size test", frame_size_test);
+    test_suite.add_test("Compiled kernel test", compiled_kernel_test);
+    test_suite.add_test("Kernel file test", kernel_file_test);
+    test_suite.add_test("LOAD_ARG test", load_arg_test);
 
     // Mathematical operations tests
     test_suite.add_test("Int math operations test", int_math_ops_test);
@@ -1370,6 +3574,45 @@ int main(int argc, char **argv) {
 
     // RAND operation test
     test_suite.add_test("RAND test", random_test);
+    test_suite.add_test("RAND partition test", random_partition_test);
+
+    // Verifier tests
+    test_suite.add_test("Verify test", verify_test);
+    test_suite.add_test("Verify reject test", verify_reject_test);
+
+    // Register interpreter tests
+    test_suite.add_test("Register interpreter test", register_test);
+    test_suite.add_test("Register encoding test", register_encoding_test);
+
+    // Optimizer tests
+    test_suite.add_test("Optimizer test", optimizer_test);
+    test_suite.add_test("Superinstruction test", superinstruction_test);
+
+    // JIT tests
+    test_suite.add_test("JIT test", jit_test);
+
+    // Runtime dispatch tests
+    test_suite.add_test("Engine dispatch test", engine_test);
+    test_suite.add_test("Autotuner test", tuner_test);
+
+    // Batch execution tests
+    test_suite.add_test("Batch test", batch_test);
+    test_suite.add_test("Batch tail DIV test", batch_tail_div_test);
+    test_suite.add_test("Int division test", int_division_test);
+    test_suite.add_test("Group width test", group_width_test);
+    test_suite.add_test("Reduce test", reduce_test);
+    test_suite.add_test("Batch slot test", batch_slot_test);
+
+    // Worker runtime tests
+    test_suite.add_test("Worker pool test", worker_test);
+    test_suite.add_test("Worker placement test", worker_placement_test);
+
+    // Scheduler tests
+    test_suite.add_test("Scheduler test", scheduler_test);
+
+    // Cluster tests
+    test_suite.add_test("Local cluster test", cluster_test);
+    test_suite.add_test("Wire protocol test", wire_test);
 
     bool passed = test_suite.run_tests(true);
 
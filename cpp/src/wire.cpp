@@ -0,0 +1,402 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+
+#include "wire.h"
+#include "verifier.h"
+
+/*
+ * Kernels travel as WIRE_INSTRUCTION_SIZE bytes per instruction: the
+ * opcode, the type and the operand, with BOOL constants widened to 0 or 1
+ * so equal kernels always encode, and hash, the same.
+ */
+
+constexpr uint64_t FNV_OFFSET = 0xCBF29CE484222325;
+constexpr uint64_t FNV_PRIME = 0x00000100000001B3;
+
+/* Bytes in a WIRE_KERNEL payload ahead of the instructions. */
+constexpr size_t KERNEL_PREFIX_SIZE = 16;
+
+/*
+ * Continue a 64-bit FNV-1a hash over a buffer.
+ */
+static uint64_t fnv1a(const void *data, size_t size, uint64_t hash) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Encode bytecode for the wire.
+ */
+static void encode_kernel(const Instruction *bytecode, int length, std::vector<uint8_t> *encoded) {
+    encoded->resize(length * WIRE_INSTRUCTION_SIZE);
+    uint8_t *out = encoded->data();
+    for(int pc = 0; pc < length; pc++, out += WIRE_INSTRUCTION_SIZE) {
+        const Instruction& instr = bytecode[pc];
+        int32_t operand = instr.opcode == PUSH_CONST && instr.type == BOOL ? instr.const_bool : instr.const_int;
+        out[0] = (uint8_t)instr.opcode;
+        out[1] = (uint8_t)instr.type;
+        memcpy(out + 2, &operand, sizeof(operand));
+    }
+}
+
+/*
+ * Decode bytecode from the wire.
+ * Returns:
+ *     int - 0 on success, -1 if an opcode or type is out of range.
+ */
+static int decode_kernel(const uint8_t *encoded, int length, std::vector<Instruction> *bytecode) {
+    bytecode->resize(length);
+    for(int pc = 0; pc < length; pc++, encoded += WIRE_INSTRUCTION_SIZE) {
+        if(encoded[0] >= NUM_OPCODES || encoded[1] > BOOL) return -1;
+
+        Instruction& instr = (*bytecode)[pc];
+        instr.opcode = (OpCode)encoded[0];
+        instr.type = (TypeTag)encoded[1];
+        memcpy(&instr.const_int, encoded + 2, sizeof(instr.const_int));
+        if(instr.opcode == PUSH_CONST && instr.type == BOOL) instr.const_bool = instr.const_int != 0;
+    }
+    return 0;
+}
+
+/*
+ * Hash of an encoded kernel and its return type.
+ */
+static uint64_t hash_encoded(const uint8_t *encoded, size_t size, VMReturnType type) {
+    int32_t return_type = type;
+    return fnv1a(encoded, size, fnv1a(&return_type, sizeof(return_type), FNV_OFFSET));
+}
+
+/*
+ * Hash that names a kernel on the wire.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel.
+ *     int length - Instructions up to and including RETURN.
+ *     VMReturnType type - Return type of the kernel.
+ * Returns:
+ *     uint64_t - FNV-1a of the return type and the encoded bytecode.
+ */
+uint64_t kernel_hash(const Instruction *bytecode, int length, VMReturnType type) {
+    std::vector<uint8_t> encoded;
+    encode_kernel(bytecode, length, &encoded);
+    return hash_encoded(encoded.data(), encoded.size(), type);
+}
+
+/*
+ * Send a frame gathered from several buffers, without SIGPIPE if the peer
+ * has gone.
+ * Returns:
+ *     int - 0 on success, -1 if the connection failed.
+ */
+static int send_frame(int fd, iovec *iov, int count) {
+    while(count > 0) {
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        while(count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read exactly size bytes.
+ * Returns:
+ *     int - 0 on success, -1 if the connection failed or closed.
+ */
+static int read_exact(int fd, void *data, size_t size) {
+    uint8_t *out = (uint8_t *)data;
+    while(size > 0) {
+        ssize_t got = recv(fd, out, size, MSG_WAITALL);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return -1;
+
+        out += got;
+        size -= got;
+    }
+    return 0;
+}
+
+WireConnection::~WireConnection() {
+    if(fd >= 0) close(fd);
+}
+
+/*
+ * Make a kernel known to the peer. A kernel already sent on this
+ * connection is not sent again.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, checked by the verifier.
+ *     int length - Number of instructions available in bytecode.
+ *     VMReturnType type - Return type of the kernel.
+ *     uint64_t *hash - Receives the hash tasks refer to the kernel by.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is rejected or the send fails.
+ */
+int WireConnection::send_kernel(const Instruction *bytecode, int length, VMReturnType type, uint64_t *hash) {
+    KernelInfo info;
+    if(verify_bytecode(bytecode, length, type, &info) < 0) return -1;
+
+    std::vector<uint8_t> encoded;
+    encode_kernel(bytecode, info.length, &encoded);
+    *hash = hash_encoded(encoded.data(), encoded.size(), type);
+    if(sent.count(*hash) != 0) return 0;
+
+    uint8_t prefix[KERNEL_PREFIX_SIZE];
+    int32_t fields[2] = { type, info.length };
+    memcpy(prefix, hash, sizeof(*hash));
+    memcpy(prefix + sizeof(*hash), fields, sizeof(fields));
+
+    WireHeader header = { WIRE_MAGIC, WIRE_VERSION, WIRE_KERNEL, 1, (uint32_t)(sizeof(prefix) + encoded.size()) };
+    iovec iov[] = {
+        { &header, sizeof(header) },
+        { prefix, sizeof(prefix) },
+        { encoded.data(), encoded.size() },
+    };
+    if(send_frame(fd, iov, 3) < 0) return -1;
+
+    sent.insert(*hash);
+    return 0;
+}
+
+/*
+ * Send task assignments, as many to a frame as the header can count. The
+ * largest task count bounds the result frames accepted afterwards.
+ * Arguments:
+ *     const WireTask *tasks - Tasks, sent straight from this array.
+ *     size_t count - Number of tasks.
+ * Returns:
+ *     int - 0 on success, -1 if a task names a kernel not sent on this
+ *           connection or the send fails.
+ */
+int WireConnection::send_tasks(const WireTask *tasks, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        if(sent.count(tasks[i].kernel) == 0) return -1;
+    }
+    for(size_t i = 0; i < count; i++) max_task_count = std::max(max_task_count, tasks[i].count);
+
+    for(size_t first = 0; first < count; first += UINT16_MAX) {
+        uint16_t batch = (uint16_t)(count - first < UINT16_MAX ? count - first : UINT16_MAX);
+        WireHeader header = { WIRE_MAGIC, WIRE_VERSION, WIRE_TASKS, batch, (uint32_t)(batch * sizeof(WireTask)) };
+        iovec iov[] = {
+            { &header, sizeof(header) },
+            { (void *)(tasks + first), batch * sizeof(WireTask) },
+        };
+        if(send_frame(fd, iov, 2) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send the outcome of a task.
+ * Arguments:
+ *     const WireResult& result - Task id, status, type and value count.
+ *     const void *values - result.count 32-bit values, sent in place.
+ * Returns:
+ *     int - 0 on success, -1 if the values do not fit a frame or the send
+ *           fails.
+ */
+int WireConnection::send_result(const WireResult& result, const void *values) {
+    if(result.count > (WIRE_MAX_PAYLOAD - sizeof(WireResult)) / sizeof(int32_t)) return -1;
+
+    uint32_t bytes = (uint32_t)(result.count * sizeof(int32_t));
+    WireHeader header = { WIRE_MAGIC, WIRE_VERSION, WIRE_RESULT, 1, (uint32_t)sizeof(WireResult) + bytes };
+    iovec iov[] = {
+        { &header, sizeof(header) },
+        { (void *)&result, sizeof(result) },
+        { (void *)values, bytes },
+    };
+    return send_frame(fd, iov, bytes > 0 ? 3 : 2);
+}
+
+/*
+ * Largest payload a frame of this type can legally carry, so a peer can't
+ * make receive() allocate more: a kernel of MAX_KERNEL_LENGTH instructions,
+ * the header's count of tasks, or the values of the largest task sent on
+ * this connection.
+ * Returns:
+ *     size_t - Payload bytes allowed, 0 for an unknown frame type.
+ */
+size_t WireConnection::payload_limit(const WireHeader& header) const {
+    switch(header.type) {
+        case WIRE_KERNEL:
+            return KERNEL_PREFIX_SIZE + MAX_KERNEL_LENGTH * WIRE_INSTRUCTION_SIZE;
+        case WIRE_TASKS:
+            return header.count * sizeof(WireTask);
+        case WIRE_RESULT:
+            return sizeof(WireResult) + std::min<uint64_t>(max_task_count, WIRE_MAX_PAYLOAD / sizeof(int32_t)) * sizeof(int32_t);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Wait for the next frame and decode it. Kernels are kept for
+ * find_kernel(); tasks must name a kernel the peer already sent.
+ * Arguments:
+ *     WireMessage *message - Receives the frame.
+ * Returns:
+ *     int - 0 on success, -1 if the connection closed or the frame is
+ *           malformed or larger than its type allows.
+ */
+int WireConnection::receive(WireMessage *message) {
+    WireHeader header;
+    if(read_exact(fd, &header, sizeof(header)) < 0) return -1;
+    if(header.magic != WIRE_MAGIC || header.version != WIRE_VERSION || header.length > WIRE_MAX_PAYLOAD) return -1;
+    if(header.length > payload_limit(header)) return -1;
+
+    payload.resize(header.length);
+    if(read_exact(fd, payload.data(), payload.size()) < 0) return -1;
+
+    message->type = (WireType)header.type;
+    switch(header.type) {
+        case WIRE_KERNEL: {
+            if(header.count != 1 || payload.size() < KERNEL_PREFIX_SIZE) return -1;
+
+            uint64_t hash;
+            int32_t fields[2];
+            memcpy(&hash, payload.data(), sizeof(hash));
+            memcpy(fields, payload.data() + sizeof(hash), sizeof(fields));
+            if(fields[0] < KERNEL_I32 || fields[0] > KERNEL_BOOL || fields[1] <= 0) return -1;
+            if(payload.size() - KERNEL_PREFIX_SIZE != (size_t)fields[1] * WIRE_INSTRUCTION_SIZE) return -1;
+
+            const uint8_t *encoded = payload.data() + KERNEL_PREFIX_SIZE;
+            if(hash_encoded(encoded, payload.size() - KERNEL_PREFIX_SIZE, (VMReturnType)fields[0]) != hash) return -1;
+
+            WireKernel kernel;
+            kernel.return_type = (VMReturnType)fields[0];
+            if(decode_kernel(encoded, fields[1], &kernel.bytecode) < 0) return -1;
+
+            received[hash] = std::move(kernel);
+            message->kernel = hash;
+            return 0;
+        }
+        case WIRE_TASKS: {
+            if(payload.size() != header.count * sizeof(WireTask)) return -1;
+
+            message->tasks.resize(header.count);
+            memcpy(message->tasks.data(), payload.data(), payload.size());
+            for(const WireTask& task : message->tasks) {
+                if(received.count(task.kernel) == 0) return -1;
+            }
+            return 0;
+        }
+        case WIRE_RESULT: {
+            if(header.count != 1 || payload.size() < sizeof(WireResult)) return -1;
+
+            memcpy(&message->result, payload.data(), sizeof(WireResult));
+            if(message->result.count > payload.size()) return -1;
+            if(payload.size() - sizeof(WireResult) != message->result.count * sizeof(int32_t)) return -1;
+
+            message->values = payload.data() + sizeof(WireResult);
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Look up a kernel the peer sent.
+ * Returns:
+ *     const WireKernel * - The kernel, nullptr if none has this hash.
+ */
+const WireKernel *WireConnection::find_kernel(uint64_t hash) const {
+    auto kernel = received.find(hash);
+    return kernel != received.end() ? &kernel->second : nullptr;
+}
+
+/*
+ * Listen for connections on the loopback interface.
+ * Arguments:
+ *     uint16_t port - Port to listen on, 0 for any free port.
+ *     uint16_t *bound_port - Receives the port listened on.
+ * Returns:
+ *     int - Listening socket, -1 on failure.
+ */
+int wire_listen(uint16_t port, uint16_t *bound_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if(bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0
+       || getsockname(fd, (sockaddr *)&address, &size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *bound_port = ntohs(address.sin_port);
+    return fd;
+}
+
+/*
+ * Frames are small and latency bound, so do not let Nagle hold them back.
+ */
+static int no_delay(int fd) {
+    int on = 1;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Accept a connection from a listening socket.
+ * Returns:
+ *     int - Connected socket for a WireConnection, -1 on failure.
+ */
+int wire_accept(int listener) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if(fd < 0) return -1;
+    return no_delay(fd);
+}
+
+/*
+ * Connect to a port on the loopback interface.
+ * Returns:
+ *     int - Connected socket for a WireConnection, -1 on failure.
+ */
+int wire_connect(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return no_delay(fd);
+}
@@ -0,0 +1,462 @@
+#include <string.h>
+#include <algorithm>
+
+#include "worker.h"
+
+/*
+ * Take the next chunk from the front of the worker's own deque.
+ * Arguments:
+ *     uint32_t *chunk - Receives the chunk number.
+ * Returns:
+ *     int - 0 on success, -1 if the deque is empty.
+ */
+int ChunkDeque::pop(uint32_t *chunk) {
+    uint64_t current = range.load(std::memory_order_acquire);
+    for(;;) {
+        uint32_t begin = current >> 32, end = (uint32_t)current;
+        if(begin >= end) return -1;
+
+        uint64_t next = (uint64_t)(begin + 1) << 32 | end;
+        if(range.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            *chunk = begin;
+            return 0;
+        }
+    }
+}
+
+/*
+ * Move the back half of another worker's chunks, at least one, into this
+ * empty deque. Ranges only shrink while a job runs, so a stale view of the
+ * victim just makes the compare and swap retry.
+ * Arguments:
+ *     ChunkDeque& victim - Deque to steal from.
+ * Returns:
+ *     int - 0 on success, -1 if the victim had nothing left.
+ */
+int ChunkDeque::steal(ChunkDeque& victim) {
+    uint64_t current = victim.range.load(std::memory_order_acquire);
+    for(;;) {
+        uint32_t begin = current >> 32, end = (uint32_t)current;
+        if(begin >= end) return -1;
+
+        uint32_t mid = end - (end - begin + 1) / 2;
+        uint64_t next = (uint64_t)begin << 32 | mid;
+        if(victim.range.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            assign(mid, end);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Fold one reduced chunk into a running partial.
+ * Arguments:
+ *     ReduceOp op - SUM, COUNT, MIN or MAX.
+ *     bool is_float - The values are f64.
+ *     ReduceValue *total - Partial to update.
+ *     const ReduceValue& value - Chunk result.
+ */
+static void combine(ReduceOp op, bool is_float, ReduceValue *total, const ReduceValue& value) {
+    switch(op) {
+    case REDUCE_MIN:
+        if(is_float) total->f64 = std::min(total->f64, value.f64);
+        else total->i64 = std::min(total->i64, value.i64);
+        break;
+    case REDUCE_MAX:
+        if(is_float) total->f64 = std::max(total->f64, value.f64);
+        else total->i64 = std::max(total->i64, value.i64);
+        break;
+    default:
+        if(is_float) total->f64 += value.f64;
+        else total->i64 += value.i64;
+        break;
+    }
+}
+
+/*
+ * A single node of unpinned threads, one per CPU the host reports.
+ */
+static Topology unpinned_topology() {
+    unsigned cpus = std::thread::hardware_concurrency();
+    return { { std::vector<int>(cpus > 0 ? cpus : 1, -1) }, { 0 } };
+}
+
+/*
+ * Topology of this host, or unpinned_topology() when it cannot be read.
+ */
+static Topology host_topology() {
+    Topology topology;
+    if(discover_topology(&topology) < 0) topology = unpinned_topology();
+    return topology;
+}
+
+/*
+ * Start the worker threads on this host's topology, one per usable CPU
+ * unless told otherwise.
+ * Arguments:
+ *     int num_threads - Threads to run, 0 for every usable CPU.
+ */
+WorkerPool::WorkerPool(int num_threads) : WorkerPool(num_threads, host_topology()) {}
+
+/*
+ * Start the worker threads on a given topology, or on unpinned_topology()
+ * if it lists no CPU at all.
+ * Arguments:
+ *     int num_threads - Threads to run, 0 for every CPU of the topology.
+ *     const Topology& topology - Nodes and CPUs to place threads on.
+ */
+WorkerPool::WorkerPool(int num_threads, const Topology& topology)
+    : chunk_groups(WORKER_CHUNK_GROUPS), topology(topology), profile(default_profile()), job(nullptr), output(nullptr),
+      touch(nullptr), reduce_op(REDUCE_SUM), chunk_size(0), failed(false), generation(0), running(0), stopping(false) {
+    // A topology without a single CPU is as good as unknown
+    bool any_cpu = false;
+    for(const std::vector<int>& node : this->topology.nodes) any_cpu = any_cpu || !node.empty();
+    if(!any_cpu) this->topology = unpinned_topology();
+    place_workers(num_threads);
+    for(int i = 0; i < num_workers; i++) threads.emplace_back(&WorkerPool::thread_main, this, i);
+}
+
+/*
+ * Give each worker a CPU and its steal order. CPUs are dealt round robin
+ * over the nodes so any thread count spreads evenly, then workers are
+ * numbered node by node.
+ */
+void WorkerPool::place_workers(int num_threads) {
+    std::vector<std::pair<int, int>> cpus;      // (node, cpu), nodes interleaved
+    for(size_t round = 0; ; round++) {
+        size_t before = cpus.size();
+        for(size_t node = 0; node < topology.nodes.size(); node++) {
+            if(round < topology.nodes[node].size()) cpus.push_back({ (int)node, topology.nodes[node][round] });
+        }
+        if(cpus.size() == before) break;
+    }
+
+    if(num_threads <= 0) num_threads = cpus.size();
+    num_workers = num_threads;
+
+    std::vector<std::pair<int, int>> placed;
+    for(int i = 0; i < num_workers; i++) placed.push_back(cpus[i % cpus.size()]);
+    std::stable_sort(placed.begin(), placed.end(),
+                     [](const std::pair<int, int>& a, const std::pair<int, int>& b) { return a.first < b.first; });
+
+    workers.reset(new Worker[num_workers]);
+    for(int i = 0; i < num_workers; i++) {
+        Worker& worker = workers[i];
+        worker.deque.assign(0, 0);
+        worker.has_partial = false;
+        worker.node = placed[i].first;
+        worker.cpu = placed[i].second;
+    }
+
+    // The rest of the node in ring order, then the other nodes
+    for(int i = 0; i < num_workers; i++) {
+        for(int local = 1; local >= 0; local--) {
+            for(int k = 1; k < num_workers; k++) {
+                int j = (i + k) % num_workers;
+                if((workers[j].node == workers[i].node) == (bool)local) workers[i].victims.push_back(j);
+            }
+        }
+    }
+}
+
+/*
+ * Boot the pool on the host profile: load it, or calibrate and save one
+ * when it is missing or stale, see load_or_calibrate(). Call it before
+ * preparing jobs.
+ * Arguments:
+ *     const char *path - Profile file.
+ * Returns:
+ *     int - 0 on success, -1 if the host has no engine at all.
+ */
+int WorkerPool::tune(const char *path) {
+    return load_or_calibrate(path, CALIBRATE_BUDGET_MS, &profile);
+}
+
+/*
+ * Build the engine a job runs on, the one the pool's profile picked for
+ * the kernel's shape. Every worker shares it, so the workers' contexts all
+ * follow the profile.
+ * Arguments:
+ *     const Instruction *bytecode - Kernel, read until the engine is built.
+ *     int length - Instructions up to and including RETURN.
+ *     VMReturnType type - Return type of the kernel.
+ *     std::unique_ptr<Engine> *engine - Receives the engine for BatchJob.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel is rejected.
+ */
+int WorkerPool::prepare(const Instruction *bytecode, int length, VMReturnType type, std::unique_ptr<Engine> *engine) const {
+    return create_tuned_engine(bytecode, length, type, profile, engine);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    start.notify_all();
+    for(std::thread& thread : threads) thread.join();
+}
+
+/*
+ * Pin to the worker's CPU, then wait for each job and work on it until no
+ * chunk is left anywhere.
+ */
+void WorkerPool::thread_main(int index) {
+    uint64_t seen = 0;
+
+    // Unpinned threads still work, just without placement
+    if(workers[index].cpu >= 0) pin_thread(workers[index].cpu);
+
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            start.wait(guard, [&] { return stopping || generation != seen; });
+            if(stopping) return;
+            seen = generation;
+        }
+
+        work(index);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if(--running == 0) done.notify_one();
+    }
+}
+
+/*
+ * Run chunks from this worker's deque, then steal from the others until a
+ * full pass finds nothing. The context is shared from the job's engine on
+ * the worker's own thread, so its frame is local to the node, and kept
+ * across jobs of the same build, only rebound to each job's kernel. First
+ * touch jobs never steal, pages must land where the static split of a job
+ * puts its chunks.
+ */
+void WorkerPool::work(int index) {
+    Worker& self = workers[index];
+
+    if(touch == nullptr) {
+        job->engine->share(&self.context);
+        self.context->seed_random(job->seed);
+        for(int k = job->num_inputs; k < MAX_ARGS; k++) self.context->bind_column(k, I32, nullptr);
+    }
+    self.has_partial = false;
+
+    uint32_t chunk;
+    while(!failed.load(std::memory_order_relaxed)) {
+        if(self.deque.pop(&chunk) == 0) {
+            if(run_chunk(self, chunk) < 0) failed.store(true, std::memory_order_relaxed);
+            continue;
+        }
+        if(touch != nullptr) break;
+
+        bool stolen = false;
+        for(size_t k = 0; k < self.victims.size() && !stolen; k++) {
+            stolen = self.deque.steal(workers[self.victims[k]].deque) == 0;
+        }
+        if(!stolen) break;
+    }
+
+    // Leave nothing behind for the next job after a failure
+    self.deque.assign(0, 0);
+}
+
+/*
+ * Run one chunk: point the columns at its instances, place it in the global
+ * instance order for RAND and either write its slice of the output or fold
+ * its reduction into the worker's partial. First touch jobs zero the
+ * chunk's slice of the buffer instead.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int WorkerPool::run_chunk(Worker& worker, uint32_t chunk) {
+    size_t first = (size_t)chunk * chunk_size;
+    size_t count = std::min(chunk_size, job->n - first);
+
+    if(touch != nullptr) {
+        memset(touch + first * sizeof(int32_t), 0, count * sizeof(int32_t));
+        return 0;
+    }
+
+    Column columns[MAX_ARGS];
+    for(int k = 0; k < job->num_inputs; k++) {
+        const int32_t *data = (const int32_t *)job->inputs[k].data;
+        columns[k].type = job->inputs[k].type;
+        columns[k].data = data != nullptr ? data + first : nullptr;
+    }
+
+    Engine& context = *worker.context;
+    context.set_first_instance(job->first_instance + first);
+    if(output != nullptr) return context.run_batch(columns, job->num_inputs, count, output + first);
+
+    ReduceValue value;
+    if(context.run_reduce(columns, job->num_inputs, count, reduce_op, &value) < 0) return -1;
+
+    bool is_float = job->engine->return_type() == KERNEL_F32 && reduce_op != REDUCE_COUNT;
+    if(worker.has_partial) combine(reduce_op, is_float, &worker.partial, value);
+    else worker.partial = value;
+    worker.has_partial = true;
+    return 0;
+}
+
+/*
+ * Number of chunks an n instance job is split into.
+ * Arguments:
+ *     size_t n - Number of instances.
+ *     size_t *size - Receives the instances per chunk.
+ * Returns:
+ *     size_t - Number of chunks, which fits the 32-bit deque ends.
+ */
+size_t WorkerPool::plan_chunks(size_t n, size_t *size) const {
+    *size = chunk_groups * ENGINE_MAX_WIDTH;
+    size_t chunks = (n + *size - 1) / *size;
+    while(chunks > UINT32_MAX) {
+        *size *= 2;
+        chunks = (n + *size - 1) / *size;
+    }
+    return chunks;
+}
+
+/*
+ * Split a job into chunks, deal them out in contiguous runs and wait for
+ * the workers to finish. The caller holds submit, so jobs run one at a
+ * time.
+ * Arguments:
+ *     const BatchJob& job - Job to run.
+ *     int32_t *output - Batch output, or nullptr to reduce with op.
+ *     ReduceOp op - Reduction each chunk computes.
+ * Returns:
+ *     int - 0 on success, -1 if the job is malformed or a chunk failed.
+ */
+int WorkerPool::dispatch(const BatchJob& job, int32_t *output, ReduceOp op) {
+    if(job.engine == nullptr && touch == nullptr) return -1;
+    if(job.num_inputs < 0 || job.num_inputs > MAX_ARGS) return -1;
+
+    std::unique_lock<std::mutex> guard(lock);
+    size_t chunks = plan_chunks(job.n, &chunk_size);
+
+    for(int i = 0; i < num_workers; i++) {
+        workers[i].deque.assign(chunks * i / num_workers, chunks * (i + 1) / num_workers);
+    }
+
+    this->job = &job;
+    this->output = output;
+    reduce_op = op;
+    failed.store(false);
+    running = num_workers;
+    generation++;
+    start.notify_all();
+
+    done.wait(guard, [&] { return running == 0; });
+    this->job = nullptr;
+    return failed.load() ? -1 : 0;
+}
+
+/*
+ * Run a job on every worker and write one result per instance.
+ * Arguments:
+ *     const BatchJob& job - Job to run.
+ *     void *output - Output buffer for n values of the kernel's return type.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int WorkerPool::run_batch(const BatchJob& job, void *output) {
+    std::lock_guard<std::mutex> guard(submit);
+    return dispatch(job, (int32_t *)output, REDUCE_SUM);
+}
+
+/*
+ * Run a job on every worker and reduce its results. Each worker keeps a
+ * partial of the chunks it ran, and the partials are merged here once all
+ * of them are done.
+ * Arguments:
+ *     const BatchJob& job - Job to run.
+ *     ReduceOp op - Aggregate to compute.
+ *     ReduceValue *result - Receives the aggregate.
+ * Returns:
+ *     int - 0 on success, -1 on failure or for a MIN, MAX or MEAN of no
+ *           instances.
+ */
+int WorkerPool::run_reduce(const BatchJob& job, ReduceOp op, ReduceValue *result) {
+    std::lock_guard<std::mutex> guard(submit);
+    ReduceOp chunk_op = op == REDUCE_MEAN ? REDUCE_SUM : op;
+    if(dispatch(job, nullptr, chunk_op) < 0) return -1;
+
+    bool is_float = job.engine->return_type() == KERNEL_F32 && op != REDUCE_COUNT;
+    ReduceValue total;
+    bool any = false;
+    for(int i = 0; i < num_workers; i++) {
+        if(!workers[i].has_partial) continue;
+        if(any) combine(chunk_op, is_float, &total, workers[i].partial);
+        else total = workers[i].partial;
+        any = true;
+    }
+
+    if(!any) {
+        if(op != REDUCE_SUM && op != REDUCE_COUNT) return -1;
+        if(is_float) total.f64 = 0;
+        else total.i64 = 0;
+    }
+
+    if(op == REDUCE_MEAN) {
+        result->f64 = (is_float ? total.f64 : (double)total.i64) / job.n;
+    } else {
+        *result = total;
+    }
+    return 0;
+}
+
+/*
+ * Zero a freshly allocated buffer of n 32-bit values from the workers that
+ * will process each part of it, so the kernel backs every page on that
+ * worker's node. Use it on input and output buffers before they are
+ * filled.
+ * Arguments:
+ *     void *buffer - Untouched buffer, e.g. from malloc() or mmap().
+ *     size_t n - Number of values.
+ * Returns:
+ *     int - 0 on success, -1 on failure.
+ */
+int WorkerPool::first_touch(void *buffer, size_t n) {
+    std::lock_guard<std::mutex> guard(submit);
+    BatchJob job = { nullptr, nullptr, 0, n, 0, 0 };
+
+    touch = (uint8_t *)buffer;
+    int status = dispatch(job, nullptr, REDUCE_SUM);
+    touch = nullptr;
+    return status;
+}
+
+/*
+ * Move the pages of a job's columns and output to the node whose workers
+ * start on them, for buffers that were already touched elsewhere. Does
+ * nothing on a single node.
+ * Arguments:
+ *     const BatchJob& job - Job about to run.
+ *     void *output - Its batch output, or nullptr.
+ * Returns:
+ *     int - 0 on success, -1 if the kernel refused to move some pages.
+ */
+int WorkerPool::place_job(const BatchJob& job, void *output) {
+    if(topology.nodes.size() < 2) return 0;
+
+    std::lock_guard<std::mutex> guard(submit);
+    size_t size;
+    size_t chunks = plan_chunks(job.n, &size);
+    int status = 0;
+
+    for(int i = 0, j; i < num_workers; i = j) {
+        // Workers [i, j) share a node and one span of the job
+        for(j = i; j < num_workers && workers[j].node == workers[i].node; j++) {}
+
+        size_t first = std::min(chunks * i / num_workers * size, job.n);
+        size_t last = std::min(chunks * j / num_workers * size, job.n);
+        int id = topology.node_ids[workers[i].node];
+
+        for(int k = 0; k < job.num_inputs; k++) {
+            const int32_t *data = (const int32_t *)job.inputs[k].data;
+            if(data != nullptr && bind_pages(data + first, (last - first) * sizeof(int32_t), id) < 0) status = -1;
+        }
+        if(output != nullptr && bind_pages((int32_t *)output + first, (last - first) * sizeof(int32_t), id) < 0) status = -1;
+    }
+
+    return status;
+}